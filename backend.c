@@ -0,0 +1,892 @@
+/*
+ * choose between several pipe hosts, balance sessions across them and
+ * fail over to the next one when a connection can not be made.
+ *
+ * the per-backend counters live in shared memory so that every forked
+ * session (see -L) sees the same round-robin position and connection
+ * counts.  the same goes for the health state, which is kept up to date
+ * by a checker process (see -H) and by the sessions themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "backend.h"
+#include "stats.h"
+#include "unixsock.h"
+
+
+/* a point on the consistent hash ring */
+typedef struct __nsc_ring_point_stru
+{
+   u_int32_t point;
+   u_int idx;
+} ring_t;
+
+
+static backend_t *backends = NULL;
+static u_int nbackends = 0;
+static u_int *rr_next = NULL; 		/* shared round-robin position */
+static ring_t *ring = NULL;
+static u_int *order = NULL; 		/* backends to try (and room to sort) */
+static backend_t *current = NULL; 	/* backend used by this session */
+static struct sockaddr_storage src_addr; /* -S, for -m and -N */
+static socklen_t src_len = 0;
+
+static u_int32_t backend_hash(const u_char *, size_t);
+static int backend_ring_cmp(const void *, const void *);
+static void backend_order(struct sockaddr_storage *);
+static void backend_order_down_last(void);
+static void backend_mark(backend_t *, int);
+static int backend_check(backend_t *);
+static int backend_check_reply(nsock_t *);
+static u_char *backend_unescape(u_char *);
+static int backend_resolve(u_char *, struct sockaddr_storage *, socklen_t *);
+static int backend_connect_next(backend_conn_t *);
+static void backend_failed(backend_t *, backend_t *);
+
+
+/*
+ * split up a comma separated list of hosts and build the shared table
+ */
+int
+backend_init(list)
+   u_char *list;
+{
+   u_char *copy, *p, *tok;
+   u_int i, v, n = 1;
+   char vname[1024];
+   
+   for (p = list; *p; p++)
+     if (*p == ',')
+       n++;
+   
+   if (!(copy = (u_char *)strdup((char *)list))
+       || !(backends = shared_alloc(n * sizeof(backend_t)))
+       || !(rr_next = shared_alloc(sizeof(u_int)))
+       || !(order = calloc(n * 2, sizeof(u_int))))
+     return -1;
+   
+   for (tok = (u_char *)strtok((char *)copy, ","); tok;
+	tok = (u_char *)strtok(NULL, ","))
+     {
+	if (*tok == '\0')
+	  continue;
+	backends[nbackends++].host = tok;
+     }
+   if (nbackends == 0)
+     return -1;
+   
+   /* -m and -N connect without libnsock so that they don't block, and
+    * look the pipe hosts up now rather than in the middle of things */
+   if (opts.mux || opts.flags & FLAG_DEMUX)
+     {
+	for (i = 0; i < nbackends; i++)
+	  if (backend_resolve(backends[i].host, &(backends[i].addr),
+			      &(backends[i].addr_len)) == -1)
+	    return -1;
+	if (opts.pshost
+	    && backend_resolve(opts.pshost, &src_addr, &src_len) == -1)
+	  return -1;
+     }
+   
+   /* the hash ring is only needed for hash balancing */
+   if (opts.balance != BALANCE_HASH)
+     return nbackends;
+   
+   if (!(ring = calloc(nbackends * BACKEND_VNODES, sizeof(ring_t))))
+     return -1;
+   for (i = 0; i < nbackends; i++)
+     for (v = 0; v < BACKEND_VNODES; v++)
+       {
+	  snprintf(vname, sizeof(vname), "%s#%u", backends[i].host, v);
+	  ring[i * BACKEND_VNODES + v].point = backend_hash((u_char *)vname, strlen(vname));
+	  ring[i * BACKEND_VNODES + v].idx = i;
+       }
+   qsort(ring, nbackends * BACKEND_VNODES, sizeof(ring_t), backend_ring_cmp);
+   return nbackends;
+}
+
+
+/*
+ * turn a -b argument into a balancing policy
+ */
+int
+backend_parse_policy(str)
+   u_char *str;
+{
+   if (!strcmp((char *)str, "rr"))
+     return BALANCE_RR;
+   if (!strcmp((char *)str, "lc"))
+     return BALANCE_LC;
+   if (!strcmp((char *)str, "hash"))
+     return BALANCE_HASH;
+   return -1;
+}
+
+
+/*
+ * parse -H <secs>[:<fall>[:<rise>]]
+ */
+int
+backend_parse_check(str)
+   u_char *str;
+{
+   char *p;
+   
+   opts.check_interval = strtoul((char *)str, &p, 10);
+   opts.check_fall = CHECK_FALL;
+   opts.check_rise = CHECK_RISE;
+   if (*p == ':')
+     opts.check_fall = strtoul(p + 1, &p, 10);
+   if (*p == ':')
+     opts.check_rise = strtoul(p + 1, &p, 10);
+   if (*p != '\0'
+       || opts.check_interval == 0
+       || opts.check_fall == 0
+       || opts.check_rise == 0)
+     return -1;
+   return 0;
+}
+
+
+/*
+ * parse -E <send>[|<expect>], either part may be empty
+ */
+int
+backend_parse_expect(str)
+   u_char *str;
+{
+   u_char *copy, *bar;
+   
+   if (!(copy = (u_char *)strdup((char *)str)))
+     return -1;
+   if ((bar = (u_char *)strchr((char *)copy, '|')))
+     {
+	*bar++ = '\0';
+	if (*bar)
+	  opts.check_expect = backend_unescape(bar);
+     }
+   if (*copy)
+     opts.check_send = backend_unescape(copy);
+   return 0;
+}
+
+
+/*
+ * connect to the best backend, trying the others in turn if that fails.
+ * the client address is used for hash balancing and may be NULL.
+ */
+nsock_t *
+backend_connect(cli)
+   struct sockaddr_storage *cli;
+{
+   backend_t *be;
+   nsock_t *ns;
+   u_int i;
+   
+   backend_order(cli);
+   for (i = 0; i < nbackends; i++)
+     {
+	be = &backends[order[i]];
+	if ((ns = connect_to_host(opts.pshost, be->host, 1)))
+	  {
+	     SHARED_INC(be->active);
+	     SHARED_INC(be->total);
+	     current = be;
+	     backend_mark(be, 1);
+	     return ns;
+	  }
+	backend_failed(be, i + 1 < nbackends ? &backends[order[i + 1]] : NULL);
+     }
+   return NULL;
+}
+
+
+/*
+ * start connecting to the best backend without waiting for it.  the
+ * caller waits for bc->sd to become writable (or for bc->deadline) and
+ * then asks backend_connect_check() how it went.  returns -1 if no
+ * connection could even be started.
+ */
+int
+backend_connect_start(bc, cli)
+   backend_conn_t *bc;
+   struct sockaddr_storage *cli;
+{
+   memset(bc, 0, sizeof(backend_conn_t));
+   bc->sd = -1;
+   if (!(bc->order = malloc(nbackends * sizeof(u_int))))
+     return -1;
+   backend_order(cli);
+   memcpy(bc->order, order, nbackends * sizeof(u_int));
+   if (backend_connect_next(bc) == -1)
+     {
+	backend_connect_abort(bc);
+	return -1;
+     }
+   return 0;
+}
+
+
+/*
+ * see how a connection started by backend_connect_start() went.  returns
+ * it once it is up.  otherwise NULL, with bc->sd still set while this
+ * or the next backend is being tried, or -1 once they all failed.  the
+ * backend is taken with backend_detach() as after backend_connect().
+ */
+nsock_t *
+backend_connect_check(bc)
+   backend_conn_t *bc;
+{
+   struct sockaddr_storage peer;
+   socklen_t len = sizeof(int), plen = sizeof(peer);
+   backend_t *be = bc->be;
+   u_int ns_errno;
+   nsock_t *ns;
+   int err = 0;
+   
+   if (getsockopt(bc->sd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+     err = errno;
+   
+   /* no error and no peer yet is still connecting */
+   if (!err
+       && getpeername(bc->sd, (struct sockaddr *)&peer, &plen) == -1)
+     {
+	if (stats_now() < bc->deadline)
+	  return NULL;
+	err = ETIMEDOUT;
+     }
+   
+   if (!err
+       && (ns = nsock_new(be->addr.ss_family, SOCK_STREAM, 0, &ns_errno)))
+     {
+	if (ns->sd != -1)
+	  close(ns->sd);
+	ns->sd = bc->sd;
+	memcpy(&(ns->inet_tin), &(be->addr), sizeof(be->addr));
+	bc->sd = -1;
+	backend_connect_abort(bc);
+	
+	SHARED_INC(be->active);
+	SHARED_INC(be->total);
+	current = be;
+	backend_mark(be, 1);
+	return ns;
+     }
+   
+   close(bc->sd);
+   bc->sd = -1;
+   if (opts.verbosity > 1)
+     fprintf(stderr, "pipe host %s: %s\n", be->host,
+	     strerror(err ? err : ENOMEM));
+   backend_failed(be, bc->next < nbackends ? &backends[bc->order[bc->next]] : NULL);
+   if (backend_connect_next(bc) == -1)
+     {
+	free(bc->order);
+	bc->order = NULL;
+     }
+   return NULL;
+}
+
+
+/*
+ * give up on a connection being made
+ */
+void
+backend_connect_abort(bc)
+   backend_conn_t *bc;
+{
+   if (bc->sd != -1)
+     close(bc->sd);
+   bc->sd = -1;
+   free(bc->order);
+   bc->order = NULL;
+}
+
+
+/*
+ * this session is done with its backend
+ */
+void
+backend_release(void)
+{
+   backend_put(current);
+   current = NULL;
+}
+
+
+/*
+ * for callers juggling several pipe host connections at once.  takes
+ * over the backend of the last backend_connect(), which must later be
+ * handed to backend_put().
+ */
+backend_t *
+backend_detach(void)
+{
+   backend_t *be = current;
+   
+   current = NULL;
+   return be;
+}
+
+
+void
+backend_put(be)
+   backend_t *be;
+{
+   if (be)
+     SHARED_DEC(be->active);
+}
+
+
+/*
+ * take the list made by backend_init() out of the way so another can
+ * be set up.  it comes back with backend_restore().
+ */
+backend_set_t *
+backend_save(void)
+{
+   backend_set_t *set;
+   
+   if (!(set = calloc(1, sizeof(backend_set_t))))
+     return NULL;
+   set->backends = backends;
+   set->nbackends = nbackends;
+   set->rr_next = rr_next;
+   set->ring = ring;
+   set->order = order;
+   
+   backends = NULL;
+   nbackends = 0;
+   rr_next = NULL;
+   ring = NULL;
+   order = NULL;
+   return set;
+}
+
+
+void
+backend_restore(set)
+   backend_set_t *set;
+{
+   backend_set_t none;
+   
+   if (!set)
+     {
+	memset(&none, 0, sizeof(none));
+	set = &none;
+     }
+   backends = set->backends;
+   nbackends = set->nbackends;
+   rr_next = set->rr_next;
+   ring = (ring_t *)set->ring;
+   order = set->order;
+   current = NULL;
+}
+
+
+/*
+ * add the per backend numbers to a metrics page
+ */
+void
+backend_print_metrics(fp)
+   FILE *fp;
+{
+   u_int i;
+   
+   if (nbackends == 0)
+     return;
+   
+   fprintf(fp,
+	   "# HELP nsc_backend_sessions_active Sessions currently using each pipe host.\n"
+	   "# TYPE nsc_backend_sessions_active gauge\n");
+   for (i = 0; i < nbackends; i++)
+     fprintf(fp, "nsc_backend_sessions_active{backend=\"%s\"} %u\n",
+	     backends[i].host, backends[i].active);
+   fprintf(fp,
+	   "# HELP nsc_backend_sessions_total Sessions piped to each pipe host.\n"
+	   "# TYPE nsc_backend_sessions_total counter\n");
+   for (i = 0; i < nbackends; i++)
+     fprintf(fp, "nsc_backend_sessions_total{backend=\"%s\"} %lu\n",
+	     backends[i].host, backends[i].total);
+   fprintf(fp,
+	   "# HELP nsc_backend_failures_total Failed connections and checks for each pipe host.\n"
+	   "# TYPE nsc_backend_failures_total counter\n");
+   for (i = 0; i < nbackends; i++)
+     fprintf(fp, "nsc_backend_failures_total{backend=\"%s\"} %lu\n",
+	     backends[i].host, backends[i].failures);
+   if (opts.check_interval == 0)
+     return;
+   fprintf(fp,
+	   "# HELP nsc_backend_up Whether each pipe host is passing its checks.\n"
+	   "# TYPE nsc_backend_up gauge\n");
+   for (i = 0; i < nbackends; i++)
+     fprintf(fp, "nsc_backend_up{backend=\"%s\"} %u\n",
+	     backends[i].host, !backends[i].down);
+}
+
+
+/*
+ * start a process that checks on the backends every so often.
+ * it goes away by itself once the parent does.  unused_sd is closed
+ * in the checker.
+ */
+pid_t
+backend_start_checks(unused_sd)
+   int unused_sd;
+{
+   pid_t cpid, ppid = getpid(), *pids;
+   u_int64_t start, now;
+   u_int i;
+   int status;
+   
+   if ((cpid = fork()) != 0)
+     return cpid;
+   close(unused_sd);
+   if (!(pids = malloc(nbackends * sizeof(pid_t))))
+     exit(1);
+   
+   /* a check should never take longer than the interval, and failed
+    * connections are reported as state changes rather than errors */
+   if (opts.connect_timeout == 0 || opts.connect_timeout > opts.check_interval)
+     opts.connect_timeout = opts.check_interval;
+   signal(SIGCHLD, SIG_DFL);
+   
+   /* every backend is checked at once, each in a process of its own
+    * that is killed if it runs past the interval.  dead hosts then
+    * can't stretch a round past -H for the others */
+   while (getppid() == ppid)
+     {
+	start = stats_now();
+	for (i = 0; i < nbackends; i++)
+	  if ((pids[i] = fork()) == 0)
+	    {
+	       opts.verbosity = 0;
+	       alarm(opts.check_interval);
+	       exit(backend_check(&backends[i]) ? 0 : 1);
+	    }
+	for (i = 0; i < nbackends; i++)
+	  {
+	     if (pids[i] == -1 || waitpid(pids[i], &status, 0) == -1)
+	       continue;
+	     if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	       backend_mark(&backends[i], 1);
+	     else
+	       {
+		  SHARED_INC(backends[i].failures);
+		  backend_mark(&backends[i], 0);
+	       }
+	  }
+	if ((now = stats_now()) < start + (u_int64_t)opts.check_interval * 1000000)
+	  stats_sleep(start + (u_int64_t)opts.check_interval * 1000000 - now);
+     }
+   exit(0);
+}
+
+
+/*
+ * record the outcome of a check or a connection attempt.  only the
+ * checker brings a backend back (after enough good checks in a row),
+ * unless a session manages to connect to it anyway.
+ */
+static void
+backend_mark(be, ok)
+   backend_t *be;
+   int ok;
+{
+   /* state is only tracked when checks are on */
+   if (opts.check_interval == 0)
+     return;
+   
+   if (ok)
+     {
+	be->fails = 0;
+	if (be->down
+	    && (current || ++be->oks >= opts.check_rise))
+	  {
+	     be->down = 0;
+	     be->oks = 0;
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "pipe host %s is up\n", be->host);
+	  }
+	return;
+     }
+   
+   be->oks = 0;
+   if (SHARED_INC(be->fails) + 1 >= opts.check_fall
+       && !be->down)
+     {
+	be->down = 1;
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "pipe host %s is down\n", be->host);
+     }
+}
+
+
+/*
+ * see if a backend accepts connections (and answers properly)
+ */
+static int
+backend_check(be)
+   backend_t *be;
+{
+   nsock_t *ns;
+   int ok = 1;
+   
+   if (!(ns = connect_to_host(opts.pshost, be->host, 1)))
+     return 0;
+   if ((opts.check_send || opts.check_expect)
+       && backend_check_reply(ns) == -1)
+     ok = 0;
+   nsock_close(ns);
+   return ok;
+}
+
+
+/*
+ * send the check string and look for the expected reply
+ */
+static int
+backend_check_reply(ns)
+   nsock_t *ns;
+{
+   char buf[1024];
+   size_t have = 0;
+   ssize_t len;
+   fd_set rd;
+   struct timeval tv;
+   
+   if (opts.check_send)
+     {
+#ifdef HAVE_SSL
+	if (ns->opt & NSF_USE_SSL)
+	  len = SSL_write(ns->ns_ssl.ssl, opts.check_send, strlen((char *)opts.check_send));
+	else
+#endif
+	  len = write(ns->sd, opts.check_send, strlen((char *)opts.check_send));
+	if (len != (ssize_t)strlen((char *)opts.check_send))
+	  return -1;
+     }
+   if (!opts.check_expect)
+     return 0;
+   
+   tv.tv_sec = opts.check_interval;
+   tv.tv_usec = 0;
+   while (have < sizeof(buf) - 1)
+     {
+#ifdef HAVE_SSL
+	if (!(ns->opt & NSF_USE_SSL) || SSL_pending(ns->ns_ssl.ssl) == 0)
+#endif
+	  {
+	     FD_ZERO(&rd);
+	     FD_SET(ns->sd, &rd);
+	     /* linux counts the timeout down, others just reuse it */
+	     if (select(ns->sd + 1, &rd, NULL, NULL, &tv) < 1)
+	       return -1;
+	  }
+#ifdef HAVE_SSL
+	if (ns->opt & NSF_USE_SSL)
+	  len = SSL_read(ns->ns_ssl.ssl, buf + have, sizeof(buf) - 1 - have);
+	else
+#endif
+	  len = read(ns->sd, buf + have, sizeof(buf) - 1 - have);
+	if (len < 1)
+	  return -1;
+	have += len;
+	buf[have] = '\0';
+	if (strstr(buf, (char *)opts.check_expect))
+	  return 0;
+     }
+   return -1;
+}
+
+
+/*
+ * handle \r, \n, \t and \\ in check strings (in place)
+ */
+static u_char *
+backend_unescape(str)
+   u_char *str;
+{
+   u_char *in, *out;
+   
+   for (in = out = str; *in; in++)
+     {
+	if (*in == '\\' && *(in + 1))
+	  {
+	     switch (*++in)
+	       {
+		case 'r':
+		  *out++ = '\r';
+		  break;
+		case 'n':
+		  *out++ = '\n';
+		  break;
+		case 't':
+		  *out++ = '\t';
+		  break;
+		default:
+		  *out++ = *in;
+		  break;
+	       }
+	  }
+	else
+	  *out++ = *in;
+     }
+   *out = '\0';
+   return str;
+}
+
+
+/*
+ * start connecting to the next backend in bc's order that will have it
+ */
+static int
+backend_connect_next(bc)
+   backend_conn_t *bc;
+{
+   backend_t *be;
+   int sd, fl;
+   
+   while (bc->next < nbackends)
+     {
+	be = &backends[bc->order[bc->next++]];
+	if ((sd = socket(be->addr.ss_family, SOCK_STREAM, 0)) != -1)
+	  {
+	     if ((fl = fcntl(sd, F_GETFL)) != -1)
+	       fcntl(sd, F_SETFL, fl | O_NONBLOCK);
+	     if ((!src_len || src_addr.ss_family != be->addr.ss_family
+		  || bind(sd, (struct sockaddr *)&src_addr, src_len) == 0)
+		 && (connect(sd, (struct sockaddr *)&(be->addr), be->addr_len) == 0
+		     || errno == EINPROGRESS))
+	       {
+		  bc->sd = sd;
+		  bc->be = be;
+		  bc->deadline = stats_now()
+		    + (u_int64_t)(opts.connect_timeout ? opts.connect_timeout
+				  : BACKEND_CONNECT_WAIT) * 1000000;
+		  return 0;
+	       }
+	     if (opts.verbosity > 1)
+	       fprintf(stderr, "pipe host %s: %s\n", be->host, strerror(errno));
+	     close(sd);
+	  }
+	backend_failed(be, bc->next < nbackends ? &backends[bc->order[bc->next]] : NULL);
+     }
+   return -1;
+}
+
+
+/*
+ * count a connection to be that failed, and say which is next
+ */
+static void
+backend_failed(be, next)
+   backend_t *be, *next;
+{
+   SHARED_INC(be->failures);
+   STAT_INC(pipe_connect_failures);
+   backend_mark(be, 0);
+   if (opts.verbosity > 0 && next)
+     fprintf(stderr, "pipe host %s failed, trying %s\n",
+	     be->host, next->host);
+}
+
+
+/*
+ * look up <host>:<port> (or a unix socket path) for -m and -N.  the
+ * port may be left off a source address.
+ */
+static int
+backend_resolve(host, ss, lenp)
+   u_char *host;
+   struct sockaddr_storage *ss;
+   socklen_t *lenp;
+{
+   struct addrinfo hints, *ai;
+   char name[1024], *port, *p = name;
+   int err;
+   
+   if (unixsock_is(host))
+     {
+	if (unixsock_addr(host, ss, lenp) == 0)
+	  return 0;
+	fprintf(stderr, "%s: %s\n", host, strerror(errno));
+	return -1;
+     }
+   
+   snprintf(name, sizeof(name), "%s", host);
+   if ((port = strrchr(name, ':')))
+     *port++ = '\0';
+   if (*p == '[' && p[strlen(p) - 1] == ']')
+     {
+	p[strlen(p) - 1] = '\0';
+	p++;
+     }
+   
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = opts.family;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_NUMERICSERV;
+   if ((err = getaddrinfo(*p ? p : NULL, port && *port ? port : "0",
+			  &hints, &ai)) != 0)
+     {
+	fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+	return -1;
+     }
+   memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+   *lenp = ai->ai_addrlen;
+   freeaddrinfo(ai);
+   return 0;
+}
+
+
+/*
+ * fill in the order in which the backends should be tried
+ */
+static void
+backend_order(cli)
+   struct sockaddr_storage *cli;
+{
+   u_int i, j, n = 0, first, best;
+   u_int32_t key;
+   u_char *addr = NULL;
+   size_t alen = 0;
+   
+   first = SHARED_INC(*rr_next) % nbackends;
+   
+   /* hash on the client's address (not the port) */
+   if (opts.balance == BALANCE_HASH && cli)
+     {
+	if (cli->ss_family == AF_INET)
+	  {
+	     addr = (u_char *)&((struct sockaddr_in *)cli)->sin_addr;
+	     alen = sizeof(struct in_addr);
+	  }
+#ifdef INET6
+	else if (cli->ss_family == AF_INET6)
+	  {
+	     addr = (u_char *)&((struct sockaddr_in6 *)cli)->sin6_addr;
+	     alen = sizeof(struct in6_addr);
+	  }
+#endif
+     }
+   if (addr)
+     {
+	u_int lo = 0, hi = nbackends * BACKEND_VNODES, mid;
+	
+	/* find the first point at or after the key, then walk the ring */
+	key = backend_hash(addr, alen);
+	while (lo < hi)
+	  {
+	     mid = (lo + hi) / 2;
+	     if (ring[mid].point < key)
+	       lo = mid + 1;
+	     else
+	       hi = mid;
+	  }
+	for (i = 0; n < nbackends && i < nbackends * BACKEND_VNODES; i++)
+	  {
+	     best = ring[(lo + i) % (nbackends * BACKEND_VNODES)].idx;
+	     for (j = 0; j < n; j++)
+	       if (order[j] == best)
+		 break;
+	     if (j == n)
+	       order[n++] = best;
+	  }
+	backend_order_down_last();
+	return;
+     }
+   
+   /* least connections starts its search at the round-robin position
+    * so that ties are spread out */
+   if (opts.balance == BALANCE_LC)
+     {
+	best = first;
+	for (i = 1; i < nbackends; i++)
+	  {
+	     j = (first + i) % nbackends;
+	     if ((backends[best].down && !backends[j].down)
+		 || (backends[j].down == backends[best].down
+		     && backends[j].active < backends[best].active))
+	       best = j;
+	  }
+	first = best;
+     }
+   
+   for (i = 0; i < nbackends; i++)
+     order[i] = (first + i) % nbackends;
+   backend_order_down_last();
+}
+
+
+/*
+ * move backends that are down to the end of the list, keeping the order
+ * otherwise.  they are still tried as a last resort.
+ */
+static void
+backend_order_down_last(void)
+{
+   u_int i, n = 0, *tmp;
+   
+   if (opts.check_interval == 0)
+     return;
+   
+   tmp = order + nbackends;
+   for (i = 0; i < nbackends; i++)
+     if (!backends[order[i]].down)
+       tmp[n++] = order[i];
+   for (i = 0; i < nbackends; i++)
+     if (backends[order[i]].down)
+       tmp[n++] = order[i];
+   memcpy(order, tmp, nbackends * sizeof(u_int));
+}
+
+
+/*
+ * FNV-1a with a final mix so that similar names spread around the ring
+ */
+static u_int32_t
+backend_hash(data, len)
+   const u_char *data;
+   size_t len;
+{
+   u_int32_t h = 2166136261U;
+   
+   while (len--)
+     {
+	h ^= *data++;
+	h *= 16777619U;
+     }
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35U;
+   h ^= h >> 16;
+   return h;
+}
+
+
+static int
+backend_ring_cmp(a, b)
+   const void *a, *b;
+{
+   const ring_t *ra = a, *rb = b;
+   
+   if (ra->point < rb->point)
+     return -1;
+   return ra->point > rb->point;
+}
@@ -0,0 +1,74 @@
+/*
+ * pipe host (backend) selection
+ */
+#ifndef __nsc_backend_h
+#define __nsc_backend_h
+
+#define BALANCE_RR 	0x00 	/* round-robin */
+#define BALANCE_LC 	0x01 	/* least connections */
+#define BALANCE_HASH 	0x02 	/* consistent hash on client address */
+
+/* virtual nodes each backend gets on the hash ring */
+#define BACKEND_VNODES 	64
+
+/* secs a -m/-N connection may take when -w doesn't say */
+#define BACKEND_CONNECT_WAIT 	10
+
+/* health check defaults (see -H) */
+#define CHECK_FALL 	3 	/* failures in a row before a backend is down */
+#define CHECK_RISE 	2 	/* successes in a row before it is up again */
+
+typedef struct __nsc_backend_stru
+{
+   u_char *host; 		/* host:port to pipe data with */
+   
+   /* these live in shared memory and are updated by every session */
+   u_int active; 		/* sessions currently using this backend */
+   u_long total; 		/* sessions ever piped to this backend */
+   u_long failures; 		/* failed connection attempts */
+   
+   u_int down; 			/* no new sessions while set */
+   u_int fails; 		/* consecutive failures */
+   u_int oks; 			/* consecutive successful checks while down */
+   
+   struct sockaddr_storage addr; /* looked up once for -m and -N */
+   socklen_t addr_len;
+} backend_t;
+
+/* a pipe host connection being made without blocking (-m/-N) */
+typedef struct __nsc_backend_conn_stru
+{
+   int sd; 			/* -1 once every pipe host failed */
+   backend_t *be; 		/* the one being tried */
+   u_int *order; 		/* and the ones to try after it */
+   u_int next;
+   u_int64_t deadline;
+} backend_conn_t;
+
+/* one pipe host list, for processes that serve several (-F) */
+typedef struct __nsc_backend_set_stru
+{
+   backend_t *backends;
+   u_int nbackends;
+   u_int *rr_next;
+   void *ring;
+   u_int *order;
+} backend_set_t;
+
+int backend_init(u_char *);
+int backend_parse_policy(u_char *);
+int backend_parse_check(u_char *);
+int backend_parse_expect(u_char *);
+nsock_t *backend_connect(struct sockaddr_storage *);
+int backend_connect_start(backend_conn_t *, struct sockaddr_storage *);
+nsock_t *backend_connect_check(backend_conn_t *);
+void backend_connect_abort(backend_conn_t *);
+void backend_release(void);
+backend_t *backend_detach(void);
+void backend_put(backend_t *);
+backend_set_t *backend_save(void);
+void backend_restore(backend_set_t *);
+void backend_print_metrics(FILE *);
+pid_t backend_start_checks(int);
+
+#endif
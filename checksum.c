@@ -0,0 +1,178 @@
+/*
+ * running CRC32C of what is relayed.
+ *
+ * with -D everything read from either side is summed as it lands in
+ * the buffers, after any decompression or telnet options are taken out,
+ * so the nsc at each end of a transfer prints the same sums.  that saves
+ * reading a large file again to check it arrived intact.
+ *
+ * CRC32C has instructions of its own on x86 (SSE 4.2) and armv8, which
+ * keep up with the link.  elsewhere it is done eight bytes at a time
+ * from tables.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "checksum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CSUM_HW
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CSUM_HW
+#endif
+
+#define CSUM_POLY 	0x82f63b78 	/* reversed Castagnoli */
+
+
+csum_t csum[2];
+
+static u_int32_t csum_table[8][256];
+static u_char csum_hw = 0;
+
+static u_int32_t csum_sw(u_int32_t, u_char *, size_t);
+#ifdef HAVE_CSUM_HW
+static u_int32_t csum_hw_crc(u_int32_t, u_char *, size_t);
+#endif
+
+
+/*
+ * build the tables, or find the instructions
+ */
+void
+csum_init(void)
+{
+   u_int32_t crc;
+   u_int i, j;
+
+   memset(csum, 0, sizeof(csum));
+   csum[CSUM_SENT].crc = csum[CSUM_RECV].crc = 0xffffffff;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+   __builtin_cpu_init();
+   csum_hw = __builtin_cpu_supports("sse4.2") != 0;
+#elif defined(HAVE_CSUM_HW)
+   csum_hw = 1;
+#endif
+   if (csum_hw)
+     return;
+
+   for (i = 0; i < 256; i++)
+     {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	  crc = crc & 1 ? (crc >> 1) ^ CSUM_POLY : crc >> 1;
+	csum_table[0][i] = crc;
+     }
+   for (i = 0; i < 256; i++)
+     for (j = 1; j < 8; j++)
+       csum_table[j][i] = (csum_table[j - 1][i] >> 8)
+	 ^ csum_table[0][csum_table[j - 1][i] & 0xff];
+}
+
+
+/*
+ * add some data read in one direction
+ */
+void
+csum_update(c, buf, len)
+   csum_t *c;
+   u_char *buf;
+   size_t len;
+{
+   c->bytes += len;
+#ifdef HAVE_CSUM_HW
+   if (csum_hw)
+     {
+	c->crc = csum_hw_crc(c->crc, buf, len);
+	return;
+     }
+#endif
+   c->crc = csum_sw(c->crc, buf, len);
+}
+
+
+void
+csum_report(void)
+{
+   fprintf(stderr, "crc32c: sent %08x (%llu bytes), received %08x (%llu bytes)\n",
+	   csum[CSUM_SENT].crc ^ 0xffffffff,
+	   (unsigned long long)csum[CSUM_SENT].bytes,
+	   csum[CSUM_RECV].crc ^ 0xffffffff,
+	   (unsigned long long)csum[CSUM_RECV].bytes);
+}
+
+
+/*
+ * slicing by eight
+ */
+static u_int32_t
+csum_sw(crc, p, len)
+   u_int32_t crc;
+   u_char *p;
+   size_t len;
+{
+   u_int32_t lo, hi;
+
+   while (len >= 8)
+     {
+	lo = crc ^ ((u_int32_t)p[0] | (u_int32_t)p[1] << 8
+		    | (u_int32_t)p[2] << 16 | (u_int32_t)p[3] << 24);
+	hi = (u_int32_t)p[4] | (u_int32_t)p[5] << 8
+	  | (u_int32_t)p[6] << 16 | (u_int32_t)p[7] << 24;
+	crc = csum_table[7][lo & 0xff] ^ csum_table[6][(lo >> 8) & 0xff]
+	  ^ csum_table[5][(lo >> 16) & 0xff] ^ csum_table[4][lo >> 24]
+	  ^ csum_table[3][hi & 0xff] ^ csum_table[2][(hi >> 8) & 0xff]
+	  ^ csum_table[1][(hi >> 16) & 0xff] ^ csum_table[0][hi >> 24];
+	p += 8;
+	len -= 8;
+     }
+   while (len-- > 0)
+     crc = (crc >> 8) ^ csum_table[0][(crc ^ *p++) & 0xff];
+   return crc;
+}
+
+
+#ifdef HAVE_CSUM_HW
+/*
+ * eight bytes per instruction, the tail a byte at a time
+ */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+#endif
+static u_int32_t
+csum_hw_crc(crc, p, len)
+   u_int32_t crc;
+   u_char *p;
+   size_t len;
+{
+   u_int64_t v, c = crc;
+
+   while (len >= 8)
+     {
+	memcpy(&v, p, 8);
+#if defined(__x86_64__)
+	c = _mm_crc32_u64(c, v);
+#else
+	c = __crc32cd((u_int32_t)c, v);
+#endif
+	p += 8;
+	len -= 8;
+     }
+   crc = (u_int32_t)c;
+   while (len-- > 0)
+#if defined(__x86_64__)
+     crc = _mm_crc32_u8(crc, *p++);
+#else
+     crc = __crc32cb(crc, *p++);
+#endif
+   return crc;
+}
+#endif
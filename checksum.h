@@ -0,0 +1,22 @@
+/*
+ * running CRC32C of what is relayed (-D)
+ */
+#ifndef __nsc_checksum_h
+#define __nsc_checksum_h
+
+#define CSUM_SENT 	0 	/* read locally, sent on the connection */
+#define CSUM_RECV 	1 	/* read from the connection */
+
+typedef struct __nsc_csum_stru
+{
+   u_int32_t crc;
+   u_int64_t bytes;
+} csum_t;
+
+extern csum_t csum[2];
+
+void csum_init(void);
+void csum_update(csum_t *, u_char *, size_t);
+void csum_report(void);
+
+#endif
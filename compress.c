@@ -0,0 +1,369 @@
+/*
+ * compressed links between two copies of nsc.
+ *
+ * each side starts by sending CODEC_MAGIC and the algorithm, then
+ * frames made of an 8 byte header (payload length, decoded length) and
+ * the compressed data.  a frame is produced every time the relay is
+ * able to write, so interactive traffic goes out right away while bulk
+ * traffic naturally gets bigger frames when the link is busy.  both
+ * algorithms keep their history between frames, so small frames still
+ * compress well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "compress.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+static void codec_put32(u_char *, u_int32_t);
+static u_int32_t codec_get32(u_char *);
+
+
+/*
+ * parse <alg>[:<level>]
+ */
+int
+codec_parse(spec, algp, levelp)
+   u_char *spec;
+   u_int *algp;
+   int *levelp;
+{
+   char *colon, *end;
+   
+   *algp = CODEC_NONE;
+   colon = strchr((char *)spec, ':');
+   if (colon)
+     *colon = '\0';
+   
+#ifdef HAVE_LZ4
+   if (!strcmp((char *)spec, "lz4"))
+     {
+	*algp = CODEC_LZ4;
+	*levelp = 1; 		/* lz4 acceleration, higher is faster */
+     }
+#endif
+#ifdef HAVE_ZSTD
+   if (!strcmp((char *)spec, "zstd"))
+     {
+	*algp = CODEC_ZSTD;
+	*levelp = 3;
+     }
+#endif
+   
+   if (colon)
+     *colon = ':';
+   if (*algp == CODEC_NONE)
+     return -1;
+   
+   if (colon)
+     {
+	*levelp = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || *levelp < 1)
+	  return -1;
+     }
+   return 0;
+}
+
+
+/*
+ * set up one direction of a compressed link
+ */
+codec_t *
+codec_new(alg, level, encode)
+   u_int alg;
+   int level;
+   u_char encode;
+{
+   codec_t *c;
+   
+   if (!(c = calloc(1, sizeof(codec_t)))
+       || !(c->wire = malloc(CODEC_WIRE_SZ)))
+     goto fail;
+   c->alg = alg;
+   c->level = level;
+   c->encode = encode;
+   
+   switch (alg)
+     {
+#ifdef HAVE_LZ4
+      case CODEC_LZ4:
+	if (!(c->ring = malloc(CODEC_RING_SZ)))
+	  goto fail;
+	if (encode)
+	  c->ctx = LZ4_createStream();
+	else
+	  c->ctx = LZ4_createStreamDecode();
+	break;
+#endif
+#ifdef HAVE_ZSTD
+      case CODEC_ZSTD:
+	if (encode)
+	  {
+	     if ((c->ctx = ZSTD_createCCtx()))
+	       ZSTD_CCtx_setParameter(c->ctx, ZSTD_c_compressionLevel, level);
+	  }
+	else
+	  c->ctx = ZSTD_createDCtx();
+	break;
+#endif
+     }
+   if (!c->ctx)
+     goto fail;
+   
+   /* the magic goes out before any data */
+   if (encode)
+     {
+	memcpy(c->wire, CODEC_MAGIC, CODEC_MAGIC_LEN - 1);
+	c->wire[CODEC_MAGIC_LEN - 1] = (u_char)alg;
+	c->len = CODEC_MAGIC_LEN;
+	c->started = 1;
+     }
+   return c;
+   
+ fail:
+   codec_free(c);
+   return NULL;
+}
+
+
+void
+codec_free(c)
+   codec_t *c;
+{
+   if (!c)
+     return;
+   if (c->ctx)
+     {
+	switch (c->alg)
+	  {
+#ifdef HAVE_LZ4
+	   case CODEC_LZ4:
+	     if (c->encode)
+	       LZ4_freeStream(c->ctx);
+	     else
+	       LZ4_freeStreamDecode(c->ctx);
+	     break;
+#endif
+#ifdef HAVE_ZSTD
+	   case CODEC_ZSTD:
+	     if (c->encode)
+	       ZSTD_freeCCtx(c->ctx);
+	     else
+	       ZSTD_freeDCtx(c->ctx);
+	     break;
+#endif
+	  }
+     }
+   if (c->ring)
+     free(c->ring);
+   if (c->wire)
+     free(c->wire);
+   free(c);
+}
+
+
+/*
+ * compress a block (at most NSOCK_IOP_BLOCKSZ) into a new frame at the
+ * end of the wire buffer.  the caller only does this once the previous
+ * frame has been sent.
+ */
+int
+codec_encode(c, in, len)
+   codec_t *c;
+   u_char *in;
+   size_t len;
+{
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+   u_char *out = c->wire + c->len + CODEC_HDR_LEN;
+   size_t room = CODEC_WIRE_SZ - c->len - CODEC_HDR_LEN;
+#endif
+   size_t clen = 0;
+   
+   if (len == 0)
+     return 0;
+   
+   switch (c->alg)
+     {
+#ifdef HAVE_LZ4
+      case CODEC_LZ4:
+	  {
+	     int ret;
+	     
+	     /* wrap the same way the decoder will */
+	     if (c->pos + len > CODEC_RING_SZ)
+	       c->pos = 0;
+	     memcpy(c->ring + c->pos, in, len);
+	     ret = LZ4_compress_fast_continue(c->ctx, (char *)c->ring + c->pos,
+					      (char *)out, len, room, c->level);
+	     if (ret <= 0)
+	       return -1;
+	     c->pos += len;
+	     clen = ret;
+	  }
+	break;
+#endif
+#ifdef HAVE_ZSTD
+      case CODEC_ZSTD:
+	  {
+	     ZSTD_inBuffer zin;
+	     ZSTD_outBuffer zout;
+	     size_t left;
+	     
+	     zin.src = in;
+	     zin.size = len;
+	     zin.pos = 0;
+	     zout.dst = out;
+	     zout.size = room;
+	     zout.pos = 0;
+	     /* flush, so everything so far can be decoded on the other end */
+	     do
+	       {
+		  left = ZSTD_compressStream2(c->ctx, &zout, &zin, ZSTD_e_flush);
+		  if (ZSTD_isError(left))
+		    return -1;
+	       }
+	     while (left != 0 && zout.pos < zout.size);
+	     if (left != 0)
+	       return -1;
+	     clen = zout.pos;
+	  }
+	break;
+#endif
+      default:
+	return -1;
+     }
+   
+   codec_put32(c->wire + c->len, clen);
+   codec_put32(c->wire + c->len + 4, len);
+   c->len += CODEC_HDR_LEN + clen;
+   return 0;
+}
+
+
+/*
+ * decode as many complete frames from the wire buffer as will fit in
+ * the output.  returns the number of bytes produced or -1 if the data
+ * is not something we can decode.
+ */
+ssize_t
+codec_decode(c, out, room)
+   codec_t *c;
+   u_char *out;
+   size_t room;
+{
+   size_t off = 0, made = 0;
+   u_int32_t plen, dlen;
+   
+   /* make sure the other side is speaking the same language */
+   if (!c->started)
+     {
+	if (c->len < CODEC_MAGIC_LEN)
+	  return 0;
+	if (memcmp(c->wire, CODEC_MAGIC, CODEC_MAGIC_LEN - 1)
+	    || c->wire[CODEC_MAGIC_LEN - 1] != c->alg)
+	  return -1;
+	off = CODEC_MAGIC_LEN;
+	c->started = 1;
+     }
+   
+   while (c->len - off >= CODEC_HDR_LEN)
+     {
+	plen = codec_get32(c->wire + off);
+	dlen = codec_get32(c->wire + off + 4);
+	if (dlen > NSOCK_IOP_BLOCKSZ
+	    || plen > CODEC_WIRE_SZ - CODEC_HDR_LEN)
+	  return -1;
+	
+	/* wait for the rest of the frame, or for room to put it */
+	if (c->len - off < CODEC_HDR_LEN + plen
+	    || room - made < dlen)
+	  break;
+	
+	switch (c->alg)
+	  {
+#ifdef HAVE_LZ4
+	   case CODEC_LZ4:
+	     if (c->pos + dlen > CODEC_RING_SZ)
+	       c->pos = 0;
+	     if (LZ4_decompress_safe_continue(c->ctx, (char *)c->wire + off + CODEC_HDR_LEN,
+					      (char *)c->ring + c->pos, plen, dlen) != (int)dlen)
+	       return -1;
+	     memcpy(out + made, c->ring + c->pos, dlen);
+	     c->pos += dlen;
+	     break;
+#endif
+#ifdef HAVE_ZSTD
+	   case CODEC_ZSTD:
+	       {
+		  ZSTD_inBuffer zin;
+		  ZSTD_outBuffer zout;
+		  size_t ret, last;
+		  
+		  zin.src = c->wire + off + CODEC_HDR_LEN;
+		  zin.size = plen;
+		  zin.pos = 0;
+		  zout.dst = out + made;
+		  zout.size = dlen;
+		  zout.pos = 0;
+		  while (zin.pos < zin.size)
+		    {
+		       last = zin.pos + zout.pos;
+		       ret = ZSTD_decompressStream(c->ctx, &zout, &zin);
+		       if (ZSTD_isError(ret)
+			   || zin.pos + zout.pos == last)
+			 return -1;
+		    }
+		  if (zout.pos != dlen)
+		    return -1;
+	       }
+	     break;
+#endif
+	   default:
+	     return -1;
+	  }
+	made += dlen;
+	off += CODEC_HDR_LEN + plen;
+     }
+   
+   /* keep whatever is left for next time */
+   if (off)
+     {
+	memmove(c->wire, c->wire + off, c->len - off);
+	c->len -= off;
+     }
+   return made;
+}
+
+
+static void
+codec_put32(p, v)
+   u_char *p;
+   u_int32_t v;
+{
+   p[0] = (v >> 24) & 0xff;
+   p[1] = (v >> 16) & 0xff;
+   p[2] = (v >> 8) & 0xff;
+   p[3] = v & 0xff;
+}
+
+
+static u_int32_t
+codec_get32(p)
+   u_char *p;
+{
+   return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16)
+     | ((u_int32_t)p[2] << 8) | (u_int32_t)p[3];
+}
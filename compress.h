@@ -0,0 +1,46 @@
+/*
+ * compressed links between two copies of nsc
+ */
+#ifndef __nsc_compress_h
+#define __nsc_compress_h
+
+#define CODEC_NONE 	0x00
+#define CODEC_LZ4 	0x01
+#define CODEC_ZSTD 	0x02
+
+/* sent by each side before anything else */
+#define CODEC_MAGIC 	"NSZ"
+#define CODEC_MAGIC_LEN 4 	/* the magic plus the algorithm */
+
+/* every frame is a 4 byte payload length and 4 byte decoded length */
+#define CODEC_HDR_LEN 	8
+
+/* room for one encoded block, even if it grew a little */
+#define CODEC_WIRE_SZ 	(NSOCK_IOP_BLOCKSZ * 2 + CODEC_HDR_LEN + CODEC_MAGIC_LEN)
+
+/* lz4 needs the last 64k of history to stay put, so blocks are copied
+ * into a ring of this size on both ends */
+#define CODEC_RING_SZ 	(64 * 1024 + NSOCK_IOP_BLOCKSZ)
+
+typedef struct __nsc_codec_stru
+{
+   u_int alg;
+   int level;
+   u_char encode; 		/* which way this one works */
+   u_char started; 		/* magic sent or checked */
+   
+   u_char *wire; 		/* encoded data to send, or received */
+   size_t len;
+   
+   void *ctx; 			/* algorithm specific stream state */
+   u_char *ring; 		/* lz4 history */
+   size_t pos;
+} codec_t;
+
+int codec_parse(u_char *, u_int *, int *);
+codec_t *codec_new(u_int, int, u_char);
+void codec_free(codec_t *);
+int codec_encode(codec_t *, u_char *, size_t);
+ssize_t codec_decode(codec_t *, u_char *, size_t);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * listeners handed from one nsc to the next.
+ *
+ * with -W <path> a listener also waits on a unix socket at <path>.  a
+ * new nsc started with the same -W connects there first and is sent
+ * the listening sockets, each with the address it was opened for, so
+ * the kernel keeps queueing connections while the two swap over.  the
+ * old one stops its checkers and metrics server, says it is done by
+ * hanging up, and then only waits for its sessions to finish.
+ *
+ * the new nsc picks up the sockets whose address it would listen on
+ * anyway and closes the rest, so a changed -F file takes effect too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "handoff.h"
+
+
+static u_char *handoff_path = NULL;
+
+/* what the old nsc sent, claimed ones are set to -1 */
+static int taken_sd[HANDOFF_MAX];
+static u_char *taken_name[HANDOFF_MAX];
+static u_int ntaken = 0;
+
+static pid_t helpers[4];
+static u_int nhelpers = 0;
+
+static int handoff_addr(struct sockaddr_un *);
+static void handoff_stop_helpers(void);
+
+
+/*
+ * ask whoever holds path for its listeners.  returns how many came, 0
+ * if nobody was there, or -1 on error.
+ */
+int
+handoff_take(path)
+   u_char *path;
+{
+   struct sockaddr_un sa_un;
+   u_char name[HANDOFF_NAME];
+   union
+     {
+	struct cmsghdr cm;
+	u_char buf[CMSG_SPACE(sizeof(int))];
+     } control;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cm;
+   ssize_t len;
+   int sd;
+   
+   handoff_path = path;
+   if (handoff_addr(&sa_un) == -1)
+     return -1;
+   if ((sd = socket(PF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+     return -1;
+   if (connect(sd, (struct sockaddr *)&sa_un, sizeof(sa_un)) == -1)
+     {
+	close(sd);
+	if (errno == ENOENT || errno == ECONNREFUSED)
+	  return 0;
+	return -1;
+     }
+   
+   /* one listener per message, hanging up means it is all ours */
+   while (1)
+     {
+	iov.iov_base = name;
+	iov.iov_len = sizeof(name) - 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if ((len = recvmsg(sd, &msg, 0)) == -1)
+	  {
+	     if (errno == EINTR)
+	       continue;
+	     close(sd);
+	     return -1;
+	  }
+	if (len == 0)
+	  break;
+	name[len] = '\0';
+	
+	cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+	    || ntaken == HANDOFF_MAX)
+	  continue;
+	memcpy(&taken_sd[ntaken], CMSG_DATA(cm), sizeof(int));
+	if (!(taken_name[ntaken] = (u_char *)strdup((char *)name)))
+	  {
+	     close(taken_sd[ntaken]);
+	     continue;
+	  }
+	ntaken++;
+     }
+   close(sd);
+   
+   if (opts.verbosity > 0)
+     fprintf(stderr, "took over %u listener%s at %s\n", ntaken,
+	     ntaken == 1 ? "" : "s", path);
+   return ntaken;
+}
+
+
+/*
+ * the listener that was handed over for lhost, if there was one
+ */
+nsock_t *
+handoff_find(lhost)
+   u_char *lhost;
+{
+   struct sockaddr_storage ss;
+   nsock_t *ns;
+   u_int ns_errno, i;
+   socklen_t len, slen = sizeof(ss);
+   int type;
+   
+   for (i = 0; i < ntaken; i++)
+     {
+	if (taken_sd[i] == -1 || strcmp((char *)taken_name[i], (char *)lhost))
+	  continue;
+	
+	len = sizeof(type);
+	if (getsockopt(taken_sd[i], SOL_SOCKET, SO_TYPE, &type, &len) == -1
+	    || getsockname(taken_sd[i], (struct sockaddr *)&ss, &slen) == -1)
+	  return NULL;
+	if (!(ns = nsock_new(ss.ss_family, type, 0, &ns_errno)))
+	  return NULL;
+	if (ns->sd != -1)
+	  close(ns->sd);
+	ns->sd = taken_sd[i];
+	memcpy(&(ns->inet_fin), &ss, sizeof(ss));
+	taken_sd[i] = -1;
+	return ns;
+     }
+   return NULL;
+}
+
+
+/*
+ * wait for the next nsc at the -W path.  listeners that were handed
+ * over but are no longer wanted get closed here.  returns the socket to
+ * watch, or -1 without -W or if it can't be had (the listeners are
+ * fine either way).
+ */
+int
+handoff_open(void)
+{
+   struct sockaddr_un sa_un;
+   u_int i;
+   int sd;
+   
+   for (i = 0; i < ntaken; i++)
+     if (taken_sd[i] != -1)
+       {
+	  close(taken_sd[i]);
+	  taken_sd[i] = -1;
+       }
+   
+   if (!handoff_path || handoff_addr(&sa_un) == -1)
+     return -1;
+   unlink(sa_un.sun_path);
+   if ((sd = socket(PF_UNIX, SOCK_SEQPACKET, 0)) == -1
+       || bind(sd, (struct sockaddr *)&sa_un, sizeof(sa_un)) == -1
+       || listen(sd, 1) == -1)
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "handoff: %s: %s\n", handoff_path, strerror(errno));
+	if (sd != -1)
+	  close(sd);
+	return -1;
+     }
+   return sd;
+}
+
+
+/*
+ * remember a helper process to stop before handing over
+ */
+void
+handoff_helper(pid)
+   pid_t pid;
+{
+   if (pid > 0 && nhelpers < sizeof(helpers) / sizeof(helpers[0]))
+     helpers[nhelpers++] = pid;
+}
+
+
+/*
+ * someone connected to the -W path, give them the listeners and wind
+ * down.  returns -1 if nothing was handed over, otherwise the sessions
+ * are waited for and the process exits.
+ */
+int
+handoff_give(hsd, listeners, names, n)
+   int hsd;
+   nsock_t **listeners;
+   u_char **names;
+   u_int n;
+{
+   union
+     {
+	struct cmsghdr cm;
+	u_char buf[CMSG_SPACE(sizeof(int))];
+     } control;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cm;
+   u_int i;
+   int sd;
+   
+   if ((sd = accept(hsd, NULL, NULL)) == -1)
+     return -1;
+   
+   for (i = 0; i < n; i++)
+     {
+	iov.iov_base = names[i];
+	iov.iov_len = strlen((char *)names[i]);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &(listeners[i]->sd), sizeof(int));
+	if (sendmsg(sd, &msg, MSG_NOSIGNAL) == -1)
+	  {
+	     /* nothing is lost as long as we keep listening */
+	     if (opts.verbosity > 0)
+	       perror("handoff");
+	     close(sd);
+	     return -1;
+	  }
+     }
+   
+   /* the listeners are not ours anymore */
+   close(hsd);
+   for (i = 0; i < n; i++)
+     nsock_free(&listeners[i]);
+   handoff_stop_helpers();
+   close(sd);
+   
+   if (opts.verbosity > 0)
+     fprintf(stderr, "handed over %u listener%s, finishing sessions\n",
+	     n, n == 1 ? "" : "s");
+   signal(SIGCHLD, SIG_DFL);
+   while (waitpid(-1, NULL, 0) != -1 || errno == EINTR)
+     ;
+   if (stats && opts.flags & FLAG_LATENCY)
+     stats_report();
+   exit(0);
+}
+
+
+/*
+ * the checkers and the metrics server go first, the metrics port has
+ * to be free for the new nsc
+ */
+static void
+handoff_stop_helpers(void)
+{
+   u_int i, waited;
+   
+   for (i = 0; i < nhelpers; i++)
+     kill(helpers[i], SIGTERM);
+   for (i = 0; i < nhelpers; i++)
+     for (waited = 0; waitpid(helpers[i], NULL, WNOHANG) == 0; waited++)
+       {
+	  if (waited == HANDOFF_HELPER_WAIT * 10)
+	    {
+	       kill(helpers[i], SIGKILL);
+	       waitpid(helpers[i], NULL, 0);
+	       break;
+	    }
+	  usleep(100000);
+       }
+   nhelpers = 0;
+}
+
+
+static int
+handoff_addr(sa_un)
+   struct sockaddr_un *sa_un;
+{
+   memset(sa_un, 0, sizeof(*sa_un));
+   sa_un->sun_family = AF_UNIX;
+   if (strlen((char *)handoff_path) >= sizeof(sa_un->sun_path))
+     {
+	errno = ENAMETOOLONG;
+	return -1;
+     }
+   strcpy(sa_un->sun_path, (char *)handoff_path);
+   return 0;
+}
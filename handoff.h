@@ -0,0 +1,19 @@
+/*
+ * listeners handed from one nsc to the next (-W)
+ */
+#ifndef __nsc_handoff_h
+#define __nsc_handoff_h
+
+#define HANDOFF_MAX 	256 	/* listeners one process may hand over */
+#define HANDOFF_NAME 	1024 	/* longest listen address passed along */
+
+/* give the helpers this long to go before killing them outright */
+#define HANDOFF_HELPER_WAIT 	5
+
+int handoff_take(u_char *);
+nsock_t *handoff_find(u_char *);
+int handoff_open(void);
+void handoff_helper(pid_t);
+int handoff_give(int, nsock_t **, u_char **, u_int);
+
+#endif
@@ -4,16 +4,41 @@
  * Copyright (C) 2002,2004 Joshua J. Drake <libnsock@qoop.org>
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE 		/* splice() */
+#endif
+
 #include <nsock/nsock.h>
 #include <nsock/errors.h>
 
 #include "nsc.h"
 #include "io_pipe.h"
+#include "stats.h"
+#include "compress.h"
+#include "stripe.h"
+#include "zerocopy.h"
+#include "tstamp.h"
+#include "pool.h"
+#include "record.h"
+#include "checksum.h"
+#include "shape.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sched.h>
+#endif
 
 #define TELOPTS
 #define TELCMDS
@@ -29,19 +54,111 @@ typedef struct __nsc_telnet_opt_stru
 } telnet_t;
 
 
+/* room for telnet replies queued behind a buffer */
+#define IOBUF_CTL_SZ 		192
+
 /* a little struct to make things look a bit better */
 typedef struct __nsc_io_pipe_buf_stru
 {
    u_char *buf;
    size_t len;
+   u_int64_t stamp; 		/* when the oldest data arrived (stats only) */
+   codec_t *dec; 		/* decompress what is read (-j/-J) */
+   codec_t *enc; 		/* compress what is written */
+   zc_t *zc; 			/* buffers pinned by zerocopy sends (-Z) */
+   ts_t *rts; 			/* kernel timestamps where it is read from (-y) */
+   ts_t *wts; 			/* and where it is written to */
+   u_int64_t kstamp; 		/* when the kernel got the oldest data */
+   rec_t *rec; 			/* the session recording (-o) */
+   u_char rec_dir; 		/* which side this buffer is read from */
+   shape_t *shape[2]; 		/* the session's rate limit and everyone's */
+   csum_t *sum; 		/* running checksum of what is read (-D) */
+   u_char eof; 			/* IOBUF_EOF_* */
+   u_char ctl[IOBUF_CTL_SZ]; 	/* telnet replies to go out with the data */
+   size_t ctl_len;
+   size_t ctl_at; 		/* after this much of buf */
 } iobuf_t;
 
+/* the side a buffer is read from has stopped sending, and then the
+ * side it is written to has been told so, once the buffer was empty */
+#define IOBUF_EOF_READ 		1
+#define IOBUF_EOF_PASSED 	2
+
+/* is there room to read, and is there anything to write? */
+#define IOBUF_CAN_READ(io) 	((io)->dec ? (io)->dec->len < CODEC_WIRE_SZ \
+				 : IOBUF_ROOM(io) > 0)
+#define IOBUF_ROOM(io) 		(NSOCK_IOP_BLOCKSZ - (io)->len - (io)->ctl_len)
+#define IOBUF_MUST_WRITE(io) 	((io)->len || (io)->ctl_len \
+				 || ((io)->enc && (io)->enc->len))
+
+
+/* ways data can go around the buffers (linux only) */
+#define FAST_OFF 		0
+#define FAST_SENDFILE 		1 	/* regular file to socket */
+#define FAST_SPLICE 		2 	/* pipe to socket, or socket to pipe */
+#define FAST_VIA_PIPE 		3 	/* socket to regular file, through pp */
+
+#define FAST_CHUNK 		(256 * 1024)
+
+/* options that need the data to pass through the buffers */
+#define NSCIOP_SEES_DATA 	(NSCIOP_ACK_TELNET | NSCIOP_STDOUT_TOO \
+				 | NSCIOP_COMPRESS_1 | NSCIOP_COMPRESS_2 \
+				 | NSCIOP_TSTAMP | NSCIOP_RECORD)
+
+/* when things last happened, for the -I timeouts */
+typedef struct __nsc_io_pipe_timer_stru
+{
+   u_int64_t start; 		/* the session began */
+   u_int64_t read; 		/* something was last read */
+   u_int64_t wrote; 		/* a write last went, or nothing was waiting */
+} iotimer_t;
+
+typedef struct __nsc_io_pipe_fast_stru
+{
+   u_char out; 			/* local to remote */
+   u_char in; 			/* remote to local */
+   u_char moved_out, moved_in; 	/* too late to fall back */
+   u_char blocked; 		/* the local pipe is full */
+   u_char out_eof, in_eof; 	/* a side ended while going around */
+   int pp[2]; 			/* for FAST_VIA_PIPE */
+   size_t pp_len;
+} fast_t;
+
 
 /* some helpers */
 static void io_pipe_decide_desc(nsock_t *, int *, int *, nsock_t *, int *, int *, int *);
-static void io_pipe_setfds(fd_set *, fd_set *, size_t, size_t, int, int, int, int);
+static void io_pipe_setfds(fd_set *, fd_set *, iobuf_t *, iobuf_t *, int, int, int, int);
 static ssize_t io_pipe_buf_append(nsock_t *, int, iobuf_t *, int, iobuf_t *, u_char);
 static ssize_t io_pipe_buf_flush(nsock_t *, int, iobuf_t *, u_char);
+static void io_pipe_stamp(iobuf_t *, iobuf_t *);
+static void io_pipe_relayed(iobuf_t *);
+static int io_pipe_attach(iobuf_t *);
+static void io_pipe_release(iobuf_t *);
+static void io_pipe_drain(nsock_t *, int, iobuf_t *, u_char);
+static void io_pipe_reply(iobuf_t *, int, telnet_t *);
+static int io_pipe_ctl_fold(iobuf_t *);
+static ssize_t io_pipe_writev(nsock_t *, int, iobuf_t *, u_char);
+static void io_pipe_fast_init(fast_t *, nsock_t *, nsock_t *, int, int, u_char);
+static void io_pipe_fast_setfds(fast_t *, fd_set *, fd_set *, int, int, int, int);
+static int io_pipe_fast(fast_t *, fd_set *, fd_set *, int *, nsock_t *, int, int, int, int);
+static ssize_t io_pipe_fast_out(fast_t *, int, int);
+static ssize_t io_pipe_fast_in(fast_t *, nsock_t *, int, int);
+static int io_pipe_fast_drain(fast_t *, int);
+static void io_pipe_zc_init(nsock_t *, int, iobuf_t *);
+static ts_t *io_pipe_ts_init(nsock_t *);
+static void io_pipe_errq_reap(zc_t *, ts_t *, int, fd_set *, int *);
+static int io_pipe_readable(int);
+static void io_pipe_busy_init(nsock_t *, nsock_t *);
+static void io_pipe_busy_sock(nsock_t *);
+static void io_pipe_shape_init(iobuf_t *, u_int);
+static struct timeval *io_pipe_shape_setfds(fd_set *, iobuf_t *, iobuf_t *, int, int, struct timeval *);
+static size_t io_pipe_shape_room(iobuf_t *, u_int64_t);
+static u_int64_t io_pipe_shape_wait(iobuf_t *, u_int64_t);
+static int io_pipe_timer_setfds(iotimer_t *, iobuf_t *, iobuf_t *, fast_t *, struct timeval *, struct timeval **);
+static void io_pipe_timer_seen(iotimer_t *, fd_set *, fd_set *, int, int, int, int);
+static int io_pipe_select(int, fd_set *, fd_set *, struct timeval *);
+static int io_pipe_shutdown(nsock_t *, int);
+static int io_pipe_ssl_pending(nsock_t *, int, fd_set *);
 
 /*
  * use a select() loop to act just as netcat does...
@@ -56,35 +173,150 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
    u_char iop_opts;
 {
    fd_set rd, wr;
-   iobuf_t local = { NULL, 0 };
-   iobuf_t remote = { NULL, 0 };
-   int sret, high_desc;
+   struct timeval tv, *tvp;
+   iobuf_t local, remote;
+   fast_t fast;
+   iotimer_t timer;
+   int sret, high_desc, pending;
    ssize_t len;
    
+   memset(&local, 0, sizeof(local));
+   memset(&remote, 0, sizeof(remote));
+   
    /* decide which descriptors to use */
    io_pipe_decide_desc(ns1, &in1_sd, &out1_sd,
 		       ns2, &in2_sd, &out2_sd,
 		       &high_desc);
+   
+   /* striped sessions move data their own way */
+   if (iop_opts & NSCIOP_STRIPE)
+     return stripe_pipe(ns1, in2_sd, out2_sd);
 
-   /* get some heap memory for our buffers */
-   if (!(local.buf = calloc(1, NSOCK_IOP_BLOCKSZ))
-       || !(remote.buf = calloc(1, NSOCK_IOP_BLOCKSZ)))
+   /* the buffers are only taken once there is data for them */
+#if defined(HAVE_SSL) && defined(SSL_MODE_RELEASE_BUFFERS)
+   if (ns1 && ns1->opt & NSF_USE_SSL)
+     SSL_set_mode(ns1->ns_ssl.ssl, SSL_MODE_RELEASE_BUFFERS);
+   if (ns2 && ns2->opt & NSF_USE_SSL)
+     SSL_set_mode(ns2->ns_ssl.ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif
+   
+   /* compressed links decode what they read and encode what they write */
+   if (iop_opts & NSCIOP_COMPRESS_1
+       && (!(remote.dec = codec_new(opts.codec[0], opts.codec_level[0], 0))
+	   || !(local.enc = codec_new(opts.codec[0], opts.codec_level[0], 1))))
+     return NSERR_OUT_OF_MEMORY;
+   if (iop_opts & NSCIOP_COMPRESS_2
+       && (!(local.dec = codec_new(opts.codec[1], opts.codec_level[1], 0))
+	   || !(remote.enc = codec_new(opts.codec[1], opts.codec_level[1], 1))))
+     return NSERR_OUT_OF_MEMORY;
+   
+   /* latency first (-B) */
+   io_pipe_busy_init(ns1, ns2);
+   
+   /* files and pipes on the local side can skip the buffers */
+   io_pipe_fast_init(&fast, ns1, ns2, in2_sd, out2_sd, iop_opts);
+   
+   /* rate limited directions are metered as they leave the buffers
+    * (-g/-a), and checksums are taken as data arrives in them (-D), so
+    * neither can go around them */
+   io_pipe_shape_init(&local, SHAPE_OUT);
+   io_pipe_shape_init(&remote, SHAPE_IN);
+   if (opts.flags & FLAG_CHECKSUM)
+     {
+	local.sum = &(csum[CSUM_SENT]);
+	remote.sum = &(csum[CSUM_RECV]);
+     }
+   if (local.shape[0] || local.shape[1] || local.sum)
+     fast.out = FAST_OFF;
+   if ((remote.shape[0] || remote.shape[1] || remote.sum) && fast.in)
+     {
+	if (fast.pp[0] != -1)
+	  {
+	     close(fast.pp[0]);
+	     close(fast.pp[1]);
+	     fast.pp[0] = fast.pp[1] = -1;
+	  }
+	fast.in = FAST_OFF;
+     }
+   
+   /* sockets that are sent to in bulk can skip the copy too (-Z) */
+   if (iop_opts & NSCIOP_ZEROCOPY)
      {
-	if (local.buf)
-	  free(local.buf);
-	return NSERR_OUT_OF_MEMORY;
+	if (ns1 && !local.enc && !fast.out)
+	  io_pipe_zc_init(ns1, out1_sd, &local);
+	if (ns2 && !remote.enc)
+	  io_pipe_zc_init(ns2, out2_sd, &remote);
      }
    
+   /* timestamp both sockets, each buffer is read from one and written
+    * to the other (-y) */
+   if (iop_opts & NSCIOP_TSTAMP)
+     {
+	remote.rts = local.wts = io_pipe_ts_init(ns1);
+	local.rts = remote.wts = io_pipe_ts_init(ns2);
+     }
+   
+   /* what either side sends goes to the recording as well (-o) */
+   if (iop_opts & NSCIOP_RECORD)
+     {
+	remote.rec = local.rec = rec_open(opts.record);
+	remote.rec_dir = REC_CONN;
+	local.rec_dir = REC_LOCAL;
+     }
+   
+   /* sessions that go quiet or get stuck are ended (-I) */
+   timer.start = timer.read = timer.wrote = stats_now();
+   
    /* loop until there is a problem ... */
    while (1)
      {
+	/* a side that ended is passed on once its buffer is empty, so
+	 * the other direction can finish, and the session is over once
+	 * both have been.  stdout can't be told, nor can datagrams, so
+	 * those end the session as netcat does. */
+	if (local.eof == IOBUF_EOF_READ && !IOBUF_MUST_WRITE(&local))
+	  {
+	     if (opts.flags & FLAG_USE_UDP
+		 || io_pipe_shutdown(ns1, out1_sd) == -1)
+	       break;
+	     local.eof = IOBUF_EOF_PASSED;
+	  }
+	if (remote.eof == IOBUF_EOF_READ && !IOBUF_MUST_WRITE(&remote))
+	  {
+	     if (opts.flags & FLAG_USE_UDP
+		 || (!ns2 && out2_sd == fileno(stdout))
+		 || io_pipe_shutdown(ns2, out2_sd) == -1)
+	       break;
+	     remote.eof = IOBUF_EOF_PASSED;
+	  }
+	if (local.eof == IOBUF_EOF_PASSED && remote.eof == IOBUF_EOF_PASSED)
+	  break;
+	
 	io_pipe_setfds(&rd, &wr,
-		       remote.len, local.len,
+		       &remote, &local,
 		       in1_sd, out1_sd, 
 		       in2_sd, out2_sd);
+	if (fast.out || fast.in)
+	  io_pipe_fast_setfds(&fast, &rd, &wr,
+			      in1_sd, out1_sd,
+			      in2_sd, out2_sd);
+	tvp = io_pipe_shape_setfds(&wr, &remote, &local,
+				   out1_sd, out2_sd, &tv);
+	if (io_pipe_timer_setfds(&timer, &remote, &local, &fast, &tv, &tvp) == -1)
+	  break;
 	
-	/* wait forever for something to happen.. */
-	sret = select(high_desc, &rd, &wr, NULL, NULL);
+	/* SSL can be holding data it already took off the socket, which
+	 * select() knows nothing about, so only poll */
+	pending = io_pipe_ssl_pending(ns1, in1_sd, &rd)
+	  | io_pipe_ssl_pending(ns2, in2_sd, &rd) << 1;
+	if (pending)
+	  {
+	     tv.tv_sec = tv.tv_usec = 0;
+	     tvp = &tv;
+	  }
+	
+	/* wait for something to happen, or for a rate limit to let up */
+	sret = io_pipe_select(high_desc, &rd, &wr, tvp);
 	if (sret == -1)
 	  {
 	     if (ns1)
@@ -93,6 +325,35 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 	       ns2->ns_errno = NSERR_IOP_SELECT_FAILED;
 	     return -1;
 	  }
+	if (pending & 1 && !FD_ISSET(in1_sd, &rd))
+	  {
+	     FD_SET(in1_sd, &rd);
+	     sret++;
+	  }
+	if (pending & 2 && !FD_ISSET(in2_sd, &rd))
+	  {
+	     FD_SET(in2_sd, &rd);
+	     sret++;
+	  }
+	
+	/* zerocopy completions and timestamps are not data */
+	io_pipe_errq_reap(local.zc, local.wts, in1_sd, &rd, &sret);
+	io_pipe_errq_reap(remote.zc, remote.wts, in2_sd, &rd, &sret);
+	io_pipe_timer_seen(&timer, &rd, &wr,
+			   in1_sd, out1_sd, in2_sd, out2_sd);
+	
+	/* whatever goes around the buffers */
+	if ((fast.out || fast.in)
+	    && io_pipe_fast(&fast, &rd, &wr, &sret, ns1,
+			    in1_sd, out1_sd, in2_sd, out2_sd) == -1)
+	  return -1;
+	if (fast.out_eof)
+	  local.eof = IOBUF_EOF_READ;
+	if (fast.in_eof)
+	  remote.eof = IOBUF_EOF_READ;
+	fast.out_eof = fast.in_eof = 0;
+	if (!sret)
+	  continue;
 	
 	/* ok to send stuff to remote? */
 	if (FD_ISSET(out1_sd, &wr))
@@ -107,6 +368,8 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 #ifdef DEBUG_PIPE_BUFS
 	       }
 #endif
+	     STAT_ADD(bytes[STATS_OUT], len);
+	     io_pipe_relayed(&local);
 	     if (!(--sret))
 	       continue;
 	  }
@@ -124,6 +387,8 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 #ifdef DEBUG_PIPE_BUFS
 	       }
 #endif
+	     STAT_ADD(bytes[STATS_IN], len);
+	     io_pipe_relayed(&remote);
 	     if (!(--sret))
 	       continue;
 	  }
@@ -132,15 +397,17 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 	if (FD_ISSET(in1_sd, &rd))
 	  {
 	     len = io_pipe_buf_append(ns1, in1_sd, &remote, out1_sd, &local, iop_opts);
-	     if (len < 0)
-#ifdef DEBUG_PIPE_BUFS
+	     if (len < 0 && !remote.eof)
 	       {
+		  io_pipe_drain(ns2, out2_sd, &remote, iop_opts);
+#ifdef DEBUG_PIPE_BUFS
 		  fprintf(stderr, "local %u remote %u\n", local.len, remote.len);
 #endif
 		  return len;
-#ifdef DEBUG_PIPE_BUFS
 	       }
-#endif
+	     if (remote.len == NSOCK_IOP_BLOCKSZ)
+	       STAT_INC(buffer_full[STATS_IN]);
+	     io_pipe_stamp(&remote, &local);
 	     if (!(--sret))
 	       continue;
 	  }
@@ -149,15 +416,17 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 	if (FD_ISSET(in2_sd, &rd))
 	  {
 	     len = io_pipe_buf_append(ns2, in2_sd, &local, -1, NULL, iop_opts);
-	     if (len < 0)
-#ifdef DEBUG_PIPE_BUFS
+	     if (len < 0 && !local.eof)
 	       {
+		  io_pipe_drain(ns1, out1_sd, &local, iop_opts);
+#ifdef DEBUG_PIPE_BUFS
 		  fprintf(stderr, "local %u remote %u\n", local.len, remote.len);
 #endif
 		  return len;
-#ifdef DEBUG_PIPE_BUFS
 	       }
-#endif
+	     if (local.len == NSOCK_IOP_BLOCKSZ)
+	       STAT_INC(buffer_full[STATS_OUT]);
+	     io_pipe_stamp(&local, NULL);
 	     if (!(--sret))
 	       continue;
 	  }
@@ -166,12 +435,929 @@ nsc_io_pipe(ns1, in1_sd, out1_sd,
 	  fprintf(stderr, "%s: %d unhandled sockets!\n", __func__, sret);
      }
    
-   free(local.buf);
-   free(remote.buf);
+   codec_free(remote.dec);
+   codec_free(remote.enc);
+   codec_free(local.dec);
+   codec_free(local.enc);
+   if (local.zc)
+     zc_free(local.zc);
+   else
+     pool_put(&pool_blocks, local.buf);
+   if (remote.zc)
+     zc_free(remote.zc);
+   else
+     pool_put(&pool_blocks, remote.buf);
+   ts_free(local.rts);
+   ts_free(local.wts);
+   rec_close(local.rec);
+   free(local.shape[0]);
+   free(remote.shape[0]);
    return NSERR_SUCCESS;
 }
 
 
+/*
+ * note when data shows up in a buffer that was empty.  telnet replies
+ * can land in the other buffer, so that one gets checked too.
+ */
+static void
+io_pipe_stamp(io, oio)
+   iobuf_t *io, *oio;
+{
+   if (!stats)
+     return;
+   if (io->len && !io->stamp)
+     io->stamp = stats_now();
+   if (oio && oio->len && !oio->stamp)
+     oio->stamp = stats_now();
+}
+
+
+/*
+ * some data went out, see how long it waited
+ */
+static void
+io_pipe_relayed(io)
+   iobuf_t *io;
+{
+   u_int64_t now;
+   
+   if (!stats)
+     return;
+   now = stats_now();
+   
+   /* the first byte of the session */
+   if (stats_session_start)
+     {
+	stats_record(HIST_FIRST_BYTE, now - stats_session_start);
+	stats_session_start = 0;
+     }
+   if (io->stamp)
+     stats_record(HIST_RELAY, now - io->stamp);
+   
+   /* whatever is left is at least as old, keep the stamp until empty */
+   if (io->len == 0)
+     io->stamp = 0;
+}
+
+
+/*
+ * get a buffer to read into.  an idle session holds none, so it only
+ * costs its sockets.
+ */
+static int
+io_pipe_attach(io)
+   iobuf_t *io;
+{
+   if (!io->buf && !(io->buf = pool_get(&pool_blocks)))
+     return -1;
+   return 0;
+}
+
+
+/*
+ * give back a buffer that was emptied, unless zerocopy owns it or the
+ * decoder still has something for it
+ */
+static void
+io_pipe_release(io)
+   iobuf_t *io;
+{
+   if (!io->buf || io->zc || io->len
+       || (io->dec && io->dec->len))
+     return;
+   pool_put(&pool_blocks, io->buf);
+   io->buf = NULL;
+}
+
+
+/*
+ * a compressed link can be holding frames the peer sent before it went
+ * away (or a frame we have not finished sending), and a rate limit can
+ * be holding back what was read.  pass those on before giving up.
+ */
+static void
+io_pipe_drain(ns, sd, io, opts)
+   nsock_t *ns;
+   int sd;
+   iobuf_t *io;
+   u_char opts;
+{
+   u_int64_t wait;
+   
+   if (!io->dec && !io->enc && !io->shape[0] && !io->shape[1])
+     return;
+   while (IOBUF_MUST_WRITE(io))
+     {
+	/* the session is over, so a rate limit can be slept off */
+	if ((wait = io_pipe_shape_wait(io, stats_now())))
+	  stats_sleep(wait);
+	if (io_pipe_buf_flush(ns, sd, io, opts) < 0)
+	  break;
+     }
+}
+
+
+/*
+ * queue a telnet reply behind what is in io so far.  replies that find
+ * the queue full, or no room left to fold it into the buffer, go out on
+ * their own.
+ */
+static void
+io_pipe_reply(io, sd, tout)
+   iobuf_t *io;
+   int sd;
+   telnet_t *tout;
+{
+   if (io->ctl_len + 3 > IOBUF_CTL_SZ || IOBUF_ROOM(io) < 3)
+     {
+	write(sd, tout, 3);
+	return;
+     }
+   
+   /* later replies join the first ones, the data read since can wait */
+   if (io->ctl_len == 0)
+     io->ctl_at = io->len;
+   memcpy(io->ctl + io->ctl_len, tout, 3);
+   io->ctl_len += 3;
+}
+
+
+/*
+ * put the queued replies into the buffer where they belong.  reads
+ * leave room for them, so they always fit.
+ */
+static int
+io_pipe_ctl_fold(io)
+   iobuf_t *io;
+{
+   if (io_pipe_attach(io) == -1)
+     return -1;
+   memmove(io->buf + io->ctl_at + io->ctl_len, io->buf + io->ctl_at,
+	   io->len - io->ctl_at);
+   memcpy(io->buf + io->ctl_at, io->ctl, io->ctl_len);
+   io->len += io->ctl_len;
+   io->ctl_len = 0;
+   return 0;
+}
+
+
+/*
+ * write the buffer with the replies in their place, and the -O copy the
+ * same way, a syscall each
+ */
+static ssize_t
+io_pipe_writev(ns, sd, io, opts)
+   nsock_t *ns;
+   int sd;
+   iobuf_t *io;
+   u_char opts;
+{
+   struct iovec iov[3];
+   ssize_t len;
+   size_t left, used, ctl_used;
+   int i, n = 0;
+   
+   if (io->ctl_at)
+     {
+	iov[n].iov_base = io->buf;
+	iov[n++].iov_len = io->ctl_at;
+     }
+   iov[n].iov_base = io->ctl;
+   iov[n++].iov_len = io->ctl_len;
+   if (io->len > io->ctl_at)
+     {
+	iov[n].iov_base = io->buf + io->ctl_at;
+	iov[n++].iov_len = io->len - io->ctl_at;
+     }
+   
+   len = writev(sd, iov, n);
+   if (len < 1)
+     {
+	if (ns)
+	  return nsock_error(ns, len == 0 ? NSERR_WRITE_EOF : NSERR_WRITE_ERROR);
+	return -1;
+     }
+   
+   /* the tap gets just what went out */
+   if (opts & NSCIOP_STDOUT_TOO && sd != fileno(stdout))
+     {
+	for (i = 0, left = len; i < n && left > 0; i++)
+	  {
+	     if (iov[i].iov_len > left)
+	       iov[i].iov_len = left;
+	     left -= iov[i].iov_len;
+	  }
+	writev(fileno(stdout), iov, i);
+     }
+   
+   /* take off what was written, from the data before the replies, then
+    * the replies, then the data after them */
+   used = (size_t)len < io->ctl_at ? (size_t)len : io->ctl_at;
+   left = len - used;
+   ctl_used = left < io->ctl_len ? left : io->ctl_len;
+   left -= ctl_used;
+   used += left;
+   
+   if (used)
+     memmove(io->buf, io->buf + used, io->len - used);
+   io->len -= used;
+   io->ctl_at -= io->ctl_at < used ? io->ctl_at : used;
+   memmove(io->ctl, io->ctl + ctl_used, io->ctl_len - ctl_used);
+   io->ctl_len -= ctl_used;
+   
+   if (io->len == 0)
+     {
+	io->kstamp = 0;
+	io_pipe_release(io);
+     }
+   return len;
+}
+
+
+/*
+ * see if either direction can skip the buffers.  that takes a plain
+ * socket on one side, a file or pipe on the other, and nothing that
+ * needs to look at the data on the way through.
+ */
+static void
+io_pipe_fast_init(fast, ns1, ns2, in2_sd, out2_sd, opts)
+   fast_t *fast;
+   nsock_t *ns1, *ns2;
+   int in2_sd, out2_sd;
+   u_char opts;
+{
+#ifdef __linux__
+   struct stat st;
+#endif
+   
+   memset(fast, 0, sizeof(*fast));
+   fast->pp[0] = fast->pp[1] = -1;
+#ifdef __linux__
+   if (!ns1 || ns2 || (opts & NSCIOP_SEES_DATA))
+     return;
+   
+   /* datagrams keep the size of each read, one big sendfile() would
+    * not fit in one */
+   if (ns1->type != SOCK_STREAM)
+     return;
+#ifdef HAVE_SSL
+   if (ns1->opt & NSF_USE_SSL)
+     return;
+#endif
+   
+   if (fstat(in2_sd, &st) == 0)
+     {
+	if (S_ISREG(st.st_mode))
+	  fast->out = FAST_SENDFILE;
+	else if (S_ISFIFO(st.st_mode))
+	  fast->out = FAST_SPLICE;
+     }
+   
+   /* splice() into a file can't append, so leave >> alone */
+   if (out2_sd != in2_sd && fstat(out2_sd, &st) == 0)
+     {
+	if (S_ISFIFO(st.st_mode))
+	  fast->in = FAST_SPLICE;
+	else if (S_ISREG(st.st_mode)
+		 && !(fcntl(out2_sd, F_GETFL) & O_APPEND)
+		 && pipe(fast->pp) == 0)
+	  fast->in = FAST_VIA_PIPE;
+     }
+#endif
+}
+
+
+/*
+ * a file on stdin is always ready, so wait on the socket instead.  a
+ * full local pipe is waited on before reading more from the remote.
+ */
+static void
+io_pipe_fast_setfds(fast, rd, wr,
+		    in1_sd, out1_sd,
+		    in2_sd, out2_sd)
+   fast_t *fast;
+   fd_set *rd, *wr;
+   int in1_sd, out1_sd;
+   int in2_sd, out2_sd;
+{
+   if (fast->out == FAST_SENDFILE)
+     {
+	FD_CLR(in2_sd, rd);
+	FD_SET(out1_sd, wr);
+     }
+   if (fast->in == FAST_SPLICE && fast->blocked)
+     {
+	FD_CLR(in1_sd, rd);
+	FD_SET(out2_sd, wr);
+     }
+}
+
+
+/*
+ * move what select() says can go without the buffers.  the descriptors
+ * dealt with here are taken out of the sets (and the count) so the
+ * buffered code doesn't see them.
+ */
+static int
+io_pipe_fast(fast, rd, wr, sretp, ns1,
+	     in1_sd, out1_sd,
+	     in2_sd, out2_sd)
+   fast_t *fast;
+   fd_set *rd, *wr;
+   int *sretp;
+   nsock_t *ns1;
+   int in1_sd, out1_sd;
+   int in2_sd, out2_sd;
+{
+   ssize_t len;
+   
+   /* local to remote */
+   if ((fast->out == FAST_SENDFILE && FD_ISSET(out1_sd, wr))
+       || (fast->out == FAST_SPLICE && FD_ISSET(in2_sd, rd)))
+     {
+	if (fast->out == FAST_SENDFILE)
+	  FD_CLR(out1_sd, wr);
+	else
+	  FD_CLR(in2_sd, rd);
+	(*sretp)--;
+	
+	len = io_pipe_fast_out(fast, in2_sd, out1_sd);
+	if (len < 0)
+	  return -1;
+	STAT_ADD(bytes[STATS_OUT], len);
+     }
+   
+   /* the local pipe has room again */
+   if (fast->in == FAST_SPLICE && fast->blocked && FD_ISSET(out2_sd, wr))
+     {
+	FD_CLR(out2_sd, wr);
+	(*sretp)--;
+	fast->blocked = 0;
+     }
+   
+   /* remote to local */
+   if (fast->in && FD_ISSET(in1_sd, rd))
+     {
+	FD_CLR(in1_sd, rd);
+	(*sretp)--;
+	
+	len = io_pipe_fast_in(fast, ns1, in1_sd, out2_sd);
+	if (len < 0)
+	  return -1;
+	STAT_ADD(bytes[STATS_IN], len);
+     }
+   return 0;
+}
+
+
+/*
+ * local to remote with sendfile() or splice().  returns what was sent
+ * (0 if the fast path just gave up) or -1 at the end of the input.
+ */
+static ssize_t
+io_pipe_fast_out(fast, in2_sd, out1_sd)
+   fast_t *fast;
+   int in2_sd, out1_sd;
+{
+   ssize_t len = -1;
+   
+#ifdef __linux__
+   if (fast->out == FAST_SENDFILE)
+     len = sendfile(out1_sd, in2_sd, NULL, FAST_CHUNK);
+   else
+     len = splice(in2_sd, NULL, out1_sd, NULL, FAST_CHUNK,
+		  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+   if (len == -1)
+     {
+	if (errno == EAGAIN || errno == EINTR)
+	  return 0;
+	
+	/* these descriptors won't do it, use the buffers */
+	if (!fast->moved_out && (errno == EINVAL || errno == ENOSYS))
+	  {
+	     fast->out = FAST_OFF;
+	     return 0;
+	  }
+	return -1;
+     }
+   if (len == 0)
+     {
+	fast->out = FAST_OFF;
+	fast->out_eof = 1;
+	return 0;
+     }
+   fast->moved_out = 1;
+#endif
+   return len;
+}
+
+
+/*
+ * remote to local with splice(), straight into a pipe or through our
+ * own pipe into a file.
+ */
+static ssize_t
+io_pipe_fast_in(fast, ns1, in1_sd, out2_sd)
+   fast_t *fast;
+   nsock_t *ns1;
+   int in1_sd, out2_sd;
+{
+   ssize_t len = -1;
+   
+#ifdef __linux__
+   len = splice(in1_sd, NULL,
+		fast->in == FAST_SPLICE ? out2_sd : fast->pp[1], NULL,
+		FAST_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+   if (len == -1)
+     {
+	if (errno == EINTR)
+	  return 0;
+	if (errno == EAGAIN)
+	  {
+	     fast->blocked = (fast->in == FAST_SPLICE);
+	     return 0;
+	  }
+	if (!fast->moved_in && (errno == EINVAL || errno == ENOSYS))
+	  {
+	     if (fast->pp[0] != -1)
+	       {
+		  close(fast->pp[0]);
+		  close(fast->pp[1]);
+		  fast->pp[0] = fast->pp[1] = -1;
+	       }
+	     fast->in = FAST_OFF;
+	     return 0;
+	  }
+	return nsock_error(ns1, NSERR_READ_ERROR);
+     }
+   if (len == 0)
+     {
+	/* FAST_VIA_PIPE has written everything out already */
+	fast->in = FAST_OFF;
+	fast->in_eof = 1;
+	nsock_error(ns1, NSERR_READ_EOF);
+	return 0;
+     }
+   fast->moved_in = 1;
+   
+   if (fast->in == FAST_VIA_PIPE)
+     {
+	fast->pp_len += len;
+	if (io_pipe_fast_drain(fast, out2_sd) == -1)
+	  return -1;
+     }
+#endif
+   return len;
+}
+
+
+/*
+ * empty our pipe into the output file.  if the file won't take a
+ * splice(), copy out what is stuck and use the buffers from now on.
+ */
+static int
+io_pipe_fast_drain(fast, out2_sd)
+   fast_t *fast;
+   int out2_sd;
+{
+#ifdef __linux__
+   u_char buf[NSOCK_IOP_BLOCKSZ];
+   u_char copy = 0;
+   ssize_t len;
+   
+   while (fast->pp_len > 0)
+     {
+	if (!copy)
+	  {
+	     len = splice(fast->pp[0], NULL, out2_sd, NULL, fast->pp_len,
+			  SPLICE_F_MOVE);
+	     if (len == -1 && errno == EINTR)
+	       continue;
+	     if (len == -1 && (errno == EINVAL || errno == ENOSYS))
+	       copy = 1;
+	     else if (len < 1)
+	       return -1;
+	  }
+	if (copy)
+	  {
+	     len = read(fast->pp[0], buf,
+			fast->pp_len < sizeof(buf) ? fast->pp_len : sizeof(buf));
+	     if (len < 1 || write(out2_sd, buf, len) != len)
+	       return -1;
+	  }
+	fast->pp_len -= len;
+     }
+   
+   if (copy)
+     {
+	close(fast->pp[0]);
+	close(fast->pp[1]);
+	fast->pp[0] = fast->pp[1] = -1;
+	fast->in = FAST_OFF;
+     }
+#endif
+   return 0;
+}
+
+
+/*
+ * move a socket's buffer into a zerocopy pool
+ */
+static void
+io_pipe_zc_init(ns, sd, io)
+   nsock_t *ns;
+   int sd;
+   iobuf_t *io;
+{
+#ifdef HAVE_SSL
+   if (ns->opt & NSF_USE_SSL)
+     return;
+#endif
+   if (!(io->zc = zc_new(sd)))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "zerocopy: %s, copying as usual\n", strerror(errno));
+	return;
+     }
+   io->buf = zc_get(io->zc);
+}
+
+
+/*
+ * timestamps for a plain tcp socket, if the kernel has them
+ */
+static ts_t *
+io_pipe_ts_init(ns)
+   nsock_t *ns;
+{
+   ts_t *ts;
+   
+   if (!ns)
+     return NULL;
+#ifdef HAVE_SSL
+   if (ns->opt & NSF_USE_SSL)
+     return NULL;
+#endif
+   if (!(ts = ts_new(ns->sd)) && opts.verbosity > 0)
+     fprintf(stderr, "timestamps: %s\n", strerror(errno));
+   return ts;
+}
+
+
+/*
+ * zerocopy completions and transmit timestamps wait in the error queue,
+ * which makes the socket look readable.  collect them, and take the
+ * socket out of the read set if that is all there was.
+ */
+static void
+io_pipe_errq_reap(zc, ts, sd, rd, sretp)
+   zc_t *zc;
+   ts_t *ts;
+   int sd;
+   fd_set *rd;
+   int *sretp;
+{
+   if (!(zc && zc->inflight) && !(ts && ts->count))
+     return;
+   if (zc)
+     zc_reap(zc);
+   if (ts)
+     ts_reap(ts);
+   if (FD_ISSET(sd, rd) && !io_pipe_readable(sd))
+     {
+	FD_CLR(sd, rd);
+	(*sretp)--;
+     }
+}
+
+
+/*
+ * is there really something to read (or an end of file)?
+ */
+static int
+io_pipe_readable(sd)
+   int sd;
+{
+   struct pollfd pfd;
+   
+   pfd.fd = sd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   if (poll(&pfd, 1, 0) < 1)
+     return 0;
+   return (pfd.revents & (POLLIN | POLLHUP)) ? 1 : 0;
+}
+
+
+/*
+ * set up the sockets (and the cpu) for -B
+ */
+static void
+io_pipe_busy_init(ns1, ns2)
+   nsock_t *ns1, *ns2;
+{
+#ifdef __linux__
+   cpu_set_t set;
+#endif
+   
+   if (!opts.busy_poll)
+     return;
+   io_pipe_busy_sock(ns1);
+   io_pipe_busy_sock(ns2);
+   
+#ifdef __linux__
+   if (opts.busy_cpu >= 0)
+     {
+	CPU_ZERO(&set);
+	CPU_SET(opts.busy_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1
+	    && opts.verbosity > 0)
+	  fprintf(stderr, "unable to pin to cpu %d: %s\n", opts.busy_cpu, strerror(errno));
+     }
+#endif
+}
+
+
+/*
+ * small replies go out right away, and reads spin on the device queue
+ * for a while before sleeping where the kernel supports it
+ */
+static void
+io_pipe_busy_sock(ns)
+   nsock_t *ns;
+{
+   int one = 1;
+   int usecs = opts.busy_poll;
+   
+   if (!ns || ns->sd == -1)
+     return;
+   
+   /* fails on unix and udp sockets, which don't need it */
+   setsockopt(ns->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   
+#ifdef SO_BUSY_POLL
+   /* more than net.core.busy_read takes CAP_NET_ADMIN */
+   if (setsockopt(ns->sd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1
+       && opts.verbosity > 1)
+     fprintf(stderr, "SO_BUSY_POLL: %s\n", strerror(errno));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+   setsockopt(ns->sd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+   (void)usecs;
+}
+
+
+/*
+ * give a buffer the rate limits for the direction it is written in
+ */
+static void
+io_pipe_shape_init(io, dir)
+   iobuf_t *io;
+   u_int dir;
+{
+   if (opts.shape_rate[dir])
+     io->shape[0] = shape_new(opts.shape_rate[dir], 0);
+   io->shape[1] = opts.shape_all[dir];
+}
+
+
+/*
+ * keep buffers the rate limits are holding back out of the write set,
+ * and work out when the first of them may go.  returns the timeout for
+ * select(), or NULL to wait for the descriptors alone.
+ */
+static struct timeval *
+io_pipe_shape_setfds(wr, rio, lio, out1_sd, out2_sd, tv)
+   fd_set *wr;
+   iobuf_t *rio, *lio;
+   int out1_sd, out2_sd;
+   struct timeval *tv;
+{
+   u_int64_t now, wait, least = 0;
+   
+   if (!lio->shape[0] && !lio->shape[1]
+       && !rio->shape[0] && !rio->shape[1])
+     return NULL;
+   
+   now = stats_now();
+   if (FD_ISSET(out1_sd, wr) && (wait = io_pipe_shape_wait(lio, now)))
+     {
+	FD_CLR(out1_sd, wr);
+	least = wait;
+     }
+   if (FD_ISSET(out2_sd, wr) && (wait = io_pipe_shape_wait(rio, now)))
+     {
+	FD_CLR(out2_sd, wr);
+	if (!least || wait < least)
+	  least = wait;
+     }
+   if (!least)
+     return NULL;
+   tv->tv_sec = least / 1000000;
+   tv->tv_usec = least % 1000000;
+   return tv;
+}
+
+
+/*
+ * how much of a buffer its rate limits let out now
+ */
+static size_t
+io_pipe_shape_room(io, now)
+   iobuf_t *io;
+   u_int64_t now;
+{
+   size_t room = (size_t)-1, r;
+   u_int i;
+   
+   for (i = 0; i < 2; i++)
+     if (io->shape[i] && (r = shape_room(io->shape[i], now)) < room)
+       room = r;
+   return room;
+}
+
+
+/*
+ * usecs until a buffer may write a useful amount, 0 if it may now
+ */
+static u_int64_t
+io_pipe_shape_wait(io, now)
+   iobuf_t *io;
+   u_int64_t now;
+{
+   size_t want = io->enc && io->enc->len ? io->enc->len : io->len;
+   u_int64_t wait, most = 0;
+   u_int i;
+   
+   if (want > SHAPE_MIN_WRITE)
+     want = SHAPE_MIN_WRITE;
+   for (i = 0; i < 2; i++)
+     if (io->shape[i]
+	 && (wait = shape_wait(io->shape[i], want, now)) > most)
+       most = wait;
+   return most;
+}
+
+
+/*
+ * see if a -I timeout has run out, and if not, make sure select() wakes
+ * up in time for the next one.  returns -1 when the session is over.
+ */
+static int
+io_pipe_timer_setfds(tm, rio, lio, fast, tv, tvp)
+   iotimer_t *tm;
+   iobuf_t *rio, *lio;
+   fast_t *fast;
+   struct timeval *tv, **tvp;
+{
+   static char *what[3] = { "idle", "stuck writing", "open" };
+   u_int64_t since[3], due, now, least = (u_int64_t)-1;
+   u_int secs[3];
+   u_int i;
+   
+   if (!opts.idle_timeout && !opts.stall_timeout && !opts.session_timeout)
+     return 0;
+   
+   /* a stall only counts while something waits to be written, in the
+    * buffers or on the fast paths */
+   now = stats_now();
+   if (!IOBUF_MUST_WRITE(rio) && !IOBUF_MUST_WRITE(lio)
+       && fast->out != FAST_SENDFILE && !fast->blocked)
+     tm->wrote = now;
+   
+   since[0] = tm->read;
+   secs[0] = opts.idle_timeout;
+   since[1] = tm->wrote;
+   secs[1] = opts.stall_timeout;
+   since[2] = tm->start;
+   secs[2] = opts.session_timeout;
+   for (i = 0; i < 3; i++)
+     {
+	if (!secs[i])
+	  continue;
+	due = since[i] + (u_int64_t)secs[i] * 1000000;
+	if (due <= now)
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "session %s for %u secs, closing\n", what[i], secs[i]);
+	     STAT_INC(timeouts);
+	     return -1;
+	  }
+	if (due - now < least)
+	  least = due - now;
+     }
+   
+   if (*tvp && (u_int64_t)(*tvp)->tv_sec * 1000000 + (*tvp)->tv_usec <= least)
+     return 0;
+   tv->tv_sec = least / 1000000;
+   tv->tv_usec = least % 1000000;
+   *tvp = tv;
+   return 0;
+}
+
+
+/*
+ * note what select() found ready.  this is before the fast paths take
+ * their descriptors out of the sets.
+ */
+static void
+io_pipe_timer_seen(tm, rd, wr,
+		   in1_sd, out1_sd,
+		   in2_sd, out2_sd)
+   iotimer_t *tm;
+   fd_set *rd, *wr;
+   int in1_sd, out1_sd;
+   int in2_sd, out2_sd;
+{
+   if (!opts.idle_timeout && !opts.stall_timeout)
+     return;
+   if (FD_ISSET(in1_sd, rd) || FD_ISSET(in2_sd, rd))
+     tm->read = stats_now();
+   if (FD_ISSET(out1_sd, wr) || FD_ISSET(out2_sd, wr))
+     tm->wrote = stats_now();
+}
+
+
+/*
+ * nothing more will be written to sd, let whoever reads it know.  pipes
+ * to -e can only be closed.
+ */
+static int
+io_pipe_shutdown(ns, sd)
+   nsock_t *ns;
+   int sd;
+{
+#ifdef HAVE_SSL
+   if (ns && ns->opt & NSF_USE_SSL)
+     SSL_shutdown(ns->ns_ssl.ssl);
+#endif
+   if (shutdown(sd, SHUT_WR) == 0)
+     return 0;
+   if (errno == ENOTSOCK)
+     return close(sd);
+   return -1;
+}
+
+
+/*
+ * is sd to be read and SSL already holding some of it
+ */
+static int
+io_pipe_ssl_pending(ns, sd, rd)
+   nsock_t *ns;
+   int sd;
+   fd_set *rd;
+{
+#ifdef HAVE_SSL
+   if (ns && ns->opt & NSF_USE_SSL && sd != -1 && FD_ISSET(sd, rd)
+       && SSL_pending(ns->ns_ssl.ssl) > 0)
+     return 1;
+#endif
+   return 0;
+}
+
+
+/*
+ * wait for something to happen, for at most tvp if it is set.  with -B
+ * the descriptors are polled without sleeping for up to the spin window
+ * first, so traffic that shows up soon doesn't pay for a wakeup.
+ */
+static int
+io_pipe_select(nfds, rd, wr, tvp)
+   int nfds;
+   fd_set *rd, *wr;
+   struct timeval *tvp;
+{
+   fd_set srd, swr;
+   struct timeval tv;
+   u_int64_t start;
+   int ret;
+   
+   if (opts.busy_poll)
+     {
+	start = stats_now();
+	do
+	  {
+	     srd = *rd;
+	     swr = *wr;
+	     tv.tv_sec = 0;
+	     tv.tv_usec = 0;
+	     ret = select(nfds, &srd, &swr, NULL, &tv);
+	     if (ret != 0)
+	       {
+		  *rd = srd;
+		  *wr = swr;
+		  return ret;
+	       }
+	  }
+	while (stats_now() - start < opts.busy_poll);
+     }
+   return select(nfds, rd, wr, NULL, tvp);
+}
+
+
 /*
  * decide which descriptors to use
  */
@@ -214,11 +1400,11 @@ io_pipe_decide_desc(ns1, in1p, out1p,
  */
 static void
 io_pipe_setfds(rd, wr,
-	       rbl, lbl, 
+	       rio, lio, 
 	       in1_sd, out1_sd, 
 	       in2_sd, out2_sd)
    fd_set *rd, *wr;
-   size_t rbl, lbl;
+   iobuf_t *rio, *lio;
    int in1_sd, out1_sd;
    int out2_sd, in2_sd;
 {
@@ -227,19 +1413,19 @@ io_pipe_setfds(rd, wr,
    FD_ZERO(wr);
    
    /* want to read more (if buffer size allows) from remote */
-   if (rbl >= 0 && rbl < NSOCK_IOP_BLOCKSZ)
+   if (IOBUF_CAN_READ(rio) && !rio->eof)
      FD_SET(in1_sd, rd);
    
    /* want to read more (if buffer size allows) from local */
-   if (lbl >= 0 && lbl < NSOCK_IOP_BLOCKSZ)
+   if (IOBUF_CAN_READ(lio) && !lio->eof)
      FD_SET(in2_sd, rd);
    
    /* need to write to remote? */
-   if (lbl)
+   if (IOBUF_MUST_WRITE(lio))
      FD_SET(out1_sd, wr);
    
    /* need to write to local? */
-   if (rbl)
+   if (IOBUF_MUST_WRITE(rio))
      FD_SET(out2_sd, wr);
 }
 
@@ -256,32 +1442,75 @@ io_pipe_buf_append(ns, sd, io, osd, oio, opts)
    u_char opts;
 {
    ssize_t len;
+   u_char *rbuf;
+   size_t room = IOBUF_ROOM(io);
+   size_t old_len = io->len;
+   u_int64_t kstamp = 0;
+   
+   if (io_pipe_attach(io) == -1)
+     {
+	if (ns)
+	  return nsock_error(ns, NSERR_OUT_OF_MEMORY);
+	return -1;
+     }
+   rbuf = io->buf + io->len;
+   
+   /* compressed data goes to the decoder first */
+   if (io->dec)
+     {
+	rbuf = io->dec->wire + io->dec->len;
+	room = CODEC_WIRE_SZ - io->dec->len;
+     }
 
    /* append to the buffer, possibly fill it */
 #ifdef HAVE_SSL
    if (ns && ns->opt & NSF_USE_SSL)
-     len = SSL_read(ns->ns_ssl.ssl, io->buf + io->len,
-		    NSOCK_IOP_BLOCKSZ - io->len);
+     len = SSL_read(ns->ns_ssl.ssl, rbuf, room);
    else
 #endif
-     len = read(sd, io->buf + io->len,
-		NSOCK_IOP_BLOCKSZ - io->len);
+   if (io->rts)
+     len = ts_read(io->rts, rbuf, room, &kstamp);
+   else
+     len = read(sd, rbuf, room);
    switch (len)
      {
       case -1:
+#ifdef HAVE_SSL
+	/* a record with no data in it, such as a session ticket */
+	if (ns && ns->opt & NSF_USE_SSL
+	    && SSL_get_error(ns->ns_ssl.ssl, len) == SSL_ERROR_WANT_READ)
+	  {
+	     io_pipe_release(io);
+	     return 0;
+	  }
+#endif
 	if (ns)
 	  return nsock_error(ns, NSERR_READ_ERROR);
 	return -1;
 	break;
 	
       case 0:
+	io->eof = IOBUF_EOF_READ;
 	if (ns)
 	  return nsock_error(ns, NSERR_READ_EOF);
 	return -1;
 	break;
 	
       default:
+	if (io->dec)
+	  {
+	     io->dec->len += len;
+	     len = codec_decode(io->dec, io->buf + io->len, IOBUF_ROOM(io));
+	     if (len < 0)
+	       {
+		  if (ns)
+		    return nsock_error(ns, NSERR_READ_ERROR);
+		  return -1;
+	       }
+	  }
 	io->len += len;
+	if (!io->kstamp)
+	  io->kstamp = kstamp;
 	
 	/* if we are dealing with telnet stuff look for some options */
 	if (osd != -1 && oio && opts & NSCIOP_ACK_TELNET)
@@ -335,22 +1564,23 @@ io_pipe_buf_append(ns, sd, io, osd, oio, opts)
 		       io->len -= 3;
 		       len -= 3;
 		       
-		       /* add to output buffer */
-		       if (oio->len + 3 < NSOCK_IOP_BLOCKSZ)
-			 {
-			    memcpy(oio->buf + oio->len, &tout, 3);
-			    oio->len += 3;
-			 }
-		       else
-			 {
-			    /* write it out directly if no room in buffer */
-			    write(osd, &tout, 3);
-			 }
+		       /* queue it to go out with the other direction */
+		       io_pipe_reply(oio, osd, &tout);
 		    }
 	       }
 	  }
 	break;
      }
+   
+   /* the recording gets what is left after telnet and the decoder */
+   if (io->rec && io->len > old_len)
+     rec_write(io->rec, io->rec_dir, io->buf + old_len, io->len - old_len);
+   if (io->sum && io->len > old_len)
+     csum_update(io->sum, io->buf + old_len, io->len - old_len);
+   
+   /* telnet options or a partial frame may have left nothing */
+   io_pipe_release(io);
+   
    /* ok.. we success full read the stuf... */
    return len;
 }
@@ -367,13 +1597,72 @@ io_pipe_buf_flush(ns, sd, io, opts)
    u_char opts;
 {
    ssize_t len;
+   u_char *wbuf = io->buf;
+   size_t *wlen = &(io->len);
+   size_t n;
+   u_int64_t written = 0, now = 0;
+   
+   /* telnet replies go out in one writev() with the data around them,
+    * or become part of the data where only the buffer can be written */
+   if (io->ctl_len)
+     {
+	if (!io->enc && !io->zc && !io->wts && !io->shape[0] && !io->shape[1]
+#ifdef HAVE_SSL
+	    && !(ns && ns->opt & NSF_USE_SSL)
+#endif
+	    )
+	  return io_pipe_writev(ns, sd, io, opts);
+	if (io_pipe_ctl_fold(io) == -1)
+	  {
+	     if (ns)
+	       return nsock_error(ns, NSERR_OUT_OF_MEMORY);
+	     return -1;
+	  }
+     }
+   
+   /* a compressed link sends whatever is buffered as one frame, once
+    * the last one is out of the way */
+   if (io->enc)
+     {
+	if (io->enc->len == 0 && io->len > 0)
+	  {
+	     if (opts & NSCIOP_STDOUT_TOO
+		 && sd != fileno(stdout))
+	       write(fileno(stdout), io->buf, io->len);
+	     if (codec_encode(io->enc, io->buf, io->len) == -1)
+	       {
+		  if (ns)
+		    return nsock_error(ns, NSERR_WRITE_ERROR);
+		  return -1;
+	       }
+	     io->len = 0;
+	  }
+	wbuf = io->enc->wire;
+	wlen = &(io->enc->len);
+     }
 
+   /* no more than the rate limits allow, maybe nothing this time */
+   n = *wlen;
+   if (io->shape[0] || io->shape[1])
+     {
+	now = stats_now();
+	if ((n = io_pipe_shape_room(io, now)) > *wlen)
+	  n = *wlen;
+	if (n == 0)
+	  return 0;
+     }
+   
+   if (io->wts)
+     written = stats_wall();
 #ifdef HAVE_SSL
    if (ns && ns->opt & NSF_USE_SSL)
-     len = SSL_write(ns->ns_ssl.ssl, io->buf, io->len);
+     len = SSL_write(ns->ns_ssl.ssl, wbuf, n);
    else
 #endif
-     len = write(sd, io->buf, io->len);
+   if (io->zc)
+     len = zc_send(io->zc, wbuf, n);
+   else
+     len = write(sd, wbuf, n);
    switch (len)
      {
       case -1:
@@ -389,26 +1678,68 @@ io_pipe_buf_flush(ns, sd, io, opts)
 	break;
 	
       default:
-	if (len < io->len)
+	/* possibly additionally write the buffer to stdout
+	 * (not if already writing to stdout, compressed data was
+	 * written out before it was encoded)
+	 */
+	if (opts & NSCIOP_STDOUT_TOO
+	    && !io->enc
+	    && sd != fileno(stdout))
+	  write(fileno(stdout), wbuf, len);
+	if (io->wts)
+	  ts_sent(io->wts, len, written, io->kstamp);
+	if (io->shape[0])
+	  shape_take(io->shape[0], len, now);
+	if (io->shape[1])
+	  shape_take(io->shape[1], len, now);
+	
+	if (io->zc && io->zc->pinned)
+	  {
+	     u_char *nbuf;
+	     
+	     /* the kernel still reads from this one, carry on in another */
+	     if (!(nbuf = zc_get(io->zc)))
+	       {
+		  if (ns)
+		    return nsock_error(ns, NSERR_WRITE_ERROR);
+		  return -1;
+	       }
+	     memcpy(nbuf, wbuf + len, *wlen - len);
+	     zc_retire(io->zc, io->buf);
+	     io->buf = nbuf;
+	     *wlen -= len;
+	  }
+	else if (len < *wlen)
 	  {
 	     /* move the data that remains to the beginning of the buffer */
-	     memmove(io->buf, io->buf + len, io->len - len);
-	     io->len -= len;
+	     memmove(wbuf, wbuf + len, *wlen - len);
+	     *wlen -= len;
 	  }
 	else
-	  io->len = 0;
+	  *wlen = 0;
 	break;
      }
    
-   /* possibly additionally write the buffer to stdout
-    * (not if already writing to stdout)
-    */
-   if (opts & NSCIOP_STDOUT_TOO
-       && sd != fileno(stdout))
-     write(fileno(stdout), io->buf, len);
+   /* there may be compressed data waiting for room in this buffer */
+   if (io->dec && io->dec->len)
+     {
+	ssize_t dlen;
+	
+	dlen = codec_decode(io->dec, io->buf + io->len, IOBUF_ROOM(io));
+	if (dlen < 0)
+	  {
+	     if (ns)
+	       return nsock_error(ns, NSERR_READ_ERROR);
+	     return -1;
+	  }
+	io->len += dlen;
+     }
    
    /* reset buffer.. */
    if (io->len == 0)
-     memset(io->buf, 0, NSOCK_IOP_BLOCKSZ);
+     {
+	io->kstamp = 0;
+	io_pipe_release(io);
+     }
    return len;
 }
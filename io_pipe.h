@@ -3,6 +3,12 @@
 
 #define NSCIOP_ACK_TELNET 	0x01
 #define NSCIOP_STDOUT_TOO 	0x02
+#define NSCIOP_COMPRESS_1 	0x04	/* remote link is compressed (-j) */
+#define NSCIOP_COMPRESS_2 	0x08	/* local link is compressed (-J) */
+#define NSCIOP_STRIPE 		0x10	/* remote is a group of connections (-P) */
+#define NSCIOP_ZEROCOPY 	0x20	/* send to sockets with MSG_ZEROCOPY (-Z) */
+#define NSCIOP_TSTAMP 		0x40	/* kernel timestamps on both sockets (-y) */
+#define NSCIOP_RECORD 		0x80	/* write what is read to a file (-o) */
 
 int nsc_io_pipe(nsock_t *, int, int, nsock_t *, int, int, u_char);
 
@@ -0,0 +1,981 @@
+/*
+ * many sessions over a few long lived connections.
+ *
+ * with -m a single process owns the listener and carries every client
+ * as a stream over one or more connections to the pipe host, which is
+ * another nsc running with -N.  that end opens a connection to its own
+ * pipe host for every stream.  new sessions cost one frame instead of
+ * a handshake, and the tunnels stay out of slow start.
+ *
+ * each stream may only have MUX_WINDOW_SZ bytes outstanding, so one
+ * slow reader can not make the others wait behind it.  a client that
+ * is done sending is passed on as MUX_SHUT and a shutdown() at the
+ * other end, and the stream lives on until the reply has been sent.  poll() is used
+ * rather than select() since one process holds all the sessions, and
+ * for the same reason connections to the pipe host are made without
+ * waiting for them: a stream or tunnel sits out of the loop until its
+ * socket is writable or -w secs have passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "backend.h"
+#include "stats.h"
+#include "mux.h"
+#include "pool.h"
+
+
+/* what a pollfd belongs to */
+typedef struct __nsc_mux_slot_stru
+{
+   tunnel_t *tun;
+   stream_t *st; 		/* NULL for the tunnel itself */
+} slot_t;
+
+
+/* set by the -T signal handler in nsc.c */
+extern volatile sig_atomic_t stop_requested;
+
+static tunnel_t tunnels[MUX_MAX_TUNNELS];
+static u_int ntunnels;
+static int listen_sd = -1; 	/* only on the -m side */
+static u_int32_t next_id = 1;
+static u_int nstreams;
+static stream_t *graveyard; 	/* freed once nothing can point at them */
+static pool_t streams = { sizeof(stream_t), 0, NULL, 0, 0 };
+
+
+static int mux_loop(void);
+static int mux_tunnel_up(tunnel_t *);
+static void mux_tunnel_connected(tunnel_t *);
+static void mux_tunnel_down(tunnel_t *);
+static void mux_tunnel_read(tunnel_t *);
+static void mux_tunnel_write(tunnel_t *);
+static int mux_dispatch(tunnel_t *, u_int32_t, u_int, u_int, u_char *, size_t);
+static void mux_accept(void);
+static stream_t *mux_stream_new(tunnel_t *, u_int32_t, int);
+static stream_t *mux_stream_find(tunnel_t *, u_int32_t);
+static void mux_stream_connected(stream_t *);
+static void mux_stream_close(stream_t *, int);
+static void mux_stream_free(stream_t *);
+static void mux_stream_free_buf(stream_t *);
+static void mux_stream_read(stream_t *);
+static void mux_stream_write(stream_t *);
+static void mux_stream_drained(stream_t *);
+static ssize_t mux_stream_send(stream_t *, u_char *, size_t);
+static u_char *mux_reserve(tunnel_t *, size_t);
+static void mux_frame(tunnel_t *, u_int32_t, u_int, u_char *, size_t);
+static void mux_put_hdr(u_char *, u_int32_t, u_int, size_t);
+static void mux_nonblock(int);
+
+
+/*
+ * the -m side.  carry every client of the listener over opts.mux
+ * tunnels.  does not return.
+ */
+void
+mux_listen(listener)
+   nsock_t *listener;
+{
+   u_int i;
+
+   signal(SIGPIPE, SIG_IGN);
+   listen_sd = listener->sd;
+   mux_nonblock(listen_sd);
+
+   /* start with every tunnel up.  ones that fail are tried again when
+    * a client shows up */
+   ntunnels = opts.mux;
+   for (i = 0; i < ntunnels; i++)
+     {
+	tunnels[i].sd = -1;
+	if (mux_tunnel_up(&tunnels[i]) == -1 && opts.verbosity > 0)
+	  fprintf(stderr, "tunnel %u: unable to reach the pipe host\n", i);
+     }
+   mux_loop();
+   exit(1);
+}
+
+
+/*
+ * the -N side.  serve the streams of one tunnel until it goes away.
+ */
+int
+mux_serve(ns)
+   nsock_t *ns;
+{
+   tunnel_t *t = &tunnels[0];
+
+   signal(SIGPIPE, SIG_IGN);
+   ntunnels = 1;
+   t->ns = ns;
+   t->sd = ns->sd;
+   if (!(t->in = malloc(MUX_IN_SZ)))
+     return nsock_error(ns, NSERR_OUT_OF_MEMORY);
+   mux_nonblock(t->sd);
+   mux_frame(t, 0, MUX_HELLO, NULL, 0);
+   return mux_loop();
+}
+
+
+/*
+ * wait for and handle events on everything until the tunnel of a -N
+ * side goes down.
+ */
+static int
+mux_loop(void)
+{
+   struct pollfd *pfd = NULL;
+   slot_t *slot = NULL;
+   u_int nalloc = 0, n, i, j;
+   u_int64_t now, wake;
+   int timeout;
+   tunnel_t *t;
+   stream_t *st;
+
+   while (1)
+     {
+	if (stop_requested)
+	  {
+	     stats_report();
+	     exit(0);
+	  }
+
+	/* one for the listener, each tunnel and each stream */
+	if (nalloc < 1 + ntunnels + nstreams)
+	  {
+	     nalloc = (1 + ntunnels + nstreams) * 2;
+	     pfd = realloc(pfd, nalloc * sizeof(*pfd));
+	     slot = realloc(slot, nalloc * sizeof(*slot));
+	     if (!pfd || !slot)
+	       {
+		  perror("mux");
+		  exit(1);
+	       }
+	  }
+
+	n = 0;
+	wake = 0;
+	if (listen_sd != -1)
+	  {
+	     pfd[n].fd = listen_sd;
+	     pfd[n].events = POLLIN;
+	     slot[n].tun = NULL;
+	     slot[n++].st = NULL;
+	  }
+	for (i = 0; i < ntunnels; i++)
+	  {
+	     t = &tunnels[i];
+	     if (t->sd == -1)
+	       continue;
+	     pfd[n].fd = t->sd;
+	     pfd[n].events = POLLIN | (t->out_len ? POLLOUT : 0);
+	     if (t->connecting)
+	       {
+		  pfd[n].events = POLLOUT;
+		  if (!wake || t->conn.deadline < wake)
+		    wake = t->conn.deadline;
+	       }
+	     slot[n].tun = t;
+	     slot[n++].st = NULL;
+	     for (j = 0; j < MUX_HASH; j++)
+	       for (st = t->hash[j]; st; st = st->next)
+		 {
+		    pfd[n].events = 0;
+		    if (st->connecting)
+		      {
+			 pfd[n].events = POLLOUT;
+			 if (!wake || st->conn.deadline < wake)
+			   wake = st->conn.deadline;
+		      }
+		    else if (st->window > 0 && !st->peer_done
+			     && !st->local_done && t->out_len < MUX_TUNNEL_HIGH)
+		      pfd[n].events |= POLLIN;
+		    if (st->len)
+		      pfd[n].events |= POLLOUT;
+		    if (!pfd[n].events)
+		      continue;
+		    pfd[n].fd = st->sd;
+		    slot[n].tun = t;
+		    slot[n++].st = st;
+		 }
+	  }
+
+	/* wake up for the first connection to run out of time */
+	timeout = -1;
+	if (wake)
+	  {
+	     now = stats_now();
+	     timeout = wake > now ? (wake - now) / 1000 + 1 : 0;
+	  }
+	if (poll(pfd, n, timeout) == -1)
+	  {
+	     if (errno == EINTR)
+	       continue;
+	     perror("poll");
+	     exit(1);
+	  }
+
+	now = wake ? stats_now() : 0;
+	for (i = 0; i < n; i++)
+	  {
+	     t = slot[i].tun;
+	     st = slot[i].st;
+	     if (t && (st ? !st->dead && st->connecting : t->connecting))
+	       {
+		  if (pfd[i].revents
+		      || now >= (st ? st->conn.deadline : t->conn.deadline))
+		    {
+		       if (st)
+			 mux_stream_connected(st);
+		       else
+			 mux_tunnel_connected(t);
+		    }
+		  continue;
+	       }
+	     if (!pfd[i].revents)
+	       continue;
+	     if (!t)
+	       mux_accept();
+	     else if (!st)
+	       {
+		  if (t->sd != -1 && pfd[i].revents & POLLOUT)
+		    mux_tunnel_write(t);
+		  if (t->sd != -1 && pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+		    mux_tunnel_read(t);
+	       }
+	     else if (!st->dead)
+	       {
+		  if (pfd[i].revents & (POLLOUT | POLLERR))
+		    mux_stream_write(st);
+		  if (!st->dead && pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+		    mux_stream_read(st);
+	       }
+	  }
+
+	/* send what was queued right away rather than after another poll */
+	for (i = 0; i < ntunnels; i++)
+	  if (tunnels[i].sd != -1 && !tunnels[i].connecting
+	      && tunnels[i].out_len)
+	    mux_tunnel_write(&tunnels[i]);
+
+	while ((st = graveyard))
+	  {
+	     graveyard = st->next;
+	     mux_stream_free(st);
+	  }
+
+	/* the -N side is done when its only tunnel is */
+	if (listen_sd == -1 && tunnels[0].sd == -1)
+	  {
+	     free(pfd);
+	     free(slot);
+	     return -1;
+	  }
+     }
+}
+
+
+/*
+ * start connecting a tunnel to the pipe host.  the hello, and whatever
+ * streams are opened meanwhile, wait in its output until it is up.
+ */
+static int
+mux_tunnel_up(t)
+   tunnel_t *t;
+{
+   if (!t->in && !(t->in = malloc(MUX_IN_SZ)))
+     return -1;
+   if (backend_connect_start(&(t->conn), NULL) == -1)
+     return -1;
+   t->connecting = 1;
+   t->sd = t->conn.sd;
+   t->hello = 0;
+   t->in_len = 0;
+   t->out_off = t->out_len = 0;
+   mux_frame(t, 0, MUX_HELLO, NULL, 0);
+   return 0;
+}
+
+
+/*
+ * the tunnel's socket became writable or ran out of time
+ */
+static void
+mux_tunnel_connected(t)
+   tunnel_t *t;
+{
+   nsock_t *ns;
+   int one = 1;
+
+   if (!(ns = backend_connect_check(&(t->conn))))
+     {
+	/* still going, maybe to the next pipe host */
+	if ((t->sd = t->conn.sd) != -1)
+	  return;
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "tunnel %u: unable to reach the pipe host\n",
+		  (u_int)(t - tunnels));
+	mux_tunnel_down(t);
+	return;
+     }
+   t->connecting = 0;
+   t->ns = ns;
+   t->be = backend_detach();
+   t->sd = ns->sd;
+
+   /* frames are already as big as they are going to get */
+   if (ns->domain != PF_UNIX)
+     setsockopt(t->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+
+/*
+ * a tunnel went away, and all of its streams with it
+ */
+static void
+mux_tunnel_down(t)
+   tunnel_t *t;
+{
+   stream_t *st;
+   u_int i;
+
+   for (i = 0; i < MUX_HASH; i++)
+     while ((st = t->hash[i]))
+       mux_stream_close(st, 0);
+
+   /* the -N side leaves its tunnel to main() */
+   if (t->connecting)
+     {
+	backend_connect_abort(&(t->conn));
+	t->connecting = 0;
+     }
+   else if (listen_sd != -1)
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "tunnel to %s lost\n", t->be ? t->be->host : (u_char *)"?");
+	nsock_close(t->ns);
+	t->ns = NULL;
+	backend_put(t->be);
+	t->be = NULL;
+     }
+   t->sd = -1;
+   t->in_len = 0;
+   t->out_off = t->out_len = 0;
+}
+
+
+/*
+ * read what the peer sent and act on every complete frame
+ */
+static void
+mux_tunnel_read(t)
+   tunnel_t *t;
+{
+   ssize_t len;
+   size_t off = 0, plen;
+   u_char *p;
+
+   len = read(t->sd, t->in + t->in_len, MUX_IN_SZ - t->in_len);
+   if (len == -1 && (errno == EAGAIN || errno == EINTR))
+     return;
+   if (len < 1)
+     {
+	if (t->ns)
+	  nsock_error(t->ns, len == 0 ? NSERR_READ_EOF : NSERR_READ_ERROR);
+	mux_tunnel_down(t);
+	return;
+     }
+   t->in_len += len;
+
+   while (t->in_len - off >= MUX_HDR_LEN)
+     {
+	p = t->in + off;
+	plen = (p[6] << 8) | p[7];
+	if (plen > MUX_MAX_DATA)
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "tunnel: frame too large\n");
+	     mux_tunnel_down(t);
+	     return;
+	  }
+	if (t->in_len - off < MUX_HDR_LEN + plen)
+	  break;
+	if (mux_dispatch(t, (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3],
+			 p[4], p[5], p + MUX_HDR_LEN, plen) == -1)
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "tunnel: protocol error\n");
+	     if (t->ns)
+	       nsock_error(t->ns, NSERR_READ_ERROR);
+	     mux_tunnel_down(t);
+	     return;
+	  }
+	off += MUX_HDR_LEN + plen;
+     }
+
+   /* keep the partial frame for next time */
+   if (off)
+     {
+	memmove(t->in, t->in + off, t->in_len - off);
+	t->in_len -= off;
+     }
+}
+
+
+/*
+ * send as much of the queued frames as the socket will take
+ */
+static void
+mux_tunnel_write(t)
+   tunnel_t *t;
+{
+   ssize_t len;
+
+   len = write(t->sd, t->out + t->out_off, t->out_len);
+   if (len == -1)
+     {
+	if (errno == EAGAIN || errno == EINTR)
+	  return;
+	if (t->ns)
+	  nsock_error(t->ns, NSERR_WRITE_ERROR);
+	mux_tunnel_down(t);
+	return;
+     }
+   t->out_off += len;
+   t->out_len -= len;
+   if (t->out_len == 0)
+     t->out_off = 0;
+}
+
+
+/*
+ * act on one frame
+ */
+static int
+mux_dispatch(t, id, type, version, data, len)
+   tunnel_t *t;
+   u_int32_t id;
+   u_int type, version;
+   u_char *data;
+   size_t len;
+{
+   stream_t *st;
+
+   if (!t->hello)
+     {
+	if (type != MUX_HELLO || version != MUX_VERSION)
+	  return -1;
+	t->hello = 1;
+	return 0;
+     }
+
+   /* frames for streams that were closed on this end are expected, the
+    * peer may not have heard about it yet */
+   st = mux_stream_find(t, id);
+   switch (type)
+     {
+      case MUX_OPEN:
+	  {
+	     backend_conn_t conn;
+
+	     /* only the -N side is asked to open streams */
+	     if (listen_sd != -1 || st || id == 0)
+	       return -1;
+
+	     /* what the client sends meanwhile is kept in the stream's
+	      * buffer like for one that is slow to read */
+	     if (backend_connect_start(&conn, NULL) == -1)
+	       {
+		  mux_frame(t, id, MUX_CLOSE, NULL, 0);
+		  break;
+	       }
+	     if (!(st = mux_stream_new(t, id, conn.sd)))
+	       {
+		  backend_connect_abort(&conn);
+		  mux_frame(t, id, MUX_CLOSE, NULL, 0);
+		  break;
+	       }
+	     st->conn = conn;
+	     st->connecting = 1;
+	  }
+	break;
+
+      case MUX_DATA:
+	if (!st)
+	  break;
+	if (st->len + len > MUX_WINDOW_SZ)
+	  return -1;
+
+	/* most of the time it can all go out right now, and only what
+	 * the client won't take yet needs a buffer */
+	if (!st->len && !st->connecting)
+	  {
+	     ssize_t n;
+
+	     if ((n = mux_stream_send(st, data, len)) == -1)
+	       break;
+	     data += n;
+	     len -= n;
+	     if (!len)
+	       break;
+	  }
+
+	/* make room at the end of the stream buffer */
+	if (st->off + st->len + len > st->size)
+	  {
+	     if (st->off)
+	       {
+		  memmove(st->buf, st->buf + st->off, st->len);
+		  st->off = 0;
+	       }
+	     if (st->len + len > st->size)
+	       {
+		  size_t size = st->size ? st->size * 2 : MUX_MAX_DATA;
+		  u_char *p;
+
+		  while (size < st->len + len)
+		    size *= 2;
+		  /* the first block comes from the pool */
+		  if (size == MUX_MAX_DATA)
+		    p = pool_get(&pool_blocks);
+		  else if ((p = malloc(size)))
+		    memcpy(p, st->buf, st->len);
+		  if (!p)
+		    {
+		       mux_stream_close(st, 1);
+		       break;
+		    }
+		  mux_stream_free_buf(st);
+		  st->buf = p;
+		  st->size = size;
+	       }
+	  }
+	memcpy(st->buf + st->off + st->len, data, len);
+	st->len += len;
+	break;
+
+      case MUX_CLOSE:
+	if (!st)
+	  break;
+	st->peer_done = 1;
+	if (!st->len)
+	  mux_stream_close(st, 0);
+	break;
+
+      case MUX_SHUT:
+	if (!st)
+	  break;
+	st->peer_shut = 1;
+	if (!st->len && !st->connecting)
+	  mux_stream_drained(st);
+	break;
+
+      case MUX_WINDOW:
+	if (len != 4)
+	  return -1;
+	if (st)
+	  st->window += (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	break;
+
+      default:
+	return -1;
+     }
+   return 0;
+}
+
+
+/*
+ * take every waiting client and give each a stream on the least busy
+ * tunnel
+ */
+static void
+mux_accept(void)
+{
+   tunnel_t *t, *best;
+   stream_t *st;
+   int sd;
+   u_int i;
+
+   while ((sd = accept(listen_sd, NULL, NULL)) != -1)
+     {
+	STAT_INC(accepts);
+
+	best = NULL;
+	for (i = 0; i < ntunnels; i++)
+	  {
+	     t = &tunnels[i];
+	     if (t->sd == -1 && mux_tunnel_up(t) == -1)
+	       continue;
+	     if (!best || t->streams < best->streams)
+	       best = t;
+	  }
+	if (!best || !(st = mux_stream_new(best, next_id, sd)))
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "no tunnel for a new client\n");
+	     close(sd);
+	     continue;
+	  }
+	mux_frame(best, next_id, MUX_OPEN, NULL, 0);
+
+	/* 0 is for the tunnel itself */
+	if (!++next_id)
+	  next_id = 1;
+     }
+}
+
+
+/*
+ * start tracking a stream
+ */
+static stream_t *
+mux_stream_new(t, id, sd)
+   tunnel_t *t;
+   u_int32_t id;
+   int sd;
+{
+   stream_t *st;
+
+   if (!(st = pool_get(&streams)))
+     return NULL;
+   memset(st, 0, sizeof(stream_t));
+   st->id = id;
+   st->sd = sd;
+   st->tun = t;
+   st->window = MUX_WINDOW_SZ;
+   mux_nonblock(sd);
+
+   st->next = t->hash[id % MUX_HASH];
+   t->hash[id % MUX_HASH] = st;
+   t->streams++;
+   nstreams++;
+   STAT_INC(sessions_total);
+   STAT_INC(sessions_active);
+   return st;
+}
+
+
+static stream_t *
+mux_stream_find(t, id)
+   tunnel_t *t;
+   u_int32_t id;
+{
+   stream_t *st;
+
+   for (st = t->hash[id % MUX_HASH]; st; st = st->next)
+     if (st->id == id)
+       return st;
+   return NULL;
+}
+
+
+/*
+ * the socket to a stream's pipe host became writable or ran out of time
+ */
+static void
+mux_stream_connected(st)
+   stream_t *st;
+{
+   nsock_t *ns;
+
+   if (!(ns = backend_connect_check(&(st->conn))))
+     {
+	if ((st->sd = st->conn.sd) == -1)
+	  mux_stream_close(st, 1);
+	return;
+     }
+   st->connecting = 0;
+   st->ns = ns;
+   st->be = backend_detach();
+   st->sd = ns->sd;
+   if (!st->len)
+     mux_stream_drained(st);
+}
+
+
+/*
+ * done with a stream, maybe letting the peer know.  the memory is
+ * freed once the current round of events has been handled.
+ */
+static void
+mux_stream_close(st, tell)
+   stream_t *st;
+   int tell;
+{
+   tunnel_t *t = st->tun;
+   stream_t **pp;
+
+   if (tell && t->sd != -1)
+     mux_frame(t, st->id, MUX_CLOSE, NULL, 0);
+
+   if (st->connecting)
+     backend_connect_abort(&(st->conn));
+   else if (st->ns)
+     {
+	nsock_close(st->ns);
+	st->ns = NULL;
+     }
+   else
+     close(st->sd);
+   backend_put(st->be);
+
+   for (pp = &(t->hash[st->id % MUX_HASH]); *pp; pp = &((*pp)->next))
+     if (*pp == st)
+       {
+	  *pp = st->next;
+	  break;
+       }
+   t->streams--;
+   nstreams--;
+   STAT_DEC(sessions_active);
+
+   st->dead = 1;
+   st->next = graveyard;
+   graveyard = st;
+}
+
+
+static void
+mux_stream_free(st)
+   stream_t *st;
+{
+   mux_stream_free_buf(st);
+   pool_put(&streams, st);
+}
+
+
+/*
+ * buffers start out as a pooled block and only grow past it for
+ * streams the peer floods
+ */
+static void
+mux_stream_free_buf(st)
+   stream_t *st;
+{
+   if (st->size == MUX_MAX_DATA)
+     pool_put(&pool_blocks, st->buf);
+   else
+     free(st->buf);
+}
+
+
+/*
+ * read from a stream straight into a data frame
+ */
+static void
+mux_stream_read(st)
+   stream_t *st;
+{
+   tunnel_t *t = st->tun;
+   size_t room;
+   ssize_t len;
+   u_char *p;
+
+   room = st->window < MUX_MAX_DATA ? st->window : MUX_MAX_DATA;
+   if (!(p = mux_reserve(t, MUX_HDR_LEN + room)))
+     return;
+   len = read(st->sd, p + MUX_HDR_LEN, room);
+   if (len == -1 && (errno == EAGAIN || errno == EINTR))
+     return;
+   if (len == -1)
+     {
+	mux_stream_close(st, 1);
+	return;
+     }
+
+   /* the reply may still be on its way */
+   if (len == 0)
+     {
+	mux_frame(t, st->id, MUX_SHUT, NULL, 0);
+	st->local_done = 1;
+	if (st->shut)
+	  mux_stream_close(st, 0);
+	return;
+     }
+   mux_put_hdr(p, st->id, MUX_DATA, len);
+   t->out_len += MUX_HDR_LEN + len;
+   st->window -= len;
+   STAT_ADD(bytes[listen_sd != -1 ? STATS_IN : STATS_OUT], len);
+}
+
+
+/*
+ * write what the peer sent, and give credit back as it goes out
+ */
+static void
+mux_stream_write(st)
+   stream_t *st;
+{
+   ssize_t len;
+
+   if ((len = mux_stream_send(st, st->buf + st->off, st->len)) == -1)
+     return;
+   st->off += len;
+   st->len -= len;
+
+   /* idle streams don't hold on to a buffer */
+   if (!st->len)
+     {
+	mux_stream_free_buf(st);
+	st->buf = NULL;
+	st->off = st->size = 0;
+	mux_stream_drained(st);
+     }
+}
+
+
+/*
+ * everything the peer sent has been written.  pass on its close or
+ * half-close, and the stream is done once both sides are.
+ */
+static void
+mux_stream_drained(st)
+   stream_t *st;
+{
+   if (st->peer_done)
+     mux_stream_close(st, 0);
+   else if (st->peer_shut && !st->shut)
+     {
+	shutdown(st->sd, SHUT_WR);
+	st->shut = 1;
+	if (st->local_done)
+	  mux_stream_close(st, 0);
+     }
+}
+
+
+/*
+ * write to a stream's client and give the peer credit for it.  returns
+ * how much went out, or -1 if the stream had to be closed.
+ */
+static ssize_t
+mux_stream_send(st, data, len)
+   stream_t *st;
+   u_char *data;
+   size_t len;
+{
+   ssize_t n;
+   u_char credit[4];
+
+   if ((n = write(st->sd, data, len)) == -1)
+     {
+	if (errno == EAGAIN || errno == EINTR)
+	  return 0;
+	mux_stream_close(st, 1);
+	return -1;
+     }
+   STAT_ADD(bytes[listen_sd != -1 ? STATS_OUT : STATS_IN], n);
+
+   st->unacked += n;
+   if (st->unacked >= MUX_WINDOW_SZ / 4
+       && !st->peer_done && !st->peer_shut)
+     {
+	credit[0] = st->unacked >> 24;
+	credit[1] = st->unacked >> 16;
+	credit[2] = st->unacked >> 8;
+	credit[3] = st->unacked;
+	mux_frame(st->tun, st->id, MUX_WINDOW, credit, 4);
+	st->unacked = 0;
+     }
+   return n;
+}
+
+
+/*
+ * make sure there is room for len more bytes at the end of the
+ * tunnel's output
+ */
+static u_char *
+mux_reserve(t, len)
+   tunnel_t *t;
+   size_t len;
+{
+   if (t->out_off + t->out_len + len > t->out_size)
+     {
+	if (t->out_off)
+	  {
+	     memmove(t->out, t->out + t->out_off, t->out_len);
+	     t->out_off = 0;
+	  }
+	if (t->out_len + len > t->out_size)
+	  {
+	     size_t size = t->out_size ? t->out_size * 2 : 4 * (MUX_HDR_LEN + MUX_MAX_DATA);
+	     u_char *p;
+
+	     while (size < t->out_len + len)
+	       size *= 2;
+	     if (!(p = realloc(t->out, size)))
+	       return NULL;
+	     t->out = p;
+	     t->out_size = size;
+	  }
+     }
+   return t->out + t->out_off + t->out_len;
+}
+
+
+/*
+ * queue a frame on a tunnel
+ */
+static void
+mux_frame(t, id, type, data, len)
+   tunnel_t *t;
+   u_int32_t id;
+   u_int type;
+   u_char *data;
+   size_t len;
+{
+   u_char *p;
+
+   if (!(p = mux_reserve(t, MUX_HDR_LEN + len)))
+     return;
+   mux_put_hdr(p, id, type, len);
+   if (len)
+     memcpy(p + MUX_HDR_LEN, data, len);
+   t->out_len += MUX_HDR_LEN + len;
+}
+
+
+static void
+mux_put_hdr(p, id, type, len)
+   u_char *p;
+   u_int32_t id;
+   u_int type;
+   size_t len;
+{
+   p[0] = id >> 24;
+   p[1] = id >> 16;
+   p[2] = id >> 8;
+   p[3] = id;
+   p[4] = type;
+   p[5] = MUX_VERSION;
+   p[6] = len >> 8;
+   p[7] = len;
+}
+
+
+static void
+mux_nonblock(sd)
+   int sd;
+{
+   int fl;
+
+   if ((fl = fcntl(sd, F_GETFL)) != -1)
+     fcntl(sd, F_SETFL, fl | O_NONBLOCK);
+}
@@ -0,0 +1,82 @@
+/*
+ * many sessions over a few long lived connections (-m/-N)
+ */
+#ifndef __nsc_mux_h
+#define __nsc_mux_h
+
+/* every frame starts with a be32 stream id, the type, the protocol
+ * version and a be16 payload length */
+#define MUX_HDR_LEN 	8
+#define MUX_VERSION 	0x02
+
+#define MUX_HELLO 	0x00 	/* first frame each way, stream 0 */
+#define MUX_OPEN 	0x01 	/* a new session */
+#define MUX_DATA 	0x02
+#define MUX_CLOSE 	0x03 	/* the sender is done with the stream */
+#define MUX_WINDOW 	0x04 	/* be32 more bytes the receiver will take */
+#define MUX_SHUT 	0x05 	/* the sender has no more data for the stream */
+
+#define MUX_MAX_DATA 	NSOCK_IOP_BLOCKSZ
+#define MUX_MAX_TUNNELS 16
+
+/* tunnels read up to this much at once */
+#define MUX_IN_SZ 	(4 * (MUX_HDR_LEN + MUX_MAX_DATA))
+
+/* each stream may have this much in flight each way.  the receiver
+ * gives credit back once a quarter of it has been written out */
+#define MUX_WINDOW_SZ 	(256 * 1024)
+
+/* streams are not read while their tunnel has this much queued */
+#define MUX_TUNNEL_HIGH (256 * 1024)
+
+#define MUX_HASH 	256
+
+struct __nsc_mux_tunnel_stru;
+
+typedef struct __nsc_mux_stream_stru
+{
+   u_int32_t id;
+   int sd;
+   nsock_t *ns; 		/* pipe host connection (-N side) */
+   backend_t *be;
+   backend_conn_t conn; 	/* while it is being made */
+   u_char connecting;
+   struct __nsc_mux_tunnel_stru *tun;
+
+   u_char *buf; 		/* from the tunnel, waiting to be written */
+   size_t off, len, size;
+
+   u_int32_t window; 		/* what we may still send the peer */
+   u_int32_t unacked; 		/* written out, not yet credited back */
+   u_char peer_done; 		/* close once buf is empty */
+   u_char peer_shut; 		/* shut the write side once buf is empty */
+   u_char shut; 		/* which has been done */
+   u_char local_done; 		/* our side sent MUX_SHUT */
+   u_char dead;
+
+   struct __nsc_mux_stream_stru *next;
+} stream_t;
+
+typedef struct __nsc_mux_tunnel_stru
+{
+   int sd; 			/* -1 while down */
+   nsock_t *ns;
+   backend_t *be;
+   backend_conn_t conn; 	/* while it is being made */
+   u_char connecting;
+   u_char hello; 		/* peer said hello */
+
+   u_char *in; 			/* partial frames */
+   size_t in_len;
+
+   u_char *out; 		/* frames waiting to go out */
+   size_t out_off, out_len, out_size;
+
+   u_int streams;
+   stream_t *hash[MUX_HASH];
+} tunnel_t;
+
+void mux_listen(nsock_t *);
+int mux_serve(nsock_t *);
+
+#endif
@@ -14,6 +14,8 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 /* libnsock includes */
 #include <nsock/nsock.h>
@@ -21,15 +23,27 @@
 
 #include "nsc.h"
 #include "io_pipe.h"
+#include "backend.h"
+#include "unixsock.h"
+#include "stats.h"
+#include "compress.h"
+#include "mux.h"
+#include "stripe.h"
+#include "rules.h"
+#include "pool.h"
+#include "handoff.h"
+#include "record.h"
+#include "shape.h"
+#include "checksum.h"
+#include "tls.h"
 
 
 /* globals.. */
 options_t opts;
+volatile sig_atomic_t stop_requested = 0;
 
-void parse_argv(u_int, u_char **);
 nsock_t *get_incoming(void);
-nsock_t *connect_to_host(u_char *, u_char *, u_char);
-u_char *reverse_host(nsock_t *, struct sockaddr_storage *);
+void stop_listening(int);
 void show_usage(void);
 int exec_prog(int *, int *, pid_t *);
 
@@ -46,8 +60,23 @@ main(c, v)
    /* check out parameters */
    parse_argv(c, v);
    
+   /* the listeners may come from the nsc we replace */
+   if (opts.handoff && handoff_take(opts.handoff) == -1)
+     {
+	fprintf(stderr, "handoff: %s: %s\n", opts.handoff, strerror(errno));
+	return 1;
+     }
+   
+   /* a replay or load makes connections of its own */
+   if (opts.load_conns)
+     return load_run();
+   if (opts.replay)
+     return replay_run(opts.replay);
+   
    /* attempt to setup the listener/first connection */
-   if ((opts.flags & MODE_MASK) == MODE_LISTEN)
+   if (opts.rules)
+     csd = rules_serve(opts.rules);
+   else if ((opts.flags & MODE_MASK) == MODE_LISTEN)
      csd = get_incoming();
 
    /* connect to host */
@@ -56,20 +85,69 @@ main(c, v)
    if (!csd)
      return 1;
    
+#ifdef HAVE_SSL
+   /* clients are only accepted by the listener, the handshake is the
+    * session's own business */
+   if ((opts.flags & MODE_MASK) == MODE_LISTEN
+       && opts.flags & FLAG_USE_SSL_D
+       && !(opts.flags & FLAG_USE_UDP)
+       && tls_accept(csd, opts.dcert, opts.dkey) == -1)
+     {
+	nsock_close(csd);
+	return 1;
+     }
+#endif
+   
+   /* the rest of a striped group (the listener gathered its own) */
+   if (opts.stripe
+       && (opts.flags & MODE_MASK) == MODE_CONNECT
+       && stripe_connect(csd) == -1)
+     return 1;
+   
+   /* with -N each stream over the tunnel counts as a session instead */
+   if (!(opts.flags & FLAG_DEMUX))
+     {
+	STAT_INC(sessions_total);
+	STAT_INC(sessions_active);
+     }
+   if (stats && !stats_session_start)
+     stats_session_start = stats_now();
+   
    /* setup io_pipe options */
    if (opts.flags & FLAG_TELNET)
      iop_opts |= NSCIOP_ACK_TELNET;
    if (opts.flags & FLAG_STDOUT)
      iop_opts |= NSCIOP_STDOUT_TOO;
+   if (opts.codec[0])
+     iop_opts |= NSCIOP_COMPRESS_1;
+   if (opts.codec[1])
+     iop_opts |= NSCIOP_COMPRESS_2;
+   if (opts.stripe)
+     iop_opts |= NSCIOP_STRIPE;
+   if (opts.flags & FLAG_ZEROCOPY)
+     iop_opts |= NSCIOP_ZEROCOPY;
+   if (opts.flags & FLAG_TSTAMP)
+     iop_opts |= NSCIOP_TSTAMP;
+   if (opts.record)
+     iop_opts |= NSCIOP_RECORD;
+   if (opts.flags & FLAG_CHECKSUM)
+     csum_init();
    
    /* ok we have our first side setup.  what we do now
     * depends on whether or not a -d has been specified.
     */
-   if (opts.flags & FLAG_DATAPIPE)
+   if (opts.flags & FLAG_DEMUX)
+     io_ret = mux_serve(csd);
+   else if (opts.flags & FLAG_DATAPIPE)
      {
-	dsd = connect_to_host(opts.pshost, opts.phost, 1);
+	/* hash balancing keys on the address of the client */
+	dsd = backend_connect((opts.flags & MODE_MASK) == MODE_LISTEN
+			      ? &(csd->inet_fin) : NULL);
 	if (!dsd)
-	  return 1;
+	  {
+	     STAT_DEC(sessions_active);
+	     return 1;
+	  }
 #ifdef USE_NSOCK_IOP
 	io_ret = nsock_io_pipe(csd, -1, -1, dsd, -1, -1);
 #else
@@ -84,7 +162,10 @@ main(c, v)
 	to = csd->sd;
 	from = csd->sd;
 	if (exec_prog(&to, &from, &cpid) == -1)
-	  return 1;
+	  {
+	     STAT_DEC(sessions_active);
+	     return 1;
+	  }
 #ifdef USE_NSOCK_IOP
 	io_ret = nsock_io_pipe(csd, -1, -1, NULL, from, to);
 #else
@@ -102,6 +183,14 @@ main(c, v)
 #else
      io_ret = nsc_io_pipe(csd, -1, -1, NULL, fileno(stdin), fileno(stdout), iop_opts);
 #endif
+   if (!(opts.flags & FLAG_DEMUX))
+     STAT_DEC(sessions_active);
+   
+   /* sessions normally end with an EOF, that's not worth counting */
+   if (dsd && dsd->ns_errno != NSERR_READ_EOF)
+     stats_error(dsd->ns_errno);
+   if (csd->ns_errno != NSERR_READ_EOF)
+     stats_error(csd->ns_errno);
      
    if (io_ret != NSERR_SUCCESS && opts.verbosity > 0)
      {
@@ -118,8 +207,19 @@ main(c, v)
    else if (opts.verbosity > 1)
      fprintf(stderr, "input/output finished successfully\n");
    
+   if (opts.flags & FLAG_CHECKSUM)
+     csum_report();
+   
+   /* a -L listener reports when it is stopped instead */
+   if (opts.flags & FLAG_LATENCY
+       && !(opts.flags & FLAG_KEEP_LISTEN))
+     stats_report();
+   
    if (opts.flags & FLAG_DATAPIPE)
-     nsock_close(dsd);
+     {
+	nsock_close(dsd);
+	backend_release();
+     }
    nsock_close(csd);
    
    /* yay! */
@@ -141,44 +241,66 @@ show_usage(void)
 	   "usage:\n"
 	   "   connect out:  nsc [<options>] <dhost>:<dport>\n"
 	   "   listen:       nsc -l [<options>] <lhost>[:<lport>]\n"
+	   "   pipe hosts:   -d <phost>[,<phost>...]\n"
 	   "\n"
 	   "valid options:\n"
 #ifdef INET6
 	   "    -4           force IPv4 mode\n"
 	   "    -6           force IPv6 mode\n"
 #endif
+	   "    -A <spec>    cap buffers at <kbytes>[:<kbytes> set aside at start]\n"
+	   "    -a <spec>    limit all sessions together to <out>[:<in>] bytes/sec\n"
+	   "    -B <spec>    spin <usecs>[:<cpu>] before sleeping, pinned to <cpu> if given\n"
+	   "    -b <policy>  balance between pipe hosts: rr, lc or hash (default rr)\n"
 #ifdef HAVE_SSL
 	   "    -c <file>    use this SSL cert file (for connect/listen)\n"
 	   "    -C <file>    use this SSL cert file (for pipe host)\n"
 #endif
 	   /* new netcat -D: debugging */
 	   /* new netcat -d: dont read stdin */
+	   "    -D           print a CRC32C of what was sent and received when done\n"
 	   "    -d <phost>   pipe data to and from the specified host\n"
+	   "    -E <s>|<e>   health checks send <s> and expect <e> in the reply\n"
 	   "    -e <prog>    pipe data to and from the specified program\n"
 	   /* not implemented: -g, -G: src routing */
+	   "    -F <file>    serve every forward in <file>, one per line\n"
 	   "    -f           fork into background (for pipe host mode only)\n"
+	   "    -G <spec>    load <dhost> with <conns>[:<sessions per second>[:<secs>]]\n"
+	   "    -g <spec>    limit each session to <out>[:<in>] bytes/sec\n"
+	   "    -H <spec>    check pipe hosts every <secs>[:<fall>[:<rise>]] (with -L)\n"
 	   "    -h           version and usage information (this is it)\n"
+	   "    -I <spec>    end sessions idle <secs>[:<secs> stuck writing[:<secs> in all]]\n"
 	   /* not implemented: -i: delay for line i/o */
+	   "    -j <alg>     compress the link to another nsc (for connect/listen)\n"
+	   "    -J <alg>     compress the link to another nsc (for pipe host)\n"
 	   /* new netcat -k: socket serv option (listen+fork) */
 #ifdef HAVE_SSL
 	   "    -k <file>    use this SSL private key file (for connect/listen)\n"
 	   "    -K <file>    use this SSL private key file (for pipe host)\n"
 #endif
+	   "    -L           keep listening, fork a child for each connection\n"
 	   "    -l           listen mode\n"
+	   "    -M <host>    serve prometheus metrics over http on <host> (with -L)\n"
+	   "    -m <n>       carry all sessions over <n> connections to the pipe host\n"
+	   "    -N           the pipe host side of -m, each connection carries sessions\n"
 	   "    -n           do not reverse resolve hosts\n"
-	   /* not implemented: -o: hexdump */
 	   "    -O           also output to stdout (for datapipe/execpipe)\n"
+	   "    -o <file>    record the session, both ways with timing, to <file>\n"
+	   "    -P <n>       stripe the session over <n> connections (both ends)\n"
 	   "    -p <port>    netcat -p emulation\n"
+	   "    -Q <spec>    listen queue of <backlog>[:<most accepts per second>]\n"
 	   "    -q           include out-of-band data\n"
 	   "    -R           randomize listen port\n"
 	   "    -r           randomize connect source port\n"
 	   "    -S <shost>   specify source for pipe recipient (used with -d)\n"
 	   /* new netcat -S: tcp md5 option */
 	   "    -s <shost>   specify source for connection (connect out)\n"
+	   "    -T           report latency percentiles on stderr when done\n"
 	   "    -t           answer telnet options with DONT and WONT\n"
-	   /* new netcat -U: unix sockets */
-	   "    -u           UDP mode\n"
+	   "    -U           <dhost> or <lhost> is a unix socket path\n"
+	   "    -u           UDP mode (datagrams for unix sockets)\n"
 	   "    -v           increase verbosity level\n"
+	   "    -W <path>    take over the listeners of the nsc at <path>, then wait there\n"
 	   /* new netcat -w: stdin/socket idle limit */
 	   "    -w <secs>    only wait <secs> for a connection (0 disables)\n"
 #ifdef HAVE_SSL
@@ -187,12 +309,40 @@ show_usage(void)
 	   /* new netcat -X: proxy versions connec,socks4,socks5 */
 	   "    -X           turn on SSL (for pipe host)\n"
 #endif
+	   "    -Y <spec>    replay the client side of <file>[:<speed>[:<conns>]] to <dhost>\n"
+	   "    -y           split latency up with kernel timestamps (with -T or -M)\n"
 	   "    -z           \"zero i/o mode\"\n"
+	   "    -Z           send to sockets with MSG_ZEROCOPY (linux, bulk transfers)\n"
 	   "\n"
 	   "notes:\n"
 	   "   - if the source or listen port are omitted, a psuedo-random port will be used.\n"
 	   "   - a source or listen port of 0 will yield the OS's default behavior.\n"
 	   "   - if the source or listen address are omitted, INADDR_ANY will be bound.\n"
+	   "   - when a pipe host can not be reached the next one in the list is tried.\n"
+	   "   - any host may be given as unix:<path>, or unix:@<name> for the abstract\n"
+	   "     namespace.\n"
+	   "   - with -H, pipe hosts failing <fall> checks in a row get no new sessions.\n"
+	   "   - -P must be the same on both ends.  the other end starts writing\n"
+	   "     what it received in order as soon as it can.\n"
+	   "   - -m needs -L and -d, and the pipe host must be an nsc listening with -N.\n"
+	   "   - -j and -J take lz4 or zstd, optionally followed by :<level>.  the\n"
+	   "     nsc on the other end must use the same algorithm.\n"
+	   "   - a -F line holds what would follow nsc -l -L for one forward, e.g.\n"
+	   "     -b lc -d 10.0.0.1:80,10.0.0.2:80 0:8080\n"
+	   "   - -o with -L writes <file>.<pid> for each session.  -Y replays at the\n"
+	   "     recorded pace times <speed> (0 for no waiting) over <conns> at once.\n"
+	   "   - -G sends stdin on every session and reads until the server closes,\n"
+	   "     or plays -Y's recording.  with -z it only connects.\n"
+	   "   - with -W the old nsc stops accepting and exits once its sessions end.\n"
+	   "   - -A counts per process.  a session needing a buffer past it is ended.\n"
+	   "   - -I's timeouts are each 0 for none.  -w only covers connecting and\n"
+	   "     SSL handshakes (10 secs for those by default).\n"
+	   "   - -g and -a rates take k, m or g.  out is sent on the connection, in\n"
+	   "     to stdout, -e or the pipe host.  0 leaves a direction alone.\n"
+	   "   - -D sums what is relayed after -j/-J and -t, so both ends of a\n"
+	   "     transfer print the same pair, sent on one end and received on the other.\n"
+	   "   - -B trades cpu for latency, a whole core while traffic flows.\n"
+	   "   - -Z only pays off for large sends on real NICs, loopback always copies.\n"
 	   "\n"
 	   );
    exit(0);
@@ -209,14 +359,15 @@ parse_argv(c, v)
    u_char *v[];
 {
    /* parsing vars */
-   u_int ch;
+   u_int ch, i;
    int lport = -1;
    
    memset(&opts, 0, sizeof(opts));
    opts.family = PF_UNSPEC;
+   opts.busy_cpu = -1;
    
    while ((ch = getopt(c, (char **)v,
-		       "d:e:fhi:lnOp:qRrS:s:tuvw:z"
+		       "A:a:B:b:Dd:E:e:F:fG:g:H:hI:i:J:j:LlM:m:NnOo:P:p:Q:qRrS:s:TtUuvW:w:Y:yZz"
 #ifdef HAVE_SSL
 		       "C:c:K:k:Xx"
 #endif
@@ -238,6 +389,53 @@ parse_argv(c, v)
 	     break;
 #endif
 	     
+	   case 'A':
+	       {
+		  char *p;
+		  
+		  opts.pool_max = strtoul(optarg, &p, 10) * 1024;
+		  if (*p == ':')
+		    opts.pool_reserve = strtoul(p + 1, &p, 10) * 1024;
+		  if (*p != '\0' || opts.pool_max == 0
+		      || opts.pool_reserve > opts.pool_max)
+		    {
+		       fprintf(stderr, "%s: -%c: invalid buffer spec: %s\n", v[0], (u_char)ch, optarg);
+		       exit(1);
+		    }
+	       }
+	     break;
+	     
+	   case 'a':
+	     if (shape_parse((u_char *)optarg, opts.shape_all_rate) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: invalid rate spec: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
+	     
+	   case 'B':
+	       {
+		  char *p;
+		  
+		  opts.busy_poll = strtoul(optarg, &p, 10);
+		  if (*p == ':')
+		    opts.busy_cpu = strtol(p + 1, &p, 10);
+		  if (*p != '\0' || opts.busy_poll == 0 || opts.busy_cpu < -1)
+		    {
+		       fprintf(stderr, "%s: -%c: invalid busy poll spec: %s\n", v[0], (u_char)ch, optarg);
+		       exit(1);
+		    }
+	       }
+	     break;
+	     
+	   case 'b':
+	     if ((int)(opts.balance = backend_parse_policy((u_char *)optarg)) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: unknown balancing policy: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
+	     
 #ifdef HAVE_SSL
 	   case 'C':
 	     opts.flags |= FLAG_USE_SSL_P;
@@ -250,24 +448,105 @@ parse_argv(c, v)
 	     break;
 #endif
 	     
+	   case 'D':
+	     opts.flags |= FLAG_CHECKSUM;
+	     break;
+	     
 	   case 'd':
 	     opts.phost = (u_char *)optarg;
 	     opts.flags |= FLAG_DATAPIPE;
 	     break;
 	     
+	   case 'E':
+	     if (backend_parse_expect((u_char *)optarg) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: invalid health check: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
+	     
 	   case 'e':
 	     opts.pprog = (u_char *)optarg;
 	     opts.flags |= FLAG_EXECPIPE;
 	     break;
 	     
+	   case 'F':
+	     opts.rules = (u_char *)optarg;
+	     break;
+	     
 	   case 'f':
 	     opts.flags |= FLAG_FORK;
 	     /* validated later */
 	     break;
 	     
+	   case 'G':
+	       {
+		  char *p;
+		  
+		  opts.load_conns = strtoul(optarg, &p, 10);
+		  opts.load_secs = LOAD_SECS;
+		  if (*p == ':')
+		    {
+		       opts.load_rate = strtoul(p + 1, &p, 10);
+		       if (*p == ':')
+			 opts.load_secs = strtoul(p + 1, &p, 10);
+		    }
+		  if (*p != '\0' || opts.load_conns == 0 || opts.load_secs == 0)
+		    {
+		       fprintf(stderr, "%s: -%c: invalid load spec: %s\n", v[0], (u_char)ch, optarg);
+		       exit(1);
+		    }
+	       }
+	     break;
+	     
+	   case 'g':
+	     if (shape_parse((u_char *)optarg, opts.shape_rate) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: invalid rate spec: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
+	     
+	   case 'H':
+	     if (backend_parse_check((u_char *)optarg) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: invalid check interval: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
+	     
 	   case 'h':
 	     show_usage();
 	     break;
+	     
+	   case 'I':
+	       {
+		  char *p;
+		  
+		  opts.idle_timeout = strtoul(optarg, &p, 10);
+		  if (*p == ':')
+		    {
+		       opts.stall_timeout = strtoul(p + 1, &p, 10);
+		       if (*p == ':')
+			 opts.session_timeout = strtoul(p + 1, &p, 10);
+		    }
+		  if (*p != '\0')
+		    {
+		       fprintf(stderr, "%s: -%c: invalid timeout spec: %s\n", v[0], (u_char)ch, optarg);
+		       exit(1);
+		    }
+	       }
+	     break;
+	     
+	   case 'J':
+	   case 'j':
+	     if (codec_parse((u_char *)optarg,
+			     &opts.codec[ch == 'J'], &opts.codec_level[ch == 'J']) == -1)
+	       {
+		  fprintf(stderr, "%s: -%c: unsupported compression: %s\n", v[0], (u_char)ch, optarg);
+		  exit(1);
+	       }
+	     break;
 
 #ifdef HAVE_SSL
 	   case 'K':
@@ -279,6 +558,10 @@ parse_argv(c, v)
 	     break;
 #endif
 	     
+	   case 'L':
+	     opts.flags |= FLAG_KEEP_LISTEN;
+	     break;
+	     
 	   case 'l':
 	     if ((opts.flags & MODE_MASK))
 	       {
@@ -288,6 +571,23 @@ parse_argv(c, v)
 	     opts.flags |= MODE_LISTEN;
 	     break;
 	     
+	   case 'M':
+	     opts.metrics = (u_char *)optarg;
+	     break;
+	     
+	   case 'm':
+	     opts.mux = atoi(optarg);
+	     if (opts.mux < 1 || opts.mux > MUX_MAX_TUNNELS)
+	       {
+		  fprintf(stderr, "%s: -%c: use between 1 and %u tunnels\n", v[0], (u_char)ch, MUX_MAX_TUNNELS);
+		  exit(1);
+	       }
+	     break;
+	     
+	   case 'N':
+	     opts.flags |= FLAG_DEMUX;
+	     break;
+	     
 	   case 'n':
 	     opts.flags |= FLAG_NO_REV;
 	     break;
@@ -296,6 +596,19 @@ parse_argv(c, v)
 	     opts.flags |= FLAG_STDOUT;
 	     break;
 	     
+	   case 'o':
+	     opts.record = (u_char *)optarg;
+	     break;
+	     
+	   case 'P':
+	     opts.stripe = atoi(optarg);
+	     if (opts.stripe < 1 || opts.stripe > STRIPE_MAX)
+	       {
+		  fprintf(stderr, "%s: -%c: use between 1 and %u connections\n", v[0], (u_char)ch, STRIPE_MAX);
+		  exit(1);
+	       }
+	     break;
+	     
 	   case 'p':
 	     lport = atoi(optarg);
 	     if (lport > USHRT_MAX)
@@ -305,6 +618,21 @@ parse_argv(c, v)
 	       }
 	     break;
 	     
+	   case 'Q':
+	       {
+		  char *p;
+		  
+		  opts.backlog = strtoul(optarg, &p, 10);
+		  if (*p == ':')
+		    opts.accept_rate = strtoul(p + 1, &p, 10);
+		  if (*p != '\0' || opts.backlog == 0)
+		    {
+		       fprintf(stderr, "%s: -%c: invalid queue spec: %s\n", v[0], (u_char)ch, optarg);
+		       exit(1);
+		    }
+	       }
+	     break;
+	     
 	   case 'q':
 	     opts.flags |= FLAG_OOBIN;
 	     break;
@@ -336,10 +664,18 @@ parse_argv(c, v)
 	      */
 	     break;
 	     
+	   case 'T':
+	     opts.flags |= FLAG_LATENCY;
+	     break;
+	     
 	   case 't':
 	     opts.flags |= FLAG_TELNET;
 	     break;
 	     
+	   case 'U':
+	     opts.flags |= FLAG_UNIX;
+	     break;
+	     
 	   case 'u':
 	     opts.flags |= FLAG_USE_UDP;
 	     break;
@@ -348,6 +684,10 @@ parse_argv(c, v)
 	     opts.verbosity++;
 	     break;
 	     
+	   case 'W':
+	     opts.handoff = (u_char *)optarg;
+	     break;
+	     
 	   case 'w':
 	     opts.connect_timeout = atoi(optarg);
 	     break;
@@ -362,6 +702,37 @@ parse_argv(c, v)
 	     break;
 #endif
 	     
+	   case 'Y':
+	       {
+		  char *p;
+		  
+		  opts.replay = (u_char *)optarg;
+		  opts.replay_speed = 1;
+		  opts.replay_conns = 1;
+		  if ((p = strchr(optarg, ':')))
+		    {
+		       *p++ = '\0';
+		       opts.replay_speed = strtod(p, &p);
+		       if (*p == ':')
+			 opts.replay_conns = strtoul(p + 1, &p, 10);
+		       if (*p != '\0' || opts.replay_speed < 0
+			   || opts.replay_conns == 0)
+			 {
+			    fprintf(stderr, "%s: -%c: invalid replay spec\n", v[0], (u_char)ch);
+			    exit(1);
+			 }
+		    }
+	       }
+	     break;
+	     
+	   case 'y':
+	     opts.flags |= FLAG_TSTAMP;
+	     break;
+	     
+	   case 'Z':
+	     opts.flags |= FLAG_ZEROCOPY;
+	     break;
+	     
 	   case 'z':
 	     opts.flags |= FLAG_ZERO_IO;
 	     break;
@@ -371,9 +742,27 @@ parse_argv(c, v)
 	     exit(1);
 	  }
      }
+   
+   /* -E only says what the -H checks look for */
+   if ((opts.check_send || opts.check_expect) && !opts.check_interval)
+     {
+	fprintf(stderr, "%s: -%c: health checks are only made with -H\n", v[0], 'E');
+	exit(1);
+     }
    c -= optind;
    v += optind;
    
+   /* everything else comes from the rules file */
+   if (opts.rules)
+     {
+	if (opts.flags || c > 0)
+	  {
+	     fprintf(stderr, "-F only goes with -v and -W, the rest belongs in the file\n");
+	     exit(1);
+	  }
+	return;
+     }
+   
    /* if nothing was chosen, error (netcat asks for cmdline, ew) */
    if ((opts.flags & MODE_MASK) == 0)
      {
@@ -386,7 +775,190 @@ parse_argv(c, v)
 	  }
      }
 
+   /* keeping the listener around only makes sense for tcp listeners */
+   if (opts.flags & FLAG_KEEP_LISTEN
+       && ((opts.flags & MODE_MASK) != MODE_LISTEN
+	   || opts.flags & FLAG_USE_UDP))
+     {
+	fprintf(stderr, "-L can only be used when listening for tcp connections\n");
+	exit(1);
+     }
+   
+   /* checking pipe hosts is only useful for a long running listener */
+   if (opts.check_interval
+       && (!(opts.flags & FLAG_DATAPIPE) || !(opts.flags & FLAG_KEEP_LISTEN)))
+     {
+	fprintf(stderr, "-H requires -d and -L\n");
+	exit(1);
+     }
+   
+   /* the tunnels speak plain tcp between two copies of nsc */
+   if (opts.mux || opts.flags & FLAG_DEMUX)
+     {
+	if (opts.mux && opts.flags & FLAG_DEMUX)
+	  {
+	     fprintf(stderr, "-m and -N can not be used together\n");
+	     exit(1);
+	  }
+	if ((opts.flags & MODE_MASK) != MODE_LISTEN
+	    || !(opts.flags & FLAG_DATAPIPE)
+	    || (opts.mux && !(opts.flags & FLAG_KEEP_LISTEN)))
+	  {
+	     fprintf(stderr, "-m requires -l, -L and -d, -N requires -l and -d\n");
+	     exit(1);
+	  }
+	if (opts.flags & (FLAG_USE_UDP | FLAG_USE_SSL_D | FLAG_USE_SSL_P)
+	    || opts.codec[0] || opts.codec[1])
+	  {
+	     fprintf(stderr, "-m and -N do not work with -u, SSL or compression\n");
+	     exit(1);
+	  }
+     }
+   
+   /* striping is between two copies of nsc over plain tcp */
+   if (opts.stripe
+       && (opts.flags & (FLAG_USE_UDP | FLAG_USE_SSL_D | FLAG_USE_SSL_P | FLAG_DEMUX)
+	   || opts.mux || opts.codec[0] || opts.codec[1]))
+     {
+	fprintf(stderr, "-P does not work with -u, SSL, compression, -m or -N\n");
+	exit(1);
+     }
+   
+   /* those move data their own way */
+   if (opts.flags & FLAG_ZEROCOPY
+       && (opts.stripe || opts.mux || opts.flags & FLAG_DEMUX))
+     {
+	fprintf(stderr, "-Z does not work with -P, -m or -N\n");
+	exit(1);
+     }
+   if ((opts.shape_rate[SHAPE_OUT] || opts.shape_rate[SHAPE_IN]
+	|| opts.shape_all_rate[SHAPE_OUT] || opts.shape_all_rate[SHAPE_IN])
+       && (opts.stripe || opts.mux || opts.flags & FLAG_DEMUX))
+     {
+	fprintf(stderr, "-g and -a do not work with -P, -m or -N\n");
+	exit(1);
+     }
+   if ((opts.idle_timeout || opts.stall_timeout || opts.session_timeout)
+       && (opts.stripe || opts.mux || opts.flags & FLAG_DEMUX))
+     {
+	fprintf(stderr, "-I does not work with -P, -m or -N\n");
+	exit(1);
+     }
+   if (opts.flags & FLAG_CHECKSUM
+       && (opts.stripe || opts.mux || opts.flags & FLAG_DEMUX))
+     {
+	fprintf(stderr, "-D does not work with -P, -m or -N\n");
+	exit(1);
+     }
+
+   if (opts.codec[1] && !(opts.flags & FLAG_DATAPIPE))
+     {
+	fprintf(stderr, "-J requires -d\n");
+	exit(1);
+     }
+   
+   /* the timestamps end up in the histograms */
+   if (opts.flags & FLAG_TSTAMP)
+     {
+	if (!opts.metrics && !(opts.flags & FLAG_LATENCY))
+	  {
+	     fprintf(stderr, "-y requires -T or -M\n");
+	     exit(1);
+	  }
+	if (opts.flags & FLAG_ZEROCOPY
+	    || opts.stripe || opts.mux || opts.flags & FLAG_DEMUX)
+	  {
+	     fprintf(stderr, "-y does not work with -Z, -P, -m or -N\n");
+	     exit(1);
+	  }
+     }
+   
+   /* recordings are taken from io_pipe's buffers */
+   if (opts.record
+       && (opts.stripe || opts.mux || opts.flags & FLAG_DEMUX))
+     {
+	fprintf(stderr, "-o does not work with -P, -m or -N\n");
+	exit(1);
+     }
+   
+   /* a replay makes its own plain connections */
+   if (opts.replay
+       && ((opts.flags & MODE_MASK) != MODE_CONNECT
+	   || opts.flags & (FLAG_DATAPIPE | FLAG_EXECPIPE | FLAG_DEMUX)
+	   || opts.stripe || opts.mux || opts.codec[0] || opts.codec[1]
+	   || opts.record))
+     {
+	fprintf(stderr, "-Y only connects out, without -d, -e, -P, -j, -J or -o\n");
+	exit(1);
+     }
+   if (opts.load_conns)
+     {
+	if ((opts.flags & MODE_MASK) != MODE_CONNECT
+	    || opts.flags & (FLAG_DATAPIPE | FLAG_EXECPIPE | FLAG_DEMUX)
+	    || opts.stripe || opts.mux || opts.codec[0] || opts.codec[1]
+	    || opts.record)
+	  {
+	     fprintf(stderr, "-G only connects out, without -d, -e, -P, -j, -J or -o\n");
+	     exit(1);
+	  }
+	/* the percentiles are the point */
+	opts.flags |= FLAG_LATENCY;
+     }
+   
+   if (opts.metrics && !(opts.flags & FLAG_KEEP_LISTEN))
+     {
+	fprintf(stderr, "-M requires -L\n");
+	exit(1);
+     }
+   if (opts.handoff && (!(opts.flags & FLAG_KEEP_LISTEN) || opts.mux))
+     {
+	fprintf(stderr, "-W requires -L and does not work with -m\n");
+	exit(1);
+     }
+   if ((opts.metrics || opts.flags & FLAG_LATENCY)
+       && stats_init() == -1)
+     {
+	perror("unable to set up metrics");
+	exit(1);
+     }
+   
+   /* the limits for all sessions are where every child can take from
+    * them.  each -F line gets its own. */
+   for (i = 0; i < 2; i++)
+     if (opts.shape_all_rate[i]
+	 && !(opts.shape_all[i] = shape_new(opts.shape_all_rate[i], 1)))
+       {
+	  perror("unable to set up rate limits");
+	  exit(1);
+       }
+   
+   /* set the buffers aside now rather than during a burst */
+   if (opts.pool_reserve
+       && pool_reserve(&pool_blocks, opts.pool_reserve / NSOCK_IOP_BLOCKSZ) == -1)
+     {
+	perror("unable to reserve buffers");
+	exit(1);
+     }
+   
+   /* split up the pipe host list */
+   if (opts.flags & FLAG_DATAPIPE
+       && backend_init(opts.phost) < 1)
+     {
+	fprintf(stderr, "invalid pipe host list: %s\n", opts.phost);
+	exit(1);
+     }
+   
 #ifdef HAVE_SSL
+   /* unix listeners are accepted without libnsock, so no SSL there */
+   if ((opts.flags & MODE_MASK) == MODE_LISTEN
+       && opts.flags & FLAG_USE_SSL_D
+       && (opts.flags & FLAG_UNIX
+	   || (c > 0 && unixsock_is(v[0]))))
+     {
+	fprintf(stderr, "SSL is not supported on unix sockets\n");
+	exit(1);
+     }
+   
    /* if listening, require certificate and key file */
    if ((opts.flags & MODE_MASK) == MODE_LISTEN
        && opts.flags & FLAG_USE_SSL_D
@@ -401,7 +973,8 @@ parse_argv(c, v)
    if (c < 1 || *v[0] == '\0')
      {
 	/* nothing specified, we can assume defaults for LISTEN */
-	if ((opts.flags & MODE_MASK) == MODE_LISTEN)
+	if ((opts.flags & MODE_MASK) == MODE_LISTEN
+	    && !(opts.flags & FLAG_UNIX))
 	  opts.lhost = (u_char *)"0";
 	else
 	  {
@@ -419,6 +992,31 @@ parse_argv(c, v)
 	c--;
      }
    
+   /* netcat -U, the host is really a path (memory leaked) */
+   if (opts.flags & FLAG_UNIX)
+     {
+	u_char **hostp = ((opts.flags & MODE_MASK) == MODE_CONNECT
+			  ? &opts.dhost : &opts.lhost);
+	u_char *path = *hostp;
+	
+	if (!unixsock_is(path))
+	  {
+	     if (!(*hostp = malloc(strlen(UNIXSOCK_PREFIX) + strlen((char *)path) + 1)))
+	       {
+		  perror("malloc");
+		  exit(1);
+	       }
+	     sprintf((char *)*hostp, "%s%s", UNIXSOCK_PREFIX, path);
+	  }
+     }
+   
+   /* ports mean nothing for unix sockets */
+   if (unixsock_is(opts.dhost) || unixsock_is(opts.lhost))
+     {
+	lport = -1;
+	c = 0;
+     }
+   
    /* emulate netcat -p */
    if (lport >= 0)
      {
@@ -446,8 +1044,11 @@ parse_argv(c, v)
 }
 
 
+/*
+ * set up the listener described by opts
+ */
 nsock_t *
-get_incoming(void)
+open_listener(void)
 {
 #ifdef INET6
    int family = PF_INET6;
@@ -455,11 +1056,15 @@ get_incoming(void)
    int family = PF_INET;
 #endif
    int flags = NSF_REUSE_ADDR;
-   nsock_t *listener, *cli;
+   nsock_t *listener;
    u_int ns_errno;
    int sock_type = SOCK_STREAM;
+   int backlog = 1;
+   
+   /* already listening, handed over by the nsc we replace */
+   if ((listener = handoff_find(opts.lhost)))
+     return listener;
    
-   /* get an incoming connection */
    if (!nsock_inet_host_has_port(opts.lhost) || opts.flags & FLAG_RAND_LIST)
      flags |= NSF_RAND_SRC_PORT;
    if (opts.flags & FLAG_USE_UDP)
@@ -473,8 +1078,20 @@ get_incoming(void)
      }
    if (opts.flags & FLAG_OOBIN)
      flags |= NSF_OOB_INLINE;
+   if (opts.flags & FLAG_KEEP_LISTEN)
+     backlog = opts.backlog ? opts.backlog : SOMAXCONN;
    
-   if (!(listener = nsock_listen_init(family, sock_type, opts.lhost, 1, flags, &ns_errno)))
+   if (unixsock_is(opts.lhost))
+     {
+	if (!(listener = unixsock_listen(opts.lhost, sock_type, backlog)))
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "error: %s: %s\n", opts.lhost, strerror(errno));
+	     return NULL;
+	  }
+     }
+   else if (!(listener = nsock_listen_init(family, sock_type, opts.lhost,
+					   backlog, flags, &ns_errno)))
      {
 	if (opts.verbosity > 0)
 	  fprintf(stderr, "error: %s\n", nsock_strerror_full_n(ns_errno));
@@ -486,14 +1103,138 @@ get_incoming(void)
      {
 	printf("listening on %s [%s]\n", opts.lhost,
 	       reverse_host(listener, &(listener->inet_fin)));
+	/* don't let forked children flush this again */
+	fflush(stdout);
      }
+   return listener;
+}
+
+
+/*
+ * options that apply to a tcp listener once it is set up
+ */
+void
+setup_listener(listener)
+   nsock_t *listener;
+{
+#ifdef HAVE_SSL
+   /* sessions do their own handshakes (see tls.c), the context is made
+    * now so that each of them inherits it */
+   if (opts.flags & FLAG_USE_SSL_D)
+     tls_ctx(opts.dcert, opts.dkey, 1);
+#endif
+   if ((opts.flags & FLAG_NO_REV))
+     listener->opt |= NSF_NO_REVERSE_NAME;
+   
+   /* a persistent listener takes everyone waiting each time it wakes
+    * up, and one gathering -P groups has their hellos to wait for too */
+   if (opts.flags & FLAG_KEEP_LISTEN || opts.stripe)
+     fcntl(listener->sd, F_SETFL, fcntl(listener->sd, F_GETFL) | O_NONBLOCK);
+}
+
+
+/*
+ * wait for a client on the listener.  *fatalp is set when the listener
+ * should not be used again, or to -1 when a non-blocking listener has
+ * nobody left waiting.
+ */
+nsock_t *
+accept_client(listener, fatalp)
+   nsock_t *listener;
+   int *fatalp;
+{
+   nsock_t *cli;
+   u_int ns_errno = NSERR_SUCCESS;
+   
+   *fatalp = 0;
+   
+   /* over the -Q rate the rest stay in the backlog for now */
+   if (accept_pace(0))
+     {
+	*fatalp = -1;
+	return NULL;
+     }
+   
+   /* get some storage for the incoming client */
+   if (!(cli = nsock_new(listener->domain, SOCK_STREAM, 0, &ns_errno)))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "error: %s\n", nsock_strerror_full_n(ns_errno));
+	*fatalp = 1;
+	return NULL;
+     }
+   if ((opts.flags & FLAG_NO_REV))
+     cli->opt |= NSF_NO_REVERSE_NAME;
+   
+#ifdef HAVE_SSL
+   /* copy the ssl info to the client struct */
+   memcpy(&(cli->ns_ssl), &(listener->ns_ssl), sizeof(nsock_ssl_t));
+   cli->sd = -1;
+#endif
+   
+   /* wait for their connection */
+   errno = 0;
+   if ((listener->domain == PF_UNIX
+	? unixsock_accept(listener, cli)
+	: nsock_accept(listener, cli)) != NSERR_SUCCESS)
+     {
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	  {
+	     *fatalp = -1;
+	     nsock_free(&cli);
+	     return NULL;
+	  }
+	stats_error(listener->ns_errno);
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "accept error: %s\n", nsock_strerror_full(listener));
+	nsock_free(&cli);
+	return NULL;
+     }
+   accept_pace(1);
+   return cli;
+}
+
+
+/*
+ * how long until the -Q rate lets another client in, a second's worth
+ * may go at once.  with spend set an accept is counted against it.
+ */
+u_int64_t
+accept_pace(spend)
+   int spend;
+{
+   static u_int64_t next = 0;
+   u_int64_t now;
+   
+   if (!opts.accept_rate)
+     return 0;
+   now = stats_now();
+   if (next + 1000000 < now)
+     next = now - 1000000;
+   if (spend)
+     {
+	next += 1000000 / opts.accept_rate;
+	return 0;
+     }
+   return next > now ? next - now : 0;
+}
+
+
+nsock_t *
+get_incoming(void)
+{
+   nsock_t *listener, *cli;
+   pid_t cpid;
+   int fatal, hsd = -1, drained = 1;
+   
+   /* get an incoming connection */
+   if (!(listener = open_listener()))
+     return NULL;
    
    /* become daemon if requested */
    if ((opts.flags & FLAG_DATAPIPE)
        && (opts.flags & FLAG_FORK))
      {
-	int cpid;
-	
 	cpid = fork();
 	if (cpid == -1)
 	  {
@@ -530,7 +1271,9 @@ get_incoming(void)
 	     return NULL;
 	  }
 	/* now that we have an address that sent data, we must connect back */
-	if (nsock_connect(listener) != NSERR_SUCCESS)
+	if ((listener->domain == PF_UNIX
+	     ? unixsock_connect_back(listener, slen)
+	     : nsock_connect(listener)) != NSERR_SUCCESS)
 	  {
 	     if (opts.verbosity > 0)
 	       fprintf(stderr, "udp connect: %s\n", nsock_strerror_full(listener));
@@ -540,46 +1283,166 @@ get_incoming(void)
 	return listener;
      }
    
-   /* get some storage for the incoming client */
-   ns_errno = NSERR_SUCCESS;
-   if (!(cli = nsock_new(listener->domain, SOCK_STREAM, 0, &ns_errno)))
-     {
-	if (opts.verbosity > 0)
-	  fprintf(stderr, "error: %s\n", nsock_strerror_full_n(ns_errno));
-	nsock_free(&listener);
-	return NULL;
-     }
-   if ((opts.flags & FLAG_NO_REV))
-     cli->opt |= NSF_NO_REVERSE_NAME;
+   setup_listener(listener);
    
-#ifdef HAVE_SSL
-   /* setup ssl stuff */
-   if (opts.flags & FLAG_USE_SSL_D)
+   /* when serving many clients, each one gets its own process */
+   if (opts.flags & FLAG_KEEP_LISTEN)
      {
-	listener->opt |= NSF_USE_SSL;
-	if (opts.dcert)
+	struct sigaction sa;
+	
+	pid_t hpid;
+	
+	/* the helpers are stopped when the listener is handed over */
+	if (opts.check_interval)
+	  {
+	     if ((hpid = backend_start_checks(listener->sd)) == -1
+		 && opts.verbosity > 0)
+	       perror("unable to start pipe host checks");
+	     handoff_helper(hpid);
+	  }
+	if (opts.metrics)
+	  {
+	     if ((hpid = stats_start_server(listener->sd)) == -1)
+	       {
+		  nsock_free(&listener);
+		  return NULL;
+	       }
+	     handoff_helper(hpid);
+	  }
+	
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reap_children;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	
+	/* the latency report is printed once we are told to stop */
+	if (opts.flags & FLAG_LATENCY)
 	  {
-	     listener->ns_ssl.cert_file = opts.dcert;
-	     if (opts.dkey)
-	       listener->ns_ssl.key_file = opts.dkey;
+	     sa.sa_handler = stop_listening;
+	     sa.sa_flags = 0;
+	     sigaction(SIGTERM, &sa, NULL);
+	     sigaction(SIGINT, &sa, NULL);
 	  }
+	
+	/* all the sessions live in this process from here on */
+	if (opts.mux)
+	  mux_listen(listener);
+	
+	/* wait for the nsc that will replace us */
+	hsd = handoff_open();
      }
    
-   /* copy the ssl info to the client struct */
-   memcpy(&(cli->ns_ssl), &(listener->ns_ssl), sizeof(nsock_ssl_t));
-   cli->sd = -1;
-#endif
-   if ((opts.flags & FLAG_NO_REV))
-     listener->opt |= NSF_NO_REVERSE_NAME;
-   
-   /* wait for their connection */
-   if (nsock_accept(listener, cli) != NSERR_SUCCESS)
+   while (1)
      {
-	if (opts.verbosity > 0)
-	  fprintf(stderr, "accept error: %s\n", nsock_strerror_full(listener));
-	nsock_free(&listener);
+	u_int64_t accept_start = 0, wait = accept_pace(0);
+	
+	/* a persistent listener waits for clients here and then takes
+	 * all of them before waiting again.  with stats on only the
+	 * accept itself is timed, and the next nsc asking for the
+	 * listener is waited for the same way.  over the -Q rate only
+	 * the listener is left out until it may accept again */
+	if ((drained || wait)
+	    && (opts.flags & FLAG_KEEP_LISTEN || stats || opts.stripe))
+	  {
+	     struct timeval tv, *tvp = NULL;
+	     fd_set rd;
+	     int maxfd;
+	     
+	     if (stop_requested)
+	       {
+		  stats_report();
+		  exit(0);
+	       }
+	     FD_ZERO(&rd);
+	     if (!wait)
+	       FD_SET(listener->sd, &rd);
+	     if (hsd != -1)
+	       FD_SET(hsd, &rd);
+	     maxfd = hsd > listener->sd ? hsd : listener->sd;
+	     if (opts.stripe)
+	       tvp = stripe_setfds(&rd, &maxfd, &tv);
+	     if (wait && (!tvp || (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec > wait))
+	       {
+		  tv.tv_sec = wait / 1000000;
+		  tv.tv_usec = wait % 1000000;
+		  tvp = &tv;
+	       }
+	     if (select(maxfd + 1, &rd, NULL, NULL, tvp) < 1)
+	       continue;
+	     if (hsd != -1 && FD_ISSET(hsd, &rd))
+	       {
+		  handoff_give(hsd, &listener, &opts.lhost, 1);
+		  continue;
+	       }
+	     
+	     /* a striped session starts once its whole group is here */
+	     if (opts.stripe && (cli = stripe_hellos(&rd)))
+	       goto gathered;
+	     if (!FD_ISSET(listener->sd, &rd))
+	       continue;
+	  }
+	if (stats)
+	  accept_start = stats_now();
+	
+	if (!(cli = accept_client(listener, &fatal)))
+	  {
+	     /* that was everyone */
+	     if (fatal == -1)
+	       {
+		  drained = 1;
+		  continue;
+	       }
+	     /* one bad client should not take the listener down */
+	     if (!fatal && opts.flags & FLAG_KEEP_LISTEN)
+	       continue;
+	     nsock_free(&listener);
+	     return NULL;
+	  }
+	
+	drained = 0;
+	STAT_INC(accepts);
+	if (stats)
+	  {
+	     stats_session_start = stats_now();
+	     stats_record(HIST_ACCEPT, stats_session_start - accept_start);
+	  }
+	
+	/* the hello is waited for along with everything else, a quiet
+	 * client can't hold up the listener */
+	if (opts.stripe)
+	  {
+	     if (stripe_hold(cli) == -1)
+	       {
+		  if (opts.verbosity > 0)
+		    fprintf(stderr, "stripe: too many connections saying hello\n");
+		  nsock_free(&cli);
+	       }
+	     continue;
+	  }
+	
+gathered:
+	if (!(opts.flags & FLAG_KEEP_LISTEN))
+	  break;
+	
+	cpid = fork();
+	if (cpid == -1 && opts.verbosity > 0)
+	  perror("fork failed");
+	if (cpid == 0)
+	  {
+	     signal(SIGCHLD, SIG_DFL);
+	     signal(SIGTERM, SIG_DFL);
+	     signal(SIGINT, SIG_DFL);
+	     if (hsd != -1)
+	       close(hsd);
+	     break;
+	  }
+	
+	/* the parent only needs the listener */
+	if (opts.stripe)
+	  stripe_drop(cli->sd);
+	close(cli->sd);
+	cli->sd = -1;
 	nsock_free(&cli);
-	return NULL;
      }
    
    if (opts.verbosity > 1)
@@ -588,7 +1451,13 @@ get_incoming(void)
 		reverse_host(cli, &(cli->inet_fin)));
      }
    
+   /* the session has no use for striped groups still being put together */
+   if (opts.stripe)
+     stripe_drop_pending();
+   
    /* dont need listener anymore */
+   if (!(opts.flags & FLAG_KEEP_LISTEN))
+     unixsock_unlink(listener);
    nsock_free(&listener);
    
    /* zero i/o mode? */
@@ -616,14 +1485,45 @@ connect_to_host(source, target, pipe_host)
    nsock_t *dest;
    u_int ns_errno;
    int sock_type = SOCK_STREAM;
+   u_int64_t connect_start = stats ? stats_now() : 0;
+   
+   if (opts.flags & FLAG_USE_UDP)
+     sock_type = SOCK_DGRAM;
+   
+   /* unix sockets are set up without libnsock's help */
+   if (unixsock_is(target))
+     {
+#ifdef HAVE_SSL
+	if (opts.flags & (pipe_host ? FLAG_USE_SSL_P : FLAG_USE_SSL_D))
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "error: %s: SSL is not supported on unix sockets\n", target);
+	     return NULL;
+	  }
+#endif
+	if (!(dest = unixsock_connect(source, target, sock_type)))
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "error: %s: %s\n", target, strerror(errno));
+	     return NULL;
+	  }
+	if (stats)
+	  stats_record(HIST_CONNECT, stats_now() - connect_start);
+	if (opts.verbosity > 1)
+	  fprintf(stderr, "connection to %s established\n", target);
+	if (opts.flags & FLAG_ZERO_IO)
+	  {
+	     nsock_close(dest);
+	     return NULL;
+	  }
+	return dest;
+     }
    
    if (!source
        || !nsock_inet_host_has_port(source)
        || opts.flags & FLAG_RAND_SRC)
      flags |= NSF_RAND_SRC_PORT;
    
-   if (opts.flags & FLAG_USE_UDP)
-     sock_type = SOCK_DGRAM;
    if (opts.family != PF_UNSPEC)
      {
 	flags |= NSF_USE_FAMILY_HINT;
@@ -640,36 +1540,6 @@ connect_to_host(source, target, pipe_host)
 	return NULL;
      }
    
-#ifdef HAVE_SSL
-   if (pipe_host)
-     {
-	/* setup ssl stuff */
-	if (opts.flags & FLAG_USE_SSL_P)
-	  {
-	     dest->opt |= NSF_USE_SSL;
-	     if (opts.pcert)
-	       {
-		  dest->ns_ssl.cert_file = opts.pcert;
-		  if (opts.pkey)
-		    dest->ns_ssl.key_file = opts.pkey;
-	       }
-	  }
-     }
-   else
-     {
-	/* setup ssl stuff */
-	if (opts.flags & FLAG_USE_SSL_D)
-	  {
-	     dest->opt |= NSF_USE_SSL;
-	     if (opts.dcert)
-	       {
-		  dest->ns_ssl.cert_file = opts.dcert;
-		  if (opts.dkey)
-		    dest->ns_ssl.key_file = opts.dkey;
-	       }
-	  }
-     }
-#endif
    if ((opts.flags & FLAG_NO_REV))
      dest->opt |= NSF_NO_REVERSE_NAME;
    
@@ -677,12 +1547,27 @@ connect_to_host(source, target, pipe_host)
    dest->connect_timeout = opts.connect_timeout;
    
    /* try to connect */
+   if (stats)
+     connect_start = stats_now();
    if (nsock_connect_out(dest) != NSERR_SUCCESS)
      {
 	if (opts.verbosity > 0)
 	  fprintf(stderr, "error: %s\n", nsock_strerror_full(dest));
 	return NULL;
      }
+#ifdef HAVE_SSL
+   /* the handshake is ours, so it can't hang on past -w (see tls.c) */
+   if (sock_type == SOCK_STREAM
+       && opts.flags & (pipe_host ? FLAG_USE_SSL_P : FLAG_USE_SSL_D)
+       && tls_connect(dest, pipe_host ? opts.pcert : opts.dcert,
+		      pipe_host ? opts.pkey : opts.dkey) == -1)
+     {
+	nsock_close(dest);
+	return NULL;
+     }
+#endif
+   if (stats)
+     stats_record(HIST_CONNECT, stats_now() - connect_start);
    
    /* possibly tell our outgoing info */
    if (opts.verbosity > 1)
@@ -718,6 +1603,56 @@ connect_to_host(source, target, pipe_host)
 
    
 
+/*
+ * collect any children that have finished their sessions
+ */
+void
+reap_children(sig)
+   int sig;
+{
+   int save_errno = errno;
+   
+   while (waitpid(-1, NULL, WNOHANG) > 0)
+     ;
+   errno = save_errno;
+}
+
+
+/*
+ * a -T listener was told to stop, get_incoming() reports and exits
+ */
+void
+stop_listening(sig)
+   int sig;
+{
+   stop_requested = 1;
+}
+
+
+/*
+ * get some zeroed memory that will be shared with any forked children
+ */
+void *
+shared_alloc(len)
+   size_t len;
+{
+   void *p;
+#ifndef MAP_ANON
+   int fd;
+   
+   if ((fd = open("/dev/zero", O_RDWR)) == -1)
+     return NULL;
+   p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+#else
+   p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+#endif
+   if (p == MAP_FAILED)
+     return NULL;
+   return p;
+}
+
+
 u_char *
 reverse_host(ns, cli)
    nsock_t *ns;
@@ -725,6 +1660,9 @@ reverse_host(ns, cli)
 {
    static char host_rev[2048 + 1];
    
+   if (cli->ss_family == AF_UNIX)
+     return unixsock_name(cli);
+   
    /* resolve possibly */
    if (nsock_inet_resolve_rev(ns, cli, (u_char *)host_rev, sizeof(host_rev) - 1) != NSERR_SUCCESS)
      strcpy(host_rev, "unknown:?");
@@ -784,7 +1722,8 @@ exec_prog(to, from, cpid)
 	dup2(pipe_from[1], fileno(stdout));
 	dup2(pipe_from[1], fileno(stderr));
 	
-	for (i = 0; i < 1; i++)
+	/* all of them, or the program keeps its own stdin open */
+	for (i = 0; i < 2; i++)
 	  {
 	     close(pipe_to[i]);
 	     close(pipe_from[i]);
@@ -21,6 +21,13 @@
 #define FLAG_EXECPIPE 	0x00004000
 #define FLAG_USE_UDP 	0x00008000
 #define FLAG_OOBIN 	0x00010000
+#define FLAG_KEEP_LISTEN 0x00020000
+#define FLAG_UNIX 	0x00040000
+#define FLAG_LATENCY 	0x00080000
+#define FLAG_DEMUX 	0x00100000
+#define FLAG_ZEROCOPY 	0x00200000
+#define FLAG_TSTAMP 	0x00400000
+#define FLAG_CHECKSUM 	0x00800000
 #define FLAG_MASK 	0xfffffff0
 
 typedef struct __options_stru_
@@ -49,6 +56,49 @@ typedef struct __options_stru_
    u_char *pkey;
 #endif
    
+   u_int balance; 		/* how to pick from several pipe hosts */
+   u_int check_interval; 	/* seconds between pipe host checks */
+   u_int check_fall;
+   u_int check_rise;
+   u_char *check_send; 		/* optional send/expect check */
+   u_char *check_expect;
+   
+   u_char *metrics; 		/* where to serve metrics */
+   
+   u_int codec[2]; 		/* compression for connect/listen, pipe host */
+   int codec_level[2];
+   
+   u_int mux; 			/* tunnels to carry sessions over (-m) */
+   u_int stripe; 		/* connections to stripe a session over (-P) */
+   
+   u_char *rules; 		/* file of forwards to serve (-F) */
+   u_char *handoff; 		/* where listeners change hands (-W) */
+   
+   u_int busy_poll; 		/* usecs to spin before sleeping (-B) */
+   int busy_cpu; 		/* cpu to pin to, or -1 */
+   
+   size_t pool_max; 		/* bytes of buffers per process (-A) */
+   size_t pool_reserve; 	/* bytes of them to set aside up front */
+   
+   u_char *record; 		/* where to record sessions (-o) */
+   u_char *replay; 		/* recording to play to <dhost> (-Y) */
+   double replay_speed; 	/* times the recorded pace, 0 for flat out */
+   u_int replay_conns;
+   u_int load_conns; 		/* connections kept busy (-G) */
+   u_int load_rate; 		/* most sessions started per second, 0 for any */
+   u_int load_secs;
+   
+   u_int64_t shape_rate[2]; 	/* bytes/sec out and in, per session (-g) */
+   u_int64_t shape_all_rate[2]; 	/* and for all of them (-a) */
+   struct __nsc_shape_stru *shape_all[2]; /* shared by every process */
+   
+   u_int idle_timeout; 		/* secs with nothing read (-I) */
+   u_int stall_timeout; 	/* secs with writes getting nowhere */
+   u_int session_timeout; 	/* secs in all */
+   
+   u_int backlog; 		/* listen queue with -L (-Q) */
+   u_int accept_rate; 		/* most accepts per second, 0 for any */
+   
    u_int connect_timeout;
    u_int verbosity;
 } options_t;
@@ -56,4 +106,19 @@ typedef struct __options_stru_
 
 extern options_t opts;
 
+/* counters shared between forked sessions (see shared_alloc()) */
+#define SHARED_INC(x) 	__sync_fetch_and_add(&(x), 1)
+#define SHARED_DEC(x) 	__sync_fetch_and_sub(&(x), 1)
+#define SHARED_ADD(x, n) __sync_fetch_and_add(&(x), (n))
+
+void parse_argv(u_int, u_char **);
+nsock_t *open_listener(void);
+void setup_listener(nsock_t *);
+nsock_t *accept_client(nsock_t *, int *);
+u_int64_t accept_pace(int);
+nsock_t *connect_to_host(u_char *, u_char *, u_char);
+void reap_children(int);
+u_char *reverse_host(nsock_t *, struct sockaddr_storage *);
+void *shared_alloc(size_t);
+
 #endif
@@ -0,0 +1,135 @@
+/*
+ * fixed size objects carved from slabs and recycled.
+ *
+ * relay buffers and the like are taken from slabs and put on a free list
+ * when their session is done, so a burst of sessions doesn't go through
+ * malloc() or zero memory nobody reads.  slabs are never given back.
+ * with -A the memory in slabs is capped, past that new sessions are
+ * refused rather than pushing the box into swap, and some of it may be
+ * set aside and faulted in up front.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "pool.h"
+
+
+pool_t pool_blocks = { NSOCK_IOP_BLOCKSZ, 0, NULL, 0, 0 };
+
+/* memory in slabs, across every pool */
+static size_t pool_bytes = 0;
+
+static int pool_grow(pool_t *);
+
+
+/*
+ * make sure n objects can be had without allocating, and touch them so
+ * the pages are there already.  returns -1 if that would go over -A.
+ */
+int
+pool_reserve(pool, n)
+   pool_t *pool;
+   u_int n;
+{
+   long page = sysconf(_SC_PAGESIZE);
+   u_char *obj;
+   size_t off;
+   
+   while (pool->nfree < n)
+     if (pool_grow(pool) == -1)
+       return -1;
+   for (obj = pool->free; obj; obj = *(void **)obj)
+     for (off = page; off < pool->size; off += page)
+       obj[off] = 0;
+   return 0;
+}
+
+
+/*
+ * an object, not zeroed.  NULL with ENOMEM when the cap is reached.
+ */
+void *
+pool_get(pool)
+   pool_t *pool;
+{
+   void *obj;
+   
+   if (!pool->free && pool_grow(pool) == -1)
+     {
+	STAT_INC(pool_refused);
+	return NULL;
+     }
+   obj = pool->free;
+   pool->free = *(void **)obj;
+   pool->nfree--;
+   pool->nused++;
+   return obj;
+}
+
+
+void
+pool_put(pool, obj)
+   pool_t *pool;
+   void *obj;
+{
+   if (!obj)
+     return;
+   *(void **)obj = pool->free;
+   pool->free = obj;
+   pool->nfree++;
+   pool->nused--;
+}
+
+
+/*
+ * add a slab to the free list
+ */
+static int
+pool_grow(pool)
+   pool_t *pool;
+{
+   u_char *slab;
+   size_t len;
+   u_int i;
+   
+   if (pool->size < sizeof(void *))
+     pool->size = sizeof(void *);
+   if (!pool->per_slab)
+     {
+	pool->per_slab = POOL_SLAB_SZ / pool->size;
+	if (pool->per_slab == 0)
+	  pool->per_slab = 1;
+     }
+   len = pool->per_slab * pool->size;
+   
+   /* a partial slab is better than none near the cap */
+   if (opts.pool_max && pool_bytes + len > opts.pool_max)
+     {
+	if (pool_bytes + pool->size > opts.pool_max)
+	  {
+	     errno = ENOMEM;
+	     return -1;
+	  }
+	len = (opts.pool_max - pool_bytes) / pool->size * pool->size;
+     }
+   if (!(slab = malloc(len)))
+     return -1;
+   pool_bytes += len;
+   
+   for (i = 0; i < len / pool->size; i++)
+     {
+	*(void **)(slab + i * pool->size) = pool->free;
+	pool->free = slab + i * pool->size;
+     }
+   pool->nfree += len / pool->size;
+   return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * fixed size objects carved from slabs and recycled
+ */
+#ifndef __nsc_pool_h
+#define __nsc_pool_h
+
+/* slabs are at least this big */
+#define POOL_SLAB_SZ 	(256 * 1024)
+
+typedef struct __nsc_pool_stru
+{
+   size_t size; 		/* of each object */
+   u_int per_slab;
+   void *free; 			/* free objects, linked through themselves */
+   u_int nfree, nused;
+} pool_t;
+
+extern pool_t pool_blocks; 	/* NSOCK_IOP_BLOCKSZ relay buffers */
+
+int pool_reserve(pool_t *, u_int);
+void *pool_get(pool_t *);
+void pool_put(pool_t *, void *);
+
+#endif
@@ -0,0 +1,636 @@
+/*
+ * sessions recorded to a file and played back.
+ *
+ * with -o everything io_pipe reads is written to a file as it arrives,
+ * each piece with the time since the one before and the side it came
+ * from.  the header says which side was the client: the connection for
+ * a listener, stdin (or -e) when connecting out.  a -L listener writes
+ * one file per session, named after the process.
+ *
+ * -Y plays the client half of a recording to <dhost> over one or more
+ * connections at once, at the recorded pace, some multiple of it or as
+ * fast as it can.  what the server sends back is read and counted but
+ * not compared, the point is to load it the way real clients did.
+ *
+ * -G makes that a load generator.  <conns> connections are kept busy
+ * with one session after another for <secs>, starting no more than
+ * <rate> a second between them all.  a session plays -Y's recording if
+ * there is one, otherwise it sends what came in on stdin (read once, up
+ * front), shuts down its side and reads until the server closes.  with
+ * -z sessions only connect, which measures the connection rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "record.h"
+
+
+static int replay_start(replay_entry_t *, u_int, u_char);
+static replay_entry_t *replay_load(u_char *, u_int *, u_char *);
+static int load_worker(replay_entry_t *, u_int, u_char, replay_totals_t *,
+		       u_int64_t);
+static u_char *load_payload(u_int32_t *);
+static int replay_session(replay_entry_t *, u_int, u_char, replay_totals_t *);
+static ssize_t replay_read(nsock_t *, u_int64_t);
+static int replay_write(nsock_t *, u_char *, size_t, u_int64_t *, u_char *);
+
+/* -G sessions read until the server closes rather than a set amount */
+static u_char replay_to_eof = 0;
+
+/* and are cut off when the run is over */
+static u_int64_t replay_end = 0;
+
+
+/*
+ * start recording a session
+ */
+rec_t *
+rec_open(path)
+   u_char *path;
+{
+   char name[1024];
+   u_char hdr[REC_HDR_LEN];
+   rec_t *rec;
+   
+   /* a -L listener records every session on its own */
+   if (opts.flags & FLAG_KEEP_LISTEN)
+     snprintf(name, sizeof(name), "%s.%d", path, (int)getpid());
+   else
+     snprintf(name, sizeof(name), "%s", path);
+   
+   if (!(rec = calloc(1, sizeof(rec_t))))
+     return NULL;
+   if (!(rec->fp = fopen(name, "w")))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "record: %s: %s\n", name, strerror(errno));
+	free(rec);
+	return NULL;
+     }
+   
+   memcpy(hdr, REC_MAGIC, 4);
+   hdr[4] = REC_VERSION;
+   hdr[5] = (opts.flags & MODE_MASK) == MODE_LISTEN ? REC_CONN : REC_LOCAL;
+   fwrite(hdr, 1, REC_HDR_LEN, rec->fp);
+   rec->last = stats_now();
+   
+   /* sessions end by returning from deep in io_pipe, the file is
+    * flushed when the process exits */
+   return rec;
+}
+
+
+/*
+ * note some data that was read
+ */
+void
+rec_write(rec, dir, data, len)
+   rec_t *rec;
+   u_char dir;
+   u_char *data;
+   size_t len;
+{
+   u_char hdr[REC_ENTRY_LEN];
+   u_int64_t now, gap;
+   
+   if (!rec || len == 0)
+     return;
+   now = stats_now();
+   gap = now > rec->last ? now - rec->last : 0;
+   if (gap > 0xffffffff)
+     gap = 0xffffffff;
+   rec->last = now;
+   
+   hdr[0] = gap >> 24;
+   hdr[1] = gap >> 16;
+   hdr[2] = gap >> 8;
+   hdr[3] = gap;
+   hdr[4] = dir;
+   hdr[5] = len >> 24;
+   hdr[6] = len >> 16;
+   hdr[7] = len >> 8;
+   hdr[8] = len;
+   fwrite(hdr, 1, REC_ENTRY_LEN, rec->fp);
+   fwrite(data, 1, len, rec->fp);
+}
+
+
+void
+rec_close(rec)
+   rec_t *rec;
+{
+   if (!rec)
+     return;
+   fclose(rec->fp);
+   free(rec);
+}
+
+
+/*
+ * play a recording to opts.dhost.  returns the exit code for main().
+ */
+int
+replay_run(file)
+   u_char *file;
+{
+   replay_entry_t *entries;
+   u_int n;
+   u_char client;
+   
+   if (!(entries = replay_load(file, &n, &client)))
+     return 1;
+   return replay_start(entries, n, client);
+}
+
+
+/*
+ * generate load on opts.dhost (-G).  returns the exit code for main().
+ */
+int
+load_run(void)
+{
+   replay_entry_t *entries;
+   u_int n = 0;
+   u_char client = REC_LOCAL;
+   
+   if (opts.replay)
+     {
+	if (!(entries = replay_load(opts.replay, &n, &client)))
+	  return 1;
+	return replay_start(entries, n, client);
+     }
+   
+   if (!(entries = calloc(1, sizeof(replay_entry_t))))
+     {
+	perror("load");
+	return 1;
+     }
+   /* connect_to_host() would count -z sessions as failures, an empty
+    * session connects and closes all the same */
+   if (opts.flags & FLAG_ZERO_IO)
+     opts.flags &= ~FLAG_ZERO_IO;
+   else
+     {
+	if (!(entries->data = load_payload(&(entries->len))))
+	  return 1;
+	entries->dir = REC_LOCAL;
+	n = 1;
+	replay_to_eof = 1;
+     }
+   return replay_start(entries, n, client);
+}
+
+
+/*
+ * fork the connections, wait for them and sum up
+ */
+static int
+replay_start(entries, n, client)
+   replay_entry_t *entries;
+   u_int n;
+   u_char client;
+{
+   replay_totals_t *totals;
+   u_int conns = opts.load_conns ? opts.load_conns : opts.replay_conns;
+   u_int i;
+   u_int64_t start;
+   double secs;
+   pid_t cpid;
+   
+   if (!(totals = shared_alloc(sizeof(replay_totals_t))))
+     {
+	perror("replay");
+	return 1;
+     }
+   
+   signal(SIGPIPE, SIG_IGN);
+   start = stats_now();
+   for (i = 0; i < conns; i++)
+     {
+	if ((cpid = fork()) == 0)
+	  {
+	     if (opts.load_conns)
+	       exit(load_worker(entries, n, client, totals, start));
+	     exit(replay_session(entries, n, client, totals) == -1);
+	  }
+	if (cpid == -1)
+	  {
+	     if (opts.verbosity > 0)
+	       perror("fork failed");
+	     SHARED_INC(totals->failed);
+	  }
+     }
+   while (wait(NULL) != -1 || errno == EINTR)
+     ;
+   
+   secs = (double)(stats_now() - start) / 1000000;
+   fprintf(stderr, "%s %lu session%s (%lu failed), %lu bytes sent, "
+	   "%lu received in %.3f secs\n",
+	   opts.load_conns ? "ran" : "replayed",
+	   totals->sessions, totals->sessions == 1 ? "" : "s", totals->failed,
+	   totals->bytes[0], totals->bytes[1], secs);
+   if (opts.load_conns && secs > 0)
+     fprintf(stderr, "%.1f sessions/sec, %.2f MB/s sent, %.2f MB/s received\n",
+	     totals->sessions / secs, totals->bytes[0] / secs / 1048576,
+	     totals->bytes[1] / secs / 1048576);
+   if (opts.flags & FLAG_LATENCY)
+     stats_report();
+   return totals->failed ? 1 : 0;
+}
+
+
+/*
+ * read a recording into memory.  the entries point into the file's
+ * contents.
+ */
+static replay_entry_t *
+replay_load(file, np, clientp)
+   u_char *file;
+   u_int *np;
+   u_char *clientp;
+{
+   replay_entry_t *entries;
+   struct stat st;
+   u_char *buf, *p, *end;
+   u_int64_t at = 0;
+   u_int32_t len;
+   u_int n = 0;
+   FILE *fp;
+   
+   if (!(fp = fopen((char *)file, "r"))
+       || fstat(fileno(fp), &st) == -1
+       || !(buf = malloc(st.st_size + 1))
+       || fread(buf, 1, st.st_size, fp) != (size_t)st.st_size)
+     {
+	fprintf(stderr, "replay: %s: %s\n", file, strerror(errno));
+	return NULL;
+     }
+   fclose(fp);
+   
+   if (st.st_size < REC_HDR_LEN
+       || memcmp(buf, REC_MAGIC, 4) || buf[4] != REC_VERSION)
+     {
+	fprintf(stderr, "replay: %s: not a recording\n", file);
+	return NULL;
+     }
+   *clientp = buf[5];
+   
+   /* count them, then pick them out */
+   end = buf + st.st_size;
+   for (p = buf + REC_HDR_LEN; end - p >= REC_ENTRY_LEN; p += REC_ENTRY_LEN + len)
+     {
+	len = ((u_int32_t)p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+	if ((size_t)(end - p - REC_ENTRY_LEN) < len)
+	  break;
+	n++;
+     }
+   if (!(entries = calloc(n + 1, sizeof(replay_entry_t))))
+     {
+	perror("replay");
+	return NULL;
+     }
+   
+   *np = 0;
+   for (p = buf + REC_HDR_LEN; *np < n; p += REC_ENTRY_LEN + len)
+     {
+	at += ((u_int32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	len = ((u_int32_t)p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+	entries[*np].at = at;
+	entries[*np].dir = p[4];
+	entries[*np].len = len;
+	entries[*np].data = p + REC_ENTRY_LEN;
+	(*np)++;
+     }
+   return entries;
+}
+
+
+/*
+ * one connection's worth of the recording.  the client's data goes out
+ * on time and the server is read from while waiting, and while the
+ * writes wait for room.
+ */
+static int
+replay_session(entries, n, client, totals)
+   replay_entry_t *entries;
+   u_int n;
+   u_char client;
+   replay_totals_t *totals;
+{
+   nsock_t *ns;
+   u_int64_t begin, due, now, expect = 0, got = 0, sent = 0;
+   ssize_t len;
+   u_char eof = 0;
+   u_int i;
+   
+   for (i = 0; i < n; i++)
+     if (entries[i].dir != client)
+       expect += entries[i].len;
+   
+   if (!(ns = connect_to_host(opts.shost, opts.dhost, 0)))
+     {
+	SHARED_INC(totals->failed);
+	return -1;
+     }
+   begin = stats_now();
+   if (stats)
+     stats_session_start = begin;
+   
+   /* the server is read from while the writes wait for room */
+   fcntl(ns->sd, F_SETFL, fcntl(ns->sd, F_GETFL) | O_NONBLOCK);
+   
+   for (i = 0; i < n; i++)
+     {
+	if (entries[i].dir != client)
+	  continue;
+	
+	/* keep the recorded pace, scaled by -Y's speed */
+	if (opts.replay_speed > 0)
+	  {
+	     due = begin + (u_int64_t)(entries[i].at / opts.replay_speed);
+	     while (!eof && (now = stats_now()) < due)
+	       if ((len = replay_read(ns, due - now)) == -1)
+		 eof = 1;
+	       else
+		 got += len;
+	     if (eof && (now = stats_now()) < due)
+	       stats_sleep(due - now);
+	  }
+	
+	/* at full speed there is no waiting to read in, so take what the
+	 * server has sent so far before the next entry goes */
+	else
+	  while (!eof && (len = replay_read(ns, 0)) != 0)
+	    if (len == -1)
+	      eof = 1;
+	    else
+	      got += len;
+	
+	if (replay_write(ns, entries[i].data, entries[i].len, &got, &eof) == -1)
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "replay: write: %s\n", strerror(errno));
+	     nsock_close(ns);
+	     SHARED_INC(totals->failed);
+	     return -1;
+	  }
+	sent += entries[i].len;
+     }
+   
+   /* whatever the server still has to say */
+   if (replay_to_eof)
+     {
+#ifdef HAVE_SSL
+	if (!(ns->opt & NSF_USE_SSL))
+#endif
+	  shutdown(ns->sd, SHUT_WR);
+     }
+   due = stats_now() + REPLAY_LINGER * 1000000;
+   while (!eof && (replay_to_eof || got < expect)
+	  && (now = stats_now()) < due && (!replay_end || now < replay_end))
+     if ((len = replay_read(ns, due - now)) == -1)
+       break;
+     else if (len > 0)
+       {
+	  got += len;
+	  due = stats_now() + REPLAY_LINGER * 1000000;
+       }
+   nsock_close(ns);
+   if (stats)
+     stats_record(HIST_SESSION, stats_now() - begin);
+   
+   SHARED_INC(totals->sessions);
+   SHARED_ADD(totals->bytes[0], sent);
+   SHARED_ADD(totals->bytes[1], got);
+   return 0;
+}
+
+
+/*
+ * run sessions back to back until -G's time is up.  with a rate each
+ * session takes the next start time, shared by all the workers.
+ */
+static int
+load_worker(entries, n, client, totals, start)
+   replay_entry_t *entries;
+   u_int n;
+   u_char client;
+   replay_totals_t *totals;
+   u_int64_t start;
+{
+   u_int64_t end = start + (u_int64_t)opts.load_secs * 1000000;
+   u_int64_t at, now;
+   
+   replay_end = end;
+   while ((now = stats_now()) < end)
+     {
+	if (opts.load_rate)
+	  {
+	     at = start + (u_int64_t)SHARED_INC(totals->started) * 1000000
+	       / opts.load_rate;
+	     if (at >= end)
+	       break;
+	     if (at > now)
+	       stats_sleep(at - now);
+	  }
+	replay_session(entries, n, client, totals);
+     }
+   return 0;
+}
+
+
+/*
+ * read all of stdin for -G to send
+ */
+static u_char *
+load_payload(lenp)
+   u_int32_t *lenp;
+{
+   u_char *buf = NULL, *p;
+   size_t size = 0, len = 0;
+   ssize_t ret;
+   
+   while (1)
+     {
+	if (len == size)
+	  {
+	     size = size ? size * 2 : NSOCK_IOP_BLOCKSZ;
+	     if (!(p = realloc(buf, size)))
+	       {
+		  perror("load");
+		  return NULL;
+	       }
+	     buf = p;
+	  }
+	if ((ret = read(0, buf + len, size - len)) == -1)
+	  {
+	     if (errno == EINTR)
+	       continue;
+	     perror("load: stdin");
+	     return NULL;
+	  }
+	if (ret == 0)
+	  break;
+	len += ret;
+     }
+   *lenp = len;
+   return buf;
+}
+
+
+/*
+ * read and throw away what the server sent, waiting up to usecs for
+ * it.  returns how much came (0 for none yet, or for a record without
+ * data in it), or -1 once the server is done.
+ */
+static ssize_t
+replay_read(ns, usecs)
+   nsock_t *ns;
+   u_int64_t usecs;
+{
+   u_char buf[NSOCK_IOP_BLOCKSZ];
+   struct timeval tv;
+   fd_set rd;
+   ssize_t len;
+   
+#ifdef HAVE_SSL
+   if (!(ns->opt & NSF_USE_SSL) || SSL_pending(ns->ns_ssl.ssl) == 0)
+#endif
+     {
+	tv.tv_sec = usecs / 1000000;
+	tv.tv_usec = usecs % 1000000;
+	FD_ZERO(&rd);
+	FD_SET(ns->sd, &rd);
+	switch (select(ns->sd + 1, &rd, NULL, NULL, &tv))
+	  {
+	   case -1:
+	     return errno == EINTR ? 0 : -1;
+	   case 0:
+	     return 0;
+	  }
+     }
+#ifdef HAVE_SSL
+   if (ns->opt & NSF_USE_SSL)
+     len = SSL_read(ns->ns_ssl.ssl, buf, sizeof(buf));
+   else
+#endif
+     len = read(ns->sd, buf, sizeof(buf));
+   if (len == -1 && (errno == EAGAIN || errno == EINTR))
+     return 0;
+   if (len < 1)
+     {
+#ifdef HAVE_SSL
+	if (ns->opt & NSF_USE_SSL
+	    && SSL_get_error(ns->ns_ssl.ssl, len) == SSL_ERROR_WANT_READ)
+	  return 0;
+#endif
+	return -1;
+     }
+   
+   /* the first reply is the first byte relayed as far as -T cares */
+   if (stats && stats_session_start)
+     {
+	stats_record(HIST_FIRST_BYTE, stats_now() - stats_session_start);
+	stats_session_start = 0;
+     }
+   return len;
+}
+
+
+/*
+ * send some of the recording.  a server that answers as it reads stops
+ * reading once its replies back up, so they are read (and added to
+ * *gotp) whenever they come until it all went out.  returns -1 if the
+ * server can't be written to, or when -G's time is up.
+ */
+static int
+replay_write(ns, data, len, gotp, eofp)
+   nsock_t *ns;
+   u_char *data;
+   size_t len;
+   u_int64_t *gotp;
+   u_char *eofp;
+{
+   struct timeval tv, *tvp;
+   fd_set rd, wr;
+   u_int64_t now;
+   ssize_t ret;
+   
+   while (len > 0)
+     {
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	if (!*eofp)
+	  FD_SET(ns->sd, &rd);
+	FD_SET(ns->sd, &wr);
+	tvp = NULL;
+	if (replay_end)
+	  {
+	     if ((now = stats_now()) >= replay_end)
+	       {
+		  errno = ETIMEDOUT;
+		  return -1;
+	       }
+	     tv.tv_sec = (replay_end - now) / 1000000;
+	     tv.tv_usec = (replay_end - now) % 1000000;
+	     tvp = &tv;
+	  }
+	if (select(ns->sd + 1, &rd, &wr, NULL, tvp) == -1)
+	  {
+	     if (errno == EINTR)
+	       continue;
+	     return -1;
+	  }
+	
+	if (FD_ISSET(ns->sd, &rd))
+	  {
+	     if ((ret = replay_read(ns, 0)) == -1)
+	       *eofp = 1;
+	     else
+	       *gotp += ret;
+	  }
+	if (!FD_ISSET(ns->sd, &wr))
+	  continue;
+	
+#ifdef HAVE_SSL
+	if (ns->opt & NSF_USE_SSL)
+	  {
+	     if ((ret = SSL_write(ns->ns_ssl.ssl, data, len)) < 1)
+	       switch (SSL_get_error(ns->ns_ssl.ssl, ret))
+		 {
+		  case SSL_ERROR_WANT_READ:
+		  case SSL_ERROR_WANT_WRITE:
+		    continue;
+		  default:
+		    return -1;
+		 }
+	  }
+	else
+#endif
+	  ret = write(ns->sd, data, len);
+	if (ret < 1)
+	  {
+	     if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+	       continue;
+	     return -1;
+	  }
+	data += ret;
+	len -= ret;
+     }
+   return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * sessions recorded to a file and played back (-o/-Y), and load (-G)
+ */
+#ifndef __nsc_record_h
+#define __nsc_record_h
+
+/* a recording is this header followed by records of a be32 usecs since
+ * the last record, a direction byte, a be32 length and the data */
+#define REC_MAGIC 	"NSCR"
+#define REC_VERSION 	0x01
+#define REC_HDR_LEN 	6 	/* magic, version, which side is the client */
+#define REC_ENTRY_LEN 	9
+
+#define REC_CONN 	0 	/* read from the connection */
+#define REC_LOCAL 	1 	/* read from stdin, -e or the pipe host */
+
+/* a replayed session is over once the server stays quiet this long */
+#define REPLAY_LINGER 	5
+
+/* -G runs this long unless told otherwise */
+#define LOAD_SECS 	10
+
+typedef struct __nsc_rec_stru
+{
+   FILE *fp;
+   u_int64_t last; 		/* when the previous record was written */
+} rec_t;
+
+typedef struct __nsc_replay_entry_stru
+{
+   u_int64_t at; 		/* usecs into the session */
+   u_char dir;
+   u_int32_t len;
+   u_char *data;
+} replay_entry_t;
+
+typedef struct __nsc_replay_totals_stru
+{
+   u_long sessions;
+   u_long failed;
+   u_long started; 		/* -G sessions handed a start time */
+   u_long bytes[2]; 		/* sent, received */
+} replay_totals_t;
+
+rec_t *rec_open(u_char *);
+void rec_write(rec_t *, u_char, u_char *, size_t);
+void rec_close(rec_t *);
+int replay_run(u_char *);
+int load_run(void);
+
+#endif
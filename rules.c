@@ -0,0 +1,301 @@
+/*
+ * many forwards served by one process.
+ *
+ * every line of a -F file holds the options nsc would take for one
+ * forward, as if they followed "nsc -l -L".  the lines are parsed one at
+ * a time with parse_argv() and kept, each with its own pipe host table.
+ * one process then waits on all the listeners and forks a child for
+ * each session, which carries on with the options of its line just as
+ * a -L child would.
+ *
+ *   # ssh and a balanced web forward
+ *   -d 127.0.0.1:22 0:2222
+ *   -b lc -H 5 -d 10.0.0.1:80,10.0.0.2:80 0:8080
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "backend.h"
+#include "rules.h"
+#include "handoff.h"
+
+
+static rule_t rules[RULES_MAX];
+static u_int nrules = 0;
+
+static int rules_load(u_char *);
+static int rules_split(u_char *, u_char **, int);
+static void rules_handoff(int);
+
+
+/*
+ * load the rules, open their listeners and hand out sessions.  returns
+ * a client in each child, or NULL if something went wrong.
+ */
+nsock_t *
+rules_serve(file)
+   u_char *file;
+{
+   struct sigaction sa;
+   struct timeval tv;
+   u_int64_t wait, least;
+   fd_set rd;
+   nsock_t *cli;
+   pid_t cpid;
+   u_int i, j;
+   int high, fatal, hsd;
+
+   if (rules_load(file) == -1)
+     return NULL;
+
+   /* the checkers start before the listeners so they don't hold them */
+   for (i = 0; i < nrules; i++)
+     {
+	opts = rules[i].opts;
+	backend_restore(rules[i].be);
+	if (opts.check_interval)
+	  {
+	     if ((cpid = backend_start_checks(-1)) == -1
+		 && opts.verbosity > 0)
+	       perror("unable to start pipe host checks");
+	     handoff_helper(cpid);
+	  }
+     }
+
+   for (i = 0; i < nrules; i++)
+     {
+	opts = rules[i].opts;
+	if (!(rules[i].listener = open_listener()))
+	  return NULL;
+	setup_listener(rules[i].listener);
+     }
+   hsd = handoff_open();
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = reap_children;
+   sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+   sigaction(SIGCHLD, &sa, NULL);
+
+   while (1)
+     {
+	FD_ZERO(&rd);
+	high = hsd + 1;
+	if (hsd != -1)
+	  FD_SET(hsd, &rd);
+	least = 0;
+	for (i = 0; i < nrules; i++)
+	  {
+	     /* one over its -Q rate sits out until it may accept again */
+	     opts = rules[i].opts;
+	     if ((wait = accept_pace(0)))
+	       {
+		  if (!least || wait < least)
+		    least = wait;
+		  continue;
+	       }
+	     FD_SET(rules[i].listener->sd, &rd);
+	     if (rules[i].listener->sd >= high)
+	       high = rules[i].listener->sd + 1;
+	  }
+	tv.tv_sec = least / 1000000;
+	tv.tv_usec = least % 1000000;
+	if (select(high, &rd, NULL, NULL, least ? &tv : NULL) < 1)
+	  continue;
+	if (hsd != -1 && FD_ISSET(hsd, &rd))
+	  rules_handoff(hsd);
+
+	for (i = 0; i < nrules; i++)
+	  {
+	     if (!FD_ISSET(rules[i].listener->sd, &rd))
+	       continue;
+
+	     /* take everyone that is waiting on this one */
+	     opts = rules[i].opts;
+	     backend_restore(rules[i].be);
+	     while ((cli = accept_client(rules[i].listener, &fatal))
+		    || fatal == 0)
+	       {
+		  if (!cli)
+		    continue;
+
+		  cpid = fork();
+		  if (cpid == -1 && opts.verbosity > 0)
+		    perror("fork failed");
+		  if (cpid == 0)
+		    {
+		       signal(SIGCHLD, SIG_DFL);
+		       if (hsd != -1)
+			 close(hsd);
+		       for (j = 0; j < nrules; j++)
+			 nsock_free(&(rules[j].listener));
+		       if (opts.verbosity > 1)
+			 fprintf(stderr, "connection from [%s] accepted\n",
+				 reverse_host(cli, &(cli->inet_fin)));
+		       return cli;
+		    }
+
+		  /* the parent only needs the listeners */
+		  close(cli->sd);
+		  cli->sd = -1;
+		  nsock_free(&cli);
+	       }
+	     if (fatal == 1)
+	       return NULL;
+	  }
+     }
+}
+
+
+/*
+ * pass every listener on to the nsc that replaces us (-W)
+ */
+static void
+rules_handoff(hsd)
+   int hsd;
+{
+   nsock_t *listeners[RULES_MAX];
+   u_char *names[RULES_MAX];
+   u_int i;
+
+   for (i = 0; i < nrules; i++)
+     {
+	listeners[i] = rules[i].listener;
+	names[i] = rules[i].opts.lhost;
+     }
+   handoff_give(hsd, listeners, names, nrules);
+}
+
+
+/*
+ * parse every line of the file into a rule
+ */
+static int
+rules_load(file)
+   u_char *file;
+{
+   char line[RULES_LINE], where[1024];
+   u_char *argv[RULES_MAX_ARGS + 3], *copy;
+   u_int verbosity = opts.verbosity;
+   u_int lineno = 0;
+   int argc;
+   FILE *fp;
+
+   if (!(fp = fopen((char *)file, "r")))
+     {
+	fprintf(stderr, "%s: %s\n", file, strerror(errno));
+	return -1;
+     }
+
+   while (fgets(line, sizeof(line), fp))
+     {
+	lineno++;
+
+	/* the options point into the line, so it is kept (memory leaked) */
+	if (!(copy = (u_char *)strdup(line)))
+	  {
+	     perror("strdup");
+	     fclose(fp);
+	     return -1;
+	  }
+	if ((argc = rules_split(copy, argv + 2, RULES_MAX_ARGS)) == 0)
+	  {
+	     free(copy);
+	     continue;
+	  }
+	snprintf(where, sizeof(where), "%s:%u", file, lineno);
+	if (argc == -1 || nrules == RULES_MAX)
+	  {
+	     fprintf(stderr, "%s: too many %s\n", where,
+		     argc == -1 ? "words" : "forwards");
+	     fclose(fp);
+	     return -1;
+	  }
+
+	/* parse_argv() reports problems with argv[0] in front */
+	argv[0] = (u_char *)strdup(where);
+	argv[1] = (u_char *)"-lL";
+	optind = 1;
+	parse_argv(argc + 2, argv);
+
+	if (opts.rules || opts.handoff || opts.metrics || opts.mux || opts.stripe
+	    || opts.flags & (FLAG_FORK | FLAG_LATENCY | FLAG_DEMUX))
+	  {
+	     fprintf(stderr, "%s: -F, -f, -M, -T, -W, -m, -N and -P can't be used in a rule\n", where);
+	     fclose(fp);
+	     return -1;
+	  }
+	opts.verbosity += verbosity;
+
+	rules[nrules].opts = opts;
+	if (opts.flags & FLAG_DATAPIPE
+	    && !(rules[nrules].be = backend_save()))
+	  {
+	     perror("backend_save");
+	     fclose(fp);
+	     return -1;
+	  }
+	nrules++;
+     }
+   fclose(fp);
+
+   if (nrules == 0)
+     {
+	fprintf(stderr, "%s: no forwards found\n", file);
+	return -1;
+     }
+   return 0;
+}
+
+
+/*
+ * split a line into words.  a word may be put in double quotes to keep
+ * spaces in it, and a # at the start of a word ends the line.  returns
+ * the number of words, or -1 if there are more than max.
+ */
+static int
+rules_split(line, argv, max)
+   u_char *line, **argv;
+   int max;
+{
+   u_char *p = line;
+   int argc = 0;
+
+   while (1)
+     {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+	  p++;
+	if (*p == '\0' || *p == '#')
+	  break;
+	if (argc == max)
+	  return -1;
+
+	if (*p == '"')
+	  {
+	     argv[argc++] = ++p;
+	     while (*p && *p != '"')
+	       p++;
+	  }
+	else
+	  {
+	     argv[argc++] = p;
+	     while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+	       p++;
+	  }
+	if (*p == '\0')
+	  break;
+	*p++ = '\0';
+     }
+   argv[argc] = NULL;
+   return argc;
+}
@@ -0,0 +1,20 @@
+/*
+ * many forwards served by one process (-F)
+ */
+#ifndef __nsc_rules_h
+#define __nsc_rules_h
+
+#define RULES_MAX 	256 	/* forwards in one file */
+#define RULES_MAX_ARGS 	64 	/* words on one line */
+#define RULES_LINE 	4096
+
+typedef struct __nsc_rule_stru
+{
+   options_t opts; 		/* as parsed from the line */
+   backend_set_t *be; 		/* its pipe hosts, if any */
+   nsock_t *listener;
+} rule_t;
+
+nsock_t *rules_serve(u_char *);
+
+#endif
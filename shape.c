@@ -0,0 +1,160 @@
+/*
+ * rate limits on what is relayed.
+ *
+ * each limit is a token bucket, kept as the time it will be full again
+ * (the "theoretical arrival time" of GCRA) rather than as a count of
+ * tokens.  taking from it is then one compare and swap, so the limit
+ * for all sessions (-a) can sit in shared memory and be taken from by
+ * every -L child at once.  -g gives each session buckets of its own.
+ *
+ * io_pipe only writes what the buckets allow and asks how long until
+ * they allow more, which becomes its select() timeout.  nothing sleeps
+ * and the other direction carries on meanwhile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "shape.h"
+
+
+#define NSECS 	1000000000ULL
+
+
+/*
+ * parse <out>[:<in>] bytes per second, each with an optional k, m or g.
+ * a rate of 0 leaves that direction alone.
+ */
+int
+shape_parse(spec, rates)
+   u_char *spec;
+   u_int64_t *rates;
+{
+   char *p = (char *)spec;
+   u_int i;
+
+   rates[SHAPE_OUT] = rates[SHAPE_IN] = 0;
+   for (i = 0; i < 2; i++)
+     {
+	if (*p < '0' || *p > '9')
+	  return -1;
+	rates[i] = strtoull(p, &p, 10);
+	switch (*p)
+	  {
+	   case 'g':
+	   case 'G':
+	     rates[i] *= 1024;
+	     /* fall through */
+	   case 'm':
+	   case 'M':
+	     rates[i] *= 1024;
+	     /* fall through */
+	   case 'k':
+	   case 'K':
+	     rates[i] *= 1024;
+	     p++;
+	     break;
+	  }
+	if (*p == '\0')
+	  return 0;
+	if (*p != ':' || i == 1)
+	  return -1;
+	p++;
+     }
+   return -1;
+}
+
+
+/*
+ * a full bucket for rate bytes per second, in shared memory if every
+ * process is to draw from it
+ */
+shape_t *
+shape_new(rate, shared)
+   u_int64_t rate;
+   u_char shared;
+{
+   shape_t *s;
+
+   if (shared)
+     s = shared_alloc(sizeof(shape_t));
+   else
+     s = calloc(1, sizeof(shape_t));
+   if (!s)
+     return NULL;
+   s->rate = rate;
+   s->burst = rate / SHAPE_BURST_DIV;
+   if (s->burst < SHAPE_MIN_BURST)
+     s->burst = SHAPE_MIN_BURST;
+   s->tat = 0;
+   return s;
+}
+
+
+/*
+ * how many bytes may go at now (usecs)
+ */
+size_t
+shape_room(s, now)
+   shape_t *s;
+   u_int64_t now;
+{
+   u_int64_t t = now * 1000, tau, tat = s->tat;
+
+   tau = s->burst * NSECS / s->rate;
+   if (tat < t)
+     tat = t;
+   if (tat >= t + tau)
+     return 0;
+   return (t + tau - tat) * s->rate / NSECS;
+}
+
+
+/*
+ * len bytes went at now.  another process may have taken some since
+ * shape_room(), which only means the next wait is longer.
+ */
+void
+shape_take(s, len, now)
+   shape_t *s;
+   size_t len;
+   u_int64_t now;
+{
+   u_int64_t t = now * 1000, cost, old, new;
+
+   cost = (u_int64_t)len * NSECS / s->rate;
+   do
+     {
+	old = s->tat;
+	new = (old > t ? old : t) + cost;
+     }
+   while (!__sync_bool_compare_and_swap(&(s->tat), old, new));
+}
+
+
+/*
+ * usecs from now until len bytes may go (or a full bucket, if less)
+ */
+u_int64_t
+shape_wait(s, len, now)
+   shape_t *s;
+   size_t len;
+   u_int64_t now;
+{
+   u_int64_t t = now * 1000, tau, ready;
+
+   if (len > s->burst)
+     len = s->burst;
+   tau = s->burst * NSECS / s->rate;
+   ready = s->tat + (u_int64_t)len * NSECS / s->rate;
+   if (ready <= t + tau)
+     return 0;
+   return (ready - t - tau + 999) / 1000;
+}
@@ -0,0 +1,31 @@
+/*
+ * rate limits on what is relayed (-g/-a)
+ */
+#ifndef __nsc_shape_h
+#define __nsc_shape_h
+
+/* a bucket holds a tenth of a second of its rate, but at least this much */
+#define SHAPE_BURST_DIV 	10
+#define SHAPE_MIN_BURST 	4096
+
+/* writes smaller than this are put off until more is allowed */
+#define SHAPE_MIN_WRITE 	1024
+
+/* SHAPE_OUT is sent on the connection, SHAPE_IN to the local side */
+#define SHAPE_OUT 		0
+#define SHAPE_IN 		1
+
+typedef struct __nsc_shape_stru
+{
+   u_int64_t rate; 		/* bytes per second */
+   u_int64_t burst; 		/* bytes the bucket holds */
+   u_int64_t tat; 		/* nsecs, when the bucket is full again */
+} shape_t;
+
+int shape_parse(u_char *, u_int64_t *);
+shape_t *shape_new(u_int64_t, u_char);
+size_t shape_room(shape_t *, u_int64_t);
+void shape_take(shape_t *, size_t, u_int64_t);
+u_int64_t shape_wait(shape_t *, size_t, u_int64_t);
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ * counters and latency histograms shared by every session, and a small
+ * http server that hands them out in the prometheus text format.
+ *
+ * the counters live in shared memory (see shared_alloc()) so that every
+ * forked session adds to the same numbers.  the server runs in its own
+ * process so a slow scraper can never hold up the listener.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "backend.h"
+#include "unixsock.h"
+
+
+/* accepts per second is averaged over this many seconds */
+#define STATS_RATE_WINDOW 	10
+
+
+stats_t *stats = NULL;
+u_int64_t stats_session_start = 0; 	/* when this session was accepted */
+
+/* names and bucket bounds (in microseconds) for the metrics page */
+static char *hist_names[HIST_COUNT] =
+{
+   "nsc_accept_seconds",
+   "nsc_connect_seconds",
+   "nsc_first_byte_seconds",
+   "nsc_relay_delay_seconds",
+   "nsc_kernel_rx_seconds",
+   "nsc_kernel_tx_seconds",
+   "nsc_hop_seconds",
+   "nsc_session_seconds",
+};
+static char *hist_help[HIST_COUNT] =
+{
+   "Time to accept a client, including any SSL handshake.",
+   "Time to connect out, including any SSL handshake.",
+   "Time from the start of a session to the first byte relayed.",
+   "Time relayed data spent in nsc's buffers.",
+   "Time received data waited in the kernel before nsc read it.",
+   "Time from nsc writing data to the kernel handing it to the device.",
+   "Time from the kernel receiving data to sending it on, nsc included.",
+   "Time a replayed or generated session took once connected.",
+};
+static u_long hist_le[] =
+{
+   50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+   100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static u_long rate_accepts[STATS_RATE_WINDOW];
+static time_t rate_time[STATS_RATE_WINDOW];
+static u_int rate_pos = 0;
+
+static u_int stats_bucket(u_long);
+static u_long stats_bucket_max(u_int);
+static u_long stats_percentile(u_int, double);
+static void stats_sample(void);
+static double stats_accept_rate(void);
+static void stats_serve(int);
+static void stats_print(FILE *, char *, char *, char *, u_long);
+
+
+/*
+ * get the shared counters ready
+ */
+int
+stats_init(void)
+{
+   if (!(stats = shared_alloc(sizeof(stats_t))))
+     return -1;
+   return 0;
+}
+
+
+/*
+ * count an error by its NSERR_* code
+ */
+void
+stats_error(code)
+   u_int code;
+{
+   if (!stats || code == NSERR_SUCCESS)
+     return;
+   if (code >= STATS_MAX_ERRNO)
+     code = STATS_MAX_ERRNO - 1;
+   SHARED_INC(stats->errors[code]);
+}
+
+
+/*
+ * microseconds on a clock that doesn't jump when the time is set, for
+ * measuring things and for deadlines
+ */
+u_int64_t
+stats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+   
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+     return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+   return stats_wall();
+}
+
+
+/*
+ * microseconds since the epoch, which is what kernel timestamps are
+ */
+u_int64_t
+stats_wall(void)
+{
+   struct timeval tv;
+   
+   gettimeofday(&tv, NULL);
+   return (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * sleep for some microseconds.  usleep() may refuse a second or more,
+ * which the pacing and check intervals easily ask for
+ */
+void
+stats_sleep(usecs)
+   u_int64_t usecs;
+{
+   struct timespec ts;
+   
+   ts.tv_sec = usecs / 1000000;
+   ts.tv_nsec = (usecs % 1000000) * 1000;
+   nanosleep(&ts, NULL);
+}
+
+
+/*
+ * add a sample to one of the latency histograms
+ */
+void
+stats_record(which, usecs)
+   u_int which;
+   u_int64_t usecs;
+{
+   u_long v = usecs > 0xffffffffUL ? 0xffffffffUL : (u_long)usecs;
+   
+   if (!stats)
+     return;
+   SHARED_INC(stats->hist[which][stats_bucket(v)]);
+   SHARED_INC(stats->hist_count[which]);
+   SHARED_ADD(stats->hist_sum[which], usecs);
+}
+
+
+/*
+ * print percentiles for every histogram that has samples
+ */
+void
+stats_report(void)
+{
+   FILE *fp = stderr;
+   u_int i;
+   
+   if (!stats)
+     return;
+   fprintf(fp, "%-24s %10s %10s %10s %10s %10s %10s\n", "latency (usecs)",
+	   "count", "p50", "p90", "p99", "p99.9", "max");
+   for (i = 0; i < HIST_COUNT; i++)
+     {
+	if (stats->hist_count[i] == 0)
+	  continue;
+	/* skip the "nsc_" and drop the "_seconds" */
+	fprintf(fp, "  %-22.*s %10lu %10lu %10lu %10lu %10lu %10lu\n",
+		(int)(strlen(hist_names[i]) - 12), hist_names[i] + 4,
+		stats->hist_count[i],
+		stats_percentile(i, 0.5), stats_percentile(i, 0.9),
+		stats_percentile(i, 0.99), stats_percentile(i, 0.999),
+		stats_percentile(i, 1.0));
+     }
+}
+
+
+/*
+ * which bucket a value falls in.  values below HIST_SUB get their own
+ * bucket, after that each power of two is split into HIST_SUB steps.
+ */
+static u_int
+stats_bucket(v)
+   u_long v;
+{
+   u_int msb;
+   
+   if (v < HIST_SUB)
+     return v;
+   msb = 31 - __builtin_clz((u_int32_t)v);
+   return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+     + (u_int)(v >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+
+/*
+ * the largest value that lands in a bucket
+ */
+static u_long
+stats_bucket_max(idx)
+   u_int idx;
+{
+   u_int group = idx >> HIST_SUB_BITS;
+   u_int64_t low;
+   
+   if (group == 0)
+     return idx;
+   low = (u_int64_t)(HIST_SUB + (idx & (HIST_SUB - 1))) << (group - 1);
+   return (u_long)(low + ((u_int64_t)1 << (group - 1)) - 1);
+}
+
+
+/*
+ * the value below which the given fraction of samples fall
+ */
+static u_long
+stats_percentile(which, frac)
+   u_int which;
+   double frac;
+{
+   u_long want, seen = 0;
+   u_int i, last = 0;
+   
+   want = (u_long)(frac * stats->hist_count[which] + 0.5);
+   if (want == 0)
+     want = 1;
+   for (i = 0; i < HIST_BUCKETS; i++)
+     {
+	if (stats->hist[which][i] == 0)
+	  continue;
+	last = i;
+	seen += stats->hist[which][i];
+	if (seen >= want)
+	  break;
+     }
+   return stats_bucket_max(last);
+}
+
+
+/*
+ * start listening on opts.metrics and fork off the server.  the listener
+ * is set up before forking so that a bad address is reported right away.
+ * unused_sd is closed in the server process.
+ */
+pid_t
+stats_start_server(unused_sd)
+   int unused_sd;
+{
+   nsock_t *ns;
+   u_int ns_errno;
+   pid_t cpid, ppid = getpid();
+   fd_set rd;
+   struct timeval tv;
+   int sd;
+   
+   if (unixsock_is(opts.metrics))
+     {
+	if (!(ns = unixsock_listen(opts.metrics, SOCK_STREAM, 16)))
+	  {
+	     if (opts.verbosity > 0)
+	       fprintf(stderr, "metrics: %s: %s\n", opts.metrics, strerror(errno));
+	     return -1;
+	  }
+     }
+   else if (!(ns = nsock_listen_init(opts.family == PF_UNSPEC ? PF_INET : opts.family,
+				     SOCK_STREAM, opts.metrics, 16,
+				     NSF_REUSE_ADDR | NSF_NO_REVERSE_NAME
+				     | (opts.family == PF_UNSPEC ? 0 : NSF_USE_FAMILY_HINT),
+				     &ns_errno)))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "metrics: %s\n", nsock_strerror_full_n(ns_errno));
+	return -1;
+     }
+   
+   if ((cpid = fork()) != 0)
+     {
+	nsock_free(&ns);
+	return cpid;
+     }
+   
+   close(unused_sd);
+   signal(SIGCHLD, SIG_DFL);
+   signal(SIGPIPE, SIG_IGN);
+   
+   /* start with a full window so the rate is right from the start */
+   for (rate_pos = 0; rate_pos < STATS_RATE_WINDOW; rate_pos++)
+     {
+	rate_accepts[rate_pos] = stats->accepts;
+	rate_time[rate_pos] = stats_now() / 1000000;
+     }
+   rate_pos = 0;
+   
+   /* wake up every second to sample the accept rate */
+   while (getppid() == ppid)
+     {
+	FD_ZERO(&rd);
+	FD_SET(ns->sd, &rd);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	switch (select(ns->sd + 1, &rd, NULL, NULL, &tv))
+	  {
+	   case -1:
+	     if (errno != EINTR)
+	       exit(1);
+	     break;
+	     
+	   case 0:
+	     stats_sample();
+	     break;
+	     
+	   default:
+	     if ((sd = accept(ns->sd, NULL, NULL)) != -1)
+	       stats_serve(sd);
+	     break;
+	  }
+     }
+   unixsock_unlink(ns);
+   exit(0);
+}
+
+
+/*
+ * remember the accept counter once a second
+ */
+static void
+stats_sample(void)
+{
+   rate_pos = (rate_pos + 1) % STATS_RATE_WINDOW;
+   rate_accepts[rate_pos] = stats->accepts;
+   rate_time[rate_pos] = stats_now() / 1000000;
+}
+
+
+/*
+ * accepts per second over the sampling window
+ */
+static double
+stats_accept_rate(void)
+{
+   u_int oldest = (rate_pos + 1) % STATS_RATE_WINDOW;
+   time_t now = stats_now() / 1000000;
+   
+   if (now <= rate_time[oldest])
+     return 0.0;
+   return (double)(stats->accepts - rate_accepts[oldest])
+     / (double)(now - rate_time[oldest]);
+}
+
+
+/*
+ * answer one scrape.  the request itself doesn't matter, every path
+ * gets the metrics.
+ */
+static void
+stats_serve(sd)
+   int sd;
+{
+   char req[2048];
+   size_t have = 0;
+   ssize_t len;
+   fd_set rd;
+   struct timeval tv;
+   FILE *fp;
+   u_int i;
+   
+   /* read the request headers, but don't wait forever for them */
+   tv.tv_sec = 1;
+   tv.tv_usec = 0;
+   while (have < sizeof(req) - 1)
+     {
+	FD_ZERO(&rd);
+	FD_SET(sd, &rd);
+	if (select(sd + 1, &rd, NULL, NULL, &tv) < 1
+	    || (len = read(sd, req + have, sizeof(req) - 1 - have)) < 1)
+	  break;
+	have += len;
+	req[have] = '\0';
+	if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+	  break;
+     }
+   
+   if (!(fp = fdopen(sd, "w")))
+     {
+	close(sd);
+	return;
+     }
+   fprintf(fp,
+	   "HTTP/1.0 200 OK\r\n"
+	   "Content-Type: text/plain; version=0.0.4\r\n"
+	   "Connection: close\r\n"
+	   "\r\n");
+   
+   stats_print(fp, "nsc_sessions_active", "Sessions currently being relayed.",
+	       "gauge", stats->sessions_active);
+   stats_print(fp, "nsc_sessions_total", "Sessions relayed since startup.",
+	       "counter", stats->sessions_total);
+   stats_print(fp, "nsc_accepts_total", "Connections accepted by the listener.",
+	       "counter", stats->accepts);
+   fprintf(fp,
+	   "# HELP nsc_accepts_per_second Accept rate over the last %u seconds.\n"
+	   "# TYPE nsc_accepts_per_second gauge\n"
+	   "nsc_accepts_per_second %.3f\n",
+	   STATS_RATE_WINDOW, stats_accept_rate());
+   stats_print(fp, "nsc_pipe_connect_failures_total", "Failed connections to pipe hosts.",
+	       "counter", stats->pipe_connect_failures);
+   stats_print(fp, "nsc_buffers_refused_total", "Buffers refused because of the -A cap.",
+	       "counter", stats->pool_refused);
+   stats_print(fp, "nsc_timeouts_total", "Sessions ended by one of the -I timeouts.",
+	       "counter", stats->timeouts);
+   
+   fprintf(fp,
+	   "# HELP nsc_bytes_total Bytes relayed, by direction.\n"
+	   "# TYPE nsc_bytes_total counter\n"
+	   "nsc_bytes_total{direction=\"in\"} %lu\n"
+	   "nsc_bytes_total{direction=\"out\"} %lu\n",
+	   stats->bytes[STATS_IN], stats->bytes[STATS_OUT]);
+   fprintf(fp,
+	   "# HELP nsc_buffer_full_total Times a relay buffer filled up, by direction.\n"
+	   "# TYPE nsc_buffer_full_total counter\n"
+	   "nsc_buffer_full_total{direction=\"in\"} %lu\n"
+	   "nsc_buffer_full_total{direction=\"out\"} %lu\n",
+	   stats->buffer_full[STATS_IN], stats->buffer_full[STATS_OUT]);
+   
+   fprintf(fp,
+	   "# HELP nsc_errors_total Errors, by libnsock NSERR_* code.\n"
+	   "# TYPE nsc_errors_total counter\n");
+   for (i = 0; i < STATS_MAX_ERRNO; i++)
+     if (stats->errors[i])
+       fprintf(fp, "nsc_errors_total{code=\"%u\"} %lu\n", i, stats->errors[i]);
+   
+   /* the histograms, in coarser buckets */
+   for (i = 0; i < HIST_COUNT; i++)
+     {
+	u_int b = 0, l;
+	u_long sum = 0;
+	
+	fprintf(fp,
+		"# HELP %s %s\n"
+		"# TYPE %s histogram\n",
+		hist_names[i], hist_help[i], hist_names[i]);
+	for (l = 0; l < sizeof(hist_le) / sizeof(hist_le[0]); l++)
+	  {
+	     for (; b < HIST_BUCKETS && stats_bucket_max(b) <= hist_le[l]; b++)
+	       sum += stats->hist[i][b];
+	     fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n",
+		     hist_names[i], hist_le[l] / 1000000.0, sum);
+	  }
+	fprintf(fp,
+		"%s_bucket{le=\"+Inf\"} %lu\n"
+		"%s_sum %.6f\n"
+		"%s_count %lu\n",
+		hist_names[i], stats->hist_count[i],
+		hist_names[i], stats->hist_sum[i] / 1000000.0,
+		hist_names[i], stats->hist_count[i]);
+     }
+   
+   backend_print_metrics(fp);
+   fclose(fp);
+}
+
+
+static void
+stats_print(fp, name, help, type, value)
+   FILE *fp;
+   char *name, *help, *type;
+   u_long value;
+{
+   fprintf(fp,
+	   "# HELP %s %s\n"
+	   "# TYPE %s %s\n"
+	   "%s %lu\n",
+	   name, help, name, type, name, value);
+}
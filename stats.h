@@ -0,0 +1,64 @@
+/*
+ * counters shared by every session, and a metrics endpoint to read them
+ */
+#ifndef __nsc_stats_h
+#define __nsc_stats_h
+
+#define STATS_IN 	0 	/* from the connection to the local side */
+#define STATS_OUT 	1 	/* from the local side to the connection */
+
+/* NSERR_* codes beyond this are lumped together in the last slot */
+#define STATS_MAX_ERRNO 	64
+
+/* latency histograms, all in microseconds */
+#define HIST_ACCEPT 		0 	/* accepting a client (incl. SSL) */
+#define HIST_CONNECT 		1 	/* connecting out (incl. SSL) */
+#define HIST_FIRST_BYTE 	2 	/* session start to first byte relayed */
+#define HIST_RELAY 		3 	/* time data sat in a relay buffer */
+#define HIST_KERNEL_RX 		4 	/* kernel receive queue (-y) */
+#define HIST_KERNEL_TX 		5 	/* kernel send queue (-y) */
+#define HIST_HOP 		6 	/* kernel in to kernel out (-y) */
+#define HIST_SESSION 		7 	/* a whole replayed session (-Y/-G) */
+#define HIST_COUNT 		8
+
+/* log-linear buckets: 2^HIST_SUB_BITS linear steps per power of two,
+ * good for about 6% precision over the whole 32 bit range */
+#define HIST_SUB_BITS 		4
+#define HIST_SUB 		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 		((32 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct __nsc_stats_stru
+{
+   u_long sessions_active;
+   u_long sessions_total;
+   u_long accepts;
+   u_long pipe_connect_failures;
+   u_long pool_refused;
+   u_long timeouts;
+   u_long bytes[2];
+   u_long buffer_full[2];
+   u_long errors[STATS_MAX_ERRNO];
+   
+   u_long hist[HIST_COUNT][HIST_BUCKETS];
+   u_long hist_count[HIST_COUNT];
+   u_int64_t hist_sum[HIST_COUNT];
+} stats_t;
+
+extern stats_t *stats;
+extern u_int64_t stats_session_start;
+
+/* all of these do nothing unless stats_init() was called */
+#define STAT_INC(f) 	do { if (stats) SHARED_INC(stats->f); } while (0)
+#define STAT_DEC(f) 	do { if (stats) SHARED_DEC(stats->f); } while (0)
+#define STAT_ADD(f, n) 	do { if (stats) SHARED_ADD(stats->f, (n)); } while (0)
+
+int stats_init(void);
+void stats_error(u_int);
+u_int64_t stats_now(void);
+u_int64_t stats_wall(void);
+void stats_sleep(u_int64_t);
+void stats_record(u_int, u_int64_t);
+void stats_report(void);
+pid_t stats_start_server(int);
+
+#endif
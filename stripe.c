@@ -0,0 +1,791 @@
+/*
+ * one stream striped over several connections.
+ *
+ * with -P both ends open (or accept) a group of connections and cut
+ * what they read locally into numbered chunks.  each chunk goes to the
+ * connection with the least queued, so faster paths carry more, and
+ * the far end puts them back in order.  a single tcp stream can not
+ * fill a long fat link, a handful of them can.
+ *
+ * the side whose input ends sends an empty chunk and shuts its
+ * connections for writing.  the far end passes that on as a half-close
+ * and keeps sending until its own input ends, and the session is over
+ * once both ends have sent their marker and every connection has hung
+ * up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "stripe.h"
+
+
+/* connections waiting for the rest of their group (listen side) */
+typedef struct __nsc_stripe_group_stru
+{
+   u_char id[8];
+   u_int count; 		/* 0 when the slot is free */
+   u_int have;
+   int sd[STRIPE_MAX];
+   time_t started;
+} group_t;
+
+/* accepted, the hello not all here yet (listen side) */
+typedef struct __nsc_stripe_greet_stru
+{
+   nsock_t *ns; 		/* NULL when the slot is free */
+   u_int64_t due;
+   u_char hello[STRIPE_HELLO_LEN];
+   u_int got;
+} greet_t;
+
+
+static stripe_conn_t conns[STRIPE_MAX];
+static nsock_t *extra[STRIPE_MAX]; 	/* connect side, besides the first */
+static u_int nconns;
+static group_t pending[STRIPE_PENDING];
+static greet_t greeting[STRIPE_GREETING];
+static chunk_t *freelist;
+
+
+static void stripe_hello(u_char *, u_char *, u_int, u_int);
+static int stripe_gather(nsock_t *, u_char *);
+static void stripe_reject(nsock_t *);
+static void stripe_expire(void);
+static void stripe_group_free(group_t *);
+static stripe_conn_t *stripe_pick(int);
+static void stripe_enqueue(stripe_conn_t *, chunk_t *);
+static int stripe_send(stripe_conn_t *);
+static int stripe_recv(stripe_conn_t *);
+static chunk_t *stripe_next(u_int32_t);
+static chunk_t *stripe_chunk(void);
+static void stripe_put_chunk(chunk_t *);
+static void stripe_put32(u_char *, u_int32_t);
+static u_int32_t stripe_get32(u_char *);
+
+
+/*
+ * open the rest of the group next to the first connection and say
+ * hello on each of them
+ */
+int
+stripe_connect(ns)
+   nsock_t *ns;
+{
+   u_char id[8], hello[STRIPE_HELLO_LEN];
+   u_int i;
+   int fd;
+
+   /* the id only has to tell groups apart on the listener */
+   if ((fd = open("/dev/urandom", O_RDONLY)) == -1
+       || read(fd, id, sizeof(id)) != sizeof(id))
+     {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	stripe_put32(id, tv.tv_sec ^ getpid());
+	stripe_put32(id + 4, tv.tv_usec);
+     }
+   if (fd != -1)
+     close(fd);
+
+   nconns = opts.stripe;
+   conns[0].sd = ns->sd;
+   for (i = 1; i < nconns; i++)
+     {
+	if (!(extra[i] = connect_to_host(opts.shost, opts.dhost, 0)))
+	  return -1;
+	conns[i].sd = extra[i]->sd;
+     }
+
+   for (i = 0; i < nconns; i++)
+     {
+	stripe_hello(hello, id, i, nconns);
+	if (write(conns[i].sd, hello, sizeof(hello)) != sizeof(hello))
+	  {
+	     if (opts.verbosity > 0)
+	       perror("stripe hello");
+	     return -1;
+	  }
+     }
+   return 0;
+}
+
+
+/*
+ * keep a new connection on the listener until its hello is in.
+ * returns -1 if too many are waiting already.
+ */
+int
+stripe_hold(cli)
+   nsock_t *cli;
+{
+   u_int i;
+
+   for (i = 0; i < STRIPE_GREETING; i++)
+     if (!greeting[i].ns)
+       {
+	  greeting[i].ns = cli;
+	  greeting[i].due = stats_now() + STRIPE_HELLO_WAIT * 1000000;
+	  greeting[i].got = 0;
+	  return 0;
+       }
+   return -1;
+}
+
+
+/*
+ * add the connections still saying hello to the listener's select()
+ * set.  returns the timeout for the first of them to run out of time,
+ * or NULL if none are waiting.  quiet ones and groups that never
+ * completed are given up on here.
+ */
+struct timeval *
+stripe_setfds(rd, maxfd, tv)
+   fd_set *rd;
+   int *maxfd;
+   struct timeval *tv;
+{
+   u_int64_t now = stats_now(), least = 0;
+   nsock_t *ns;
+   u_int i;
+
+   stripe_expire();
+   for (i = 0; i < STRIPE_GREETING; i++)
+     {
+	if (!(ns = greeting[i].ns))
+	  continue;
+	if (greeting[i].due <= now)
+	  {
+	     greeting[i].ns = NULL;
+	     stripe_reject(ns);
+	     continue;
+	  }
+	FD_SET(ns->sd, rd);
+	if (ns->sd > *maxfd)
+	  *maxfd = ns->sd;
+	if (!least || greeting[i].due - now < least)
+	  least = greeting[i].due - now;
+     }
+   if (!least)
+     return NULL;
+   tv->tv_sec = least / 1000000;
+   tv->tv_usec = least % 1000000;
+   return tv;
+}
+
+
+/*
+ * read what select() found of the hellos and file the connections that
+ * are done with the rest of their group.  returns the one that
+ * completed a group, which the session is started on, or NULL.
+ */
+nsock_t *
+stripe_hellos(rd)
+   fd_set *rd;
+{
+   greet_t *gr;
+   nsock_t *ns;
+   ssize_t len;
+   u_int i;
+
+   for (i = 0; i < STRIPE_GREETING; i++)
+     {
+	gr = &greeting[i];
+	if (!(ns = gr->ns) || !FD_ISSET(ns->sd, rd))
+	  continue;
+	len = recv(ns->sd, gr->hello + gr->got, STRIPE_HELLO_LEN - gr->got,
+		   MSG_DONTWAIT);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+	  continue;
+	if (len > 0 && (gr->got += len) < STRIPE_HELLO_LEN)
+	  continue;
+	
+	gr->ns = NULL;
+	switch (len < 1 ? -1 : stripe_gather(ns, gr->hello))
+	  {
+	   case -1:
+	     stripe_reject(ns);
+	     break;
+	     
+	   case 0:
+	     /* held until the rest of the group shows up */
+	     ns->sd = -1;
+	     nsock_free(&ns);
+	     break;
+	     
+	   default:
+	     return ns;
+	  }
+     }
+   return NULL;
+}
+
+
+/*
+ * file a connection with the rest of its group.  returns 1 once the
+ * group is complete, 0 if it is still waiting for others (the
+ * descriptor now belongs to the group) and -1 if this was not one of
+ * ours.
+ */
+static int
+stripe_gather(cli, hello)
+   nsock_t *cli;
+   u_char *hello;
+{
+   group_t *g = NULL;
+   u_int i, idx, count;
+
+   if (memcmp(hello, STRIPE_MAGIC, 3) || hello[3] != STRIPE_VERSION)
+     return -1;
+   idx = (hello[12] << 8) | hello[13];
+   count = (hello[14] << 8) | hello[15];
+   if (count != opts.stripe || idx >= count)
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "stripe: peer uses %u connections, we use %u\n",
+		  count, opts.stripe);
+	return -1;
+     }
+
+   for (i = 0; i < STRIPE_PENDING; i++)
+     {
+	if (pending[i].count && !memcmp(pending[i].id, hello + 4, 8))
+	  {
+	     g = &pending[i];
+	     break;
+	  }
+	if (!pending[i].count && !g)
+	  g = &pending[i];
+     }
+   if (!g || (g->count && g->sd[idx] != -1))
+     return -1;
+   if (!g->count)
+     {
+	memcpy(g->id, hello + 4, 8);
+	g->count = count;
+	g->have = 0;
+	g->started = stats_now() / 1000000;
+	for (i = 0; i < STRIPE_MAX; i++)
+	  g->sd[i] = -1;
+     }
+   g->sd[idx] = cli->sd;
+   if (++g->have < g->count)
+     return 0;
+
+   /* complete, this is the group the session will use */
+   nconns = g->count;
+   for (i = 0; i < nconns; i++)
+     conns[i].sd = g->sd[i];
+   g->count = 0;
+   return 1;
+}
+
+
+/*
+ * the listener forked a session off, it has no use for the group
+ */
+void
+stripe_drop(keep)
+   int keep;
+{
+   u_int i;
+
+   for (i = 0; i < nconns; i++)
+     if (conns[i].sd != keep)
+       close(conns[i].sd);
+   nconns = 0;
+}
+
+
+/*
+ * a session has no use for the groups still being gathered
+ */
+void
+stripe_drop_pending(void)
+{
+   u_int i;
+
+   for (i = 0; i < STRIPE_PENDING; i++)
+     if (pending[i].count)
+       stripe_group_free(&pending[i]);
+   for (i = 0; i < STRIPE_GREETING; i++)
+     if (greeting[i].ns)
+       nsock_free(&(greeting[i].ns));
+}
+
+
+/*
+ * move data between the group and a local pair of descriptors until
+ * one side is done
+ */
+int
+stripe_pipe(ns, in_sd, out_sd)
+   nsock_t *ns;
+   int in_sd, out_sd;
+{
+   struct pollfd pfd[STRIPE_MAX + 2];
+   int in_fl, out_fl, ret = NSERR_SUCCESS;
+   u_int32_t tx_seq = 0, rx_seq = 0;
+   u_char in_eof = 0, tx_done = 0, rx_done = 0;
+   stripe_conn_t *c;
+   chunk_t *out = NULL, *ch;
+   ssize_t len;
+   u_int i, neof;
+
+   for (i = 0; i < nconns; i++)
+     {
+	c = &conns[i];
+	fcntl(c->sd, F_SETFL, fcntl(c->sd, F_GETFL) | O_NONBLOCK);
+     }
+   in_fl = fcntl(in_sd, F_GETFL);
+   out_fl = fcntl(out_sd, F_GETFL);
+   fcntl(in_sd, F_SETFL, in_fl | O_NONBLOCK);
+   fcntl(out_sd, F_SETFL, out_fl | O_NONBLOCK);
+
+   while (1)
+     {
+	/* pass on whatever is next in line.  the end marker only means
+	 * the other side is done sending, what we have to say still goes */
+	if (!out && !rx_done)
+	  out = stripe_next(rx_seq);
+	if (out && out->len == STRIPE_HDR_LEN)
+	  {
+	     stripe_put_chunk(out);
+	     out = NULL;
+	     rx_seq++;
+	     rx_done = 1;
+	     shutdown(out_sd, SHUT_WR);
+	  }
+
+	neof = 0;
+	for (i = 0; i < nconns; i++)
+	  {
+	     c = &conns[i];
+	     pfd[i].fd = c->sd;
+	     pfd[i].events = 0;
+	     if (!c->eof && c->nrecv < STRIPE_QUEUE)
+	       pfd[i].events |= POLLIN;
+	     if (c->sendq)
+	       pfd[i].events |= POLLOUT;
+	     if (c->eof)
+	       neof++;
+	  }
+	pfd[nconns].fd = in_sd;
+	pfd[nconns].events = (!in_eof && stripe_pick(1)) ? POLLIN : 0;
+	pfd[nconns + 1].fd = out_sd;
+	pfd[nconns + 1].events = out ? POLLOUT : 0;
+	
+	/* a hangup is reported even when nothing was asked for */
+	for (i = 0; i < nconns + 2; i++)
+	  if (!pfd[i].events)
+	    pfd[i].fd = -1;
+
+	/* everyone hung up and there is nothing left to deliver.  the
+	 * other side waits for our marker after sending its own, hanging
+	 * up before it is only over if it never sent one */
+	if (neof == nconns && !out && (tx_done || !rx_done))
+	  {
+	     if (!rx_done)
+	       ret = nsock_error(ns, NSERR_READ_EOF);
+	     break;
+	  }
+
+	if (poll(pfd, nconns + 2, -1) == -1)
+	  {
+	     if (errno == EINTR)
+	       continue;
+	     ret = nsock_error(ns, NSERR_IOP_SELECT_FAILED);
+	     break;
+	  }
+
+	for (i = 0; i < nconns; i++)
+	  {
+	     c = &conns[i];
+	     if (pfd[i].revents & POLLOUT
+		 && stripe_send(c) == -1)
+	       {
+		  ret = nsock_error(ns, NSERR_WRITE_ERROR);
+		  goto done;
+	       }
+	     if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)
+		 && stripe_recv(c) == -1)
+	       {
+		  ret = nsock_error(ns, NSERR_READ_ERROR);
+		  goto done;
+	       }
+	  }
+
+	/* cut what came in locally into a chunk for the least busy
+	 * connection */
+	if (pfd[nconns].revents)
+	  {
+	     if (!(ch = stripe_chunk()))
+	       {
+		  ret = nsock_error(ns, NSERR_OUT_OF_MEMORY);
+		  break;
+	       }
+	     len = read(in_sd, ch->buf + STRIPE_HDR_LEN, STRIPE_CHUNK);
+	     if (len == -1 && (errno == EAGAIN || errno == EINTR))
+	       stripe_put_chunk(ch);
+	     else
+	       {
+		  if (len < 1)
+		    {
+		       in_eof = 1;
+		       len = 0;
+		    }
+		  stripe_put32(ch->buf, tx_seq++);
+		  stripe_put32(ch->buf + 4, len);
+		  ch->len = STRIPE_HDR_LEN + len;
+		  if (!(c = stripe_pick(!in_eof)))
+		    {
+		       stripe_put_chunk(ch);
+		       ret = nsock_error(ns, NSERR_WRITE_ERROR);
+		       break;
+		    }
+		  stripe_enqueue(c, ch);
+		  stripe_send(c);
+	       }
+	  }
+
+	if (out && pfd[nconns + 1].revents)
+	  {
+	     len = write(out_sd, out->buf + out->off, out->len - out->off);
+	     if (len == -1 && errno != EAGAIN && errno != EINTR)
+	       {
+		  ret = -1;
+		  break;
+	       }
+	     if (len > 0)
+	       {
+		  out->off += len;
+		  STAT_ADD(bytes[STATS_IN], len);
+	       }
+	     if (out->off == out->len)
+	       {
+		  stripe_put_chunk(out);
+		  out = NULL;
+		  rx_seq++;
+	       }
+	  }
+
+	/* once the end marker is out, stop writing but keep listening
+	 * until the other side has everything and hangs up */
+	if (in_eof && !tx_done)
+	  {
+	     for (i = 0; i < nconns && !conns[i].sendq; i++)
+	       ;
+	     if (i == nconns)
+	       {
+		  tx_done = 1;
+		  for (i = 0; i < nconns; i++)
+		    shutdown(conns[i].sd, SHUT_WR);
+	       }
+	  }
+     }
+
+ done:
+   fcntl(in_sd, F_SETFL, in_fl);
+   fcntl(out_sd, F_SETFL, out_fl);
+   if (out)
+     stripe_put_chunk(out);
+   for (i = 0; i < nconns; i++)
+     {
+	c = &conns[i];
+	while ((ch = c->sendq))
+	  {
+	     c->sendq = ch->next;
+	     stripe_put_chunk(ch);
+	  }
+	while ((ch = c->recvq))
+	  {
+	     c->recvq = ch->next;
+	     stripe_put_chunk(ch);
+	  }
+	if (c->rx)
+	  stripe_put_chunk(c->rx);
+
+	/* the first one is closed along with the nsock_t it came in */
+	if (extra[i])
+	  nsock_close(extra[i]);
+	else if (c->sd != ns->sd)
+	  close(c->sd);
+     }
+   nconns = 0;
+   while ((ch = freelist))
+     {
+	freelist = ch->next;
+	free(ch);
+     }
+   return ret;
+}
+
+
+static void
+stripe_hello(hello, id, idx, count)
+   u_char *hello, *id;
+   u_int idx, count;
+{
+   memcpy(hello, STRIPE_MAGIC, 3);
+   hello[3] = STRIPE_VERSION;
+   memcpy(hello + 4, id, 8);
+   hello[12] = idx >> 8;
+   hello[13] = idx;
+   hello[14] = count >> 8;
+   hello[15] = count;
+}
+
+
+/*
+ * a connection that didn't say a usable hello in time
+ */
+static void
+stripe_reject(ns)
+   nsock_t *ns;
+{
+   if (opts.verbosity > 0)
+     fprintf(stderr, "stripe: no usable hello from [%s]\n",
+	     reverse_host(ns, &(ns->inet_fin)));
+   nsock_free(&ns);
+}
+
+
+/*
+ * forget groups whose other connections never showed up
+ */
+static void
+stripe_expire(void)
+{
+   time_t now = stats_now() / 1000000;
+   u_int i;
+
+   for (i = 0; i < STRIPE_PENDING; i++)
+     if (pending[i].count
+	 && now - pending[i].started > STRIPE_GROUP_WAIT)
+       {
+	  if (opts.verbosity > 0)
+	    fprintf(stderr, "stripe: gave up on a group with %u of %u connections\n",
+		    pending[i].have, pending[i].count);
+	  stripe_group_free(&pending[i]);
+       }
+}
+
+
+static void
+stripe_group_free(g)
+   group_t *g;
+{
+   u_int i;
+
+   for (i = 0; i < g->count; i++)
+     if (g->sd[i] != -1)
+       close(g->sd[i]);
+   g->count = 0;
+}
+
+
+/*
+ * the connection with the least queued.  when full is set only ones
+ * that have room for another chunk count.  one the other side is done
+ * sending on can still be written to.
+ */
+static stripe_conn_t *
+stripe_pick(full)
+   int full;
+{
+   stripe_conn_t *best = NULL;
+   u_int i;
+
+   for (i = 0; i < nconns; i++)
+     {
+	if (full && conns[i].nsend >= STRIPE_QUEUE)
+	  continue;
+	if (!best || conns[i].queued < best->queued)
+	  best = &conns[i];
+     }
+   return best;
+}
+
+
+static void
+stripe_enqueue(c, ch)
+   stripe_conn_t *c;
+   chunk_t *ch;
+{
+   ch->next = NULL;
+   ch->off = 0;
+   if (c->sendq_tail)
+     c->sendq_tail->next = ch;
+   else
+     c->sendq = ch;
+   c->sendq_tail = ch;
+   c->nsend++;
+   c->queued += ch->len;
+}
+
+
+/*
+ * write as much of the queue as the connection takes
+ */
+static int
+stripe_send(c)
+   stripe_conn_t *c;
+{
+   chunk_t *ch;
+   ssize_t len;
+
+   while ((ch = c->sendq))
+     {
+	len = write(c->sd, ch->buf + ch->off, ch->len - ch->off);
+	if (len == -1)
+	  return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	ch->off += len;
+	c->queued -= len;
+	STAT_ADD(bytes[STATS_OUT], len);
+	if (ch->off < ch->len)
+	  return 0;
+
+	if (!(c->sendq = ch->next))
+	  c->sendq_tail = NULL;
+	c->nsend--;
+	stripe_put_chunk(ch);
+     }
+   return 0;
+}
+
+
+/*
+ * read the next piece of a chunk, the header first
+ */
+static int
+stripe_recv(c)
+   stripe_conn_t *c;
+{
+   chunk_t *ch;
+   size_t want;
+   ssize_t len;
+
+   if (!c->rx && !(c->rx = stripe_chunk()))
+     return -1;
+   ch = c->rx;
+   want = ch->off < STRIPE_HDR_LEN ? STRIPE_HDR_LEN : ch->len;
+   len = read(c->sd, ch->buf + ch->off, want - ch->off);
+   if (len == -1)
+     return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+   if (len == 0)
+     {
+	/* hanging up in the middle of a chunk is not */
+	c->eof = 1;
+	return ch->off ? -1 : 0;
+     }
+   ch->off += len;
+
+   if (ch->off == STRIPE_HDR_LEN)
+     {
+	ch->seq = stripe_get32(ch->buf);
+	ch->len = stripe_get32(ch->buf + 4);
+	if (ch->len > STRIPE_CHUNK)
+	  return -1;
+	ch->len += STRIPE_HDR_LEN;
+     }
+   if (ch->off < STRIPE_HDR_LEN || ch->off < ch->len)
+     return 0;
+
+   /* complete, it waits in line with the others from this connection */
+   ch->next = NULL;
+   ch->off = STRIPE_HDR_LEN;
+   if (c->recvq_tail)
+     c->recvq_tail->next = ch;
+   else
+     c->recvq = ch;
+   c->recvq_tail = ch;
+   c->nrecv++;
+   c->rx = NULL;
+   return 0;
+}
+
+
+/*
+ * take chunk seq off the connection it came in on.  each connection
+ * gets its chunks in order, so it can only be at the front of one.
+ */
+static chunk_t *
+stripe_next(seq)
+   u_int32_t seq;
+{
+   stripe_conn_t *c;
+   chunk_t *ch;
+   u_int i;
+
+   for (i = 0; i < nconns; i++)
+     {
+	c = &conns[i];
+	if (!(ch = c->recvq) || ch->seq != seq)
+	  continue;
+	if (!(c->recvq = ch->next))
+	  c->recvq_tail = NULL;
+	c->nrecv--;
+	return ch;
+     }
+   return NULL;
+}
+
+
+static chunk_t *
+stripe_chunk(void)
+{
+   chunk_t *ch;
+
+   if ((ch = freelist))
+     freelist = ch->next;
+   else if (!(ch = malloc(sizeof(chunk_t))))
+     return NULL;
+   ch->next = NULL;
+   ch->off = 0;
+   ch->len = 0;
+   return ch;
+}
+
+
+static void
+stripe_put_chunk(ch)
+   chunk_t *ch;
+{
+   ch->next = freelist;
+   freelist = ch;
+}
+
+
+static void
+stripe_put32(p, v)
+   u_char *p;
+   u_int32_t v;
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+
+static u_int32_t
+stripe_get32(p)
+   u_char *p;
+{
+   return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
@@ -0,0 +1,62 @@
+/*
+ * one stream striped over several connections (-P)
+ */
+#ifndef __nsc_stripe_h
+#define __nsc_stripe_h
+
+#define STRIPE_MAX 	32
+
+/* every connection starts with the magic, the version, a random id
+ * shared by the whole group, its index and the group size */
+#define STRIPE_MAGIC 	"NSS"
+#define STRIPE_VERSION 	0x01
+#define STRIPE_HELLO_LEN 16
+
+/* then chunks, each with a be32 sequence number and be32 length.  a
+ * chunk of length 0 ends the stream */
+#define STRIPE_HDR_LEN 	8
+#define STRIPE_CHUNK 	(64 * 1024)
+
+/* chunks queued on each connection, each way */
+#define STRIPE_QUEUE 	4
+
+/* how long the listener waits for a hello, and for the rest of a group */
+#define STRIPE_HELLO_WAIT 5
+#define STRIPE_GROUP_WAIT 30
+#define STRIPE_PENDING 	16
+
+/* connections the listener keeps waiting for their hello at once */
+#define STRIPE_GREETING 64
+
+typedef struct __nsc_stripe_chunk_stru
+{
+   struct __nsc_stripe_chunk_stru *next;
+   u_int32_t seq;
+   size_t len; 			/* header included */
+   size_t off; 			/* sent, received or delivered so far */
+   u_char buf[STRIPE_HDR_LEN + STRIPE_CHUNK];
+} chunk_t;
+
+typedef struct __nsc_stripe_conn_stru
+{
+   int sd;
+   u_char eof;
+
+   chunk_t *sendq, *sendq_tail;
+   u_int nsend;
+   size_t queued; 		/* bytes waiting in sendq */
+
+   chunk_t *rx; 		/* chunk being read */
+   chunk_t *recvq, *recvq_tail;
+   u_int nrecv;
+} stripe_conn_t;
+
+int stripe_connect(nsock_t *);
+int stripe_hold(nsock_t *);
+struct timeval *stripe_setfds(fd_set *, int *, struct timeval *);
+nsock_t *stripe_hellos(fd_set *);
+void stripe_drop(int);
+void stripe_drop_pending(void);
+int stripe_pipe(nsock_t *, int, int);
+
+#endif
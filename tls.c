@@ -0,0 +1,201 @@
+/*
+ * SSL handshakes done by nsc itself.
+ *
+ * left to libnsock the handshake happens inside nsock_accept(), so a -L
+ * or -F listener would sit in it until the client finished (or never,
+ * if it doesn't) and nobody else got accepted meanwhile.  instead the
+ * listener only accepts and the session's own process does the
+ * handshake once it has forked, so its cost and any stalling is kept
+ * to that session and the crypto is spread over every cpu.
+ *
+ * the socket is non-blocking for the handshake, which is driven from
+ * select() until it is done or -w (or TLS_TIMEOUT) secs have passed.
+ * contexts are made once, the listener's before any session forks, so
+ * certificates and keys are not read again for every session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "tls.h"
+
+#ifdef HAVE_SSL
+
+#include <openssl/err.h>
+
+
+static tls_ctx_t ctxs[TLS_CTX_MAX];
+static u_int nctxs = 0;
+
+static int tls_handshake(nsock_t *, SSL_CTX *, u_char);
+
+
+/*
+ * the context for this cert and key, made the first time it is asked
+ * for.  returns NULL if they can't be loaded.
+ */
+SSL_CTX *
+tls_ctx(cert, key, server)
+   u_char *cert, *key;
+   u_char server;
+{
+   SSL_CTX *ctx;
+   u_int i;
+
+   for (i = 0; i < nctxs; i++)
+     if (ctxs[i].cert == cert && ctxs[i].key == key
+	 && ctxs[i].server == server)
+       return ctxs[i].ctx;
+
+   if (nctxs == 0)
+     {
+	SSL_library_init();
+	SSL_load_error_strings();
+     }
+   if (!(ctx = SSL_CTX_new(server ? SSLv23_server_method()
+			   : SSLv23_client_method())))
+     return NULL;
+   if (cert
+       && (SSL_CTX_use_certificate_file(ctx, (char *)cert, SSL_FILETYPE_PEM) != 1
+	   || SSL_CTX_use_PrivateKey_file(ctx, (char *)(key ? key : cert),
+					  SSL_FILETYPE_PEM) != 1))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "error: %s: %s\n", cert,
+		  ERR_error_string(ERR_get_error(), NULL));
+	SSL_CTX_free(ctx);
+	return NULL;
+     }
+
+   /* more than that are just not kept */
+   if (nctxs < TLS_CTX_MAX)
+     {
+	ctxs[nctxs].cert = cert;
+	ctxs[nctxs].key = key;
+	ctxs[nctxs].server = server;
+	ctxs[nctxs].ctx = ctx;
+	nctxs++;
+     }
+   return ctx;
+}
+
+
+/*
+ * the server side of a handshake on an accepted client
+ */
+int
+tls_accept(ns, cert, key)
+   nsock_t *ns;
+   u_char *cert, *key;
+{
+   SSL_CTX *ctx;
+
+   if (!(ctx = tls_ctx(cert, key, 1)))
+     return -1;
+   return tls_handshake(ns, ctx, 1);
+}
+
+
+/*
+ * the client side, once connected
+ */
+int
+tls_connect(ns, cert, key)
+   nsock_t *ns;
+   u_char *cert, *key;
+{
+   SSL_CTX *ctx;
+
+   if (!(ctx = tls_ctx(cert, key, 0)))
+     return -1;
+   return tls_handshake(ns, ctx, 0);
+}
+
+
+/*
+ * run the handshake from select() until it is done or out of time.  on
+ * success the nsock is marked as SSL and the rest goes through it.
+ */
+static int
+tls_handshake(ns, ctx, server)
+   nsock_t *ns;
+   SSL_CTX *ctx;
+   u_char server;
+{
+   struct timeval tv;
+   fd_set fds;
+   SSL *ssl;
+   u_int64_t now, end;
+   int fl, ret, err = SSL_ERROR_NONE;
+
+   if (!(ssl = SSL_new(ctx)) || SSL_set_fd(ssl, ns->sd) != 1)
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
+	if (ssl)
+	  SSL_free(ssl);
+	return -1;
+     }
+
+   fl = fcntl(ns->sd, F_GETFL);
+   fcntl(ns->sd, F_SETFL, fl | O_NONBLOCK);
+   end = stats_now()
+     + (u_int64_t)(opts.connect_timeout ? opts.connect_timeout : TLS_TIMEOUT)
+     * 1000000;
+
+   while ((ret = server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1)
+     {
+	err = SSL_get_error(ssl, ret);
+	if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+	  break;
+	if ((now = stats_now()) >= end)
+	  break;
+
+	tv.tv_sec = (end - now) / 1000000;
+	tv.tv_usec = (end - now) % 1000000;
+	FD_ZERO(&fds);
+	FD_SET(ns->sd, &fds);
+	select(ns->sd + 1,
+	       err == SSL_ERROR_WANT_READ ? &fds : NULL,
+	       err == SSL_ERROR_WANT_WRITE ? &fds : NULL,
+	       NULL, &tv);
+     }
+   fcntl(ns->sd, F_SETFL, fl);
+
+   if (ret != 1)
+     {
+	if (opts.verbosity > 0)
+	  {
+	     if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	       fprintf(stderr, "SSL handshake timed out\n");
+	     else
+	       fprintf(stderr, "SSL handshake failed: %s\n",
+		       ERR_peek_error()
+		       ? ERR_error_string(ERR_get_error(), NULL)
+		       : "connection closed");
+	  }
+	SSL_free(ssl);
+	return -1;
+     }
+
+#ifdef SSL_MODE_AUTO_RETRY
+   /* io_pipe reads once for each time select() wakes it.  a record with
+    * no data in it (tls 1.3 sends session tickets after the handshake)
+    * would otherwise leave SSL_read() blocked waiting for the next one */
+   SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+#endif
+   ns->ns_ssl.ssl = ssl;
+   ns->opt |= NSF_USE_SSL;
+   return 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * SSL handshakes done by nsc itself, without blocking
+ */
+#ifndef __nsc_tls_h
+#define __nsc_tls_h
+
+#ifdef HAVE_SSL
+
+/* secs a handshake may take when -w doesn't say */
+#define TLS_TIMEOUT 	10
+
+/* contexts kept, one per cert, key and role */
+#define TLS_CTX_MAX 	8
+
+typedef struct __nsc_tls_ctx_stru
+{
+   u_char *cert;
+   u_char *key;
+   u_char server;
+   SSL_CTX *ctx;
+} tls_ctx_t;
+
+SSL_CTX *tls_ctx(u_char *, u_char *, u_char);
+int tls_accept(nsock_t *, u_char *, u_char *);
+int tls_connect(nsock_t *, u_char *, u_char *);
+
+#endif
+
+#endif
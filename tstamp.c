@@ -0,0 +1,284 @@
+/*
+ * kernel timestamps on relayed data.
+ *
+ * with -y the relay sockets get SO_TIMESTAMPING.  reads come with the
+ * time the kernel received the data, and every write asks for the time
+ * the kernel handed its last byte to the device.  together with the time
+ * data waits in nsc's own buffers (which -T and -M already show) that
+ * splits the latency of a hop into the receive queue, nsc and the send
+ * queue, and the hop as a whole.
+ *
+ * transmit timestamps come back through the socket error queue keyed
+ * by byte offset, so writes are remembered until theirs shows up.  the
+ * kernel may fold several writes into one timestamp, in which case all
+ * the writes up to that offset are done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "stats.h"
+#include "tstamp.h"
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#define HAVE_TSTAMP
+#endif
+
+
+#ifdef HAVE_TSTAMP
+static u_int64_t ts_usecs(struct timespec *);
+static void ts_done(ts_t *, u_int32_t, u_int64_t);
+#endif
+
+
+/*
+ * turn on timestamping for a tcp socket
+ */
+ts_t *
+ts_new(sd)
+   int sd;
+{
+#ifdef HAVE_TSTAMP
+   ts_t *ts;
+   int val;
+   socklen_t vlen = sizeof(val);
+
+   /* byte offsets only make sense for tcp */
+   if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &val, &vlen) == -1
+       || val != SOCK_STREAM)
+     {
+	errno = EPROTONOSUPPORT;
+	return NULL;
+     }
+   vlen = sizeof(val);
+   if (getsockopt(sd, SOL_SOCKET, SO_DOMAIN, &val, &vlen) == -1
+       || (val != AF_INET && val != AF_INET6))
+     {
+	errno = EPROTONOSUPPORT;
+	return NULL;
+     }
+
+   val = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+     | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID
+     | SOF_TIMESTAMPING_OPT_TSONLY;
+   if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)) == -1)
+     return NULL;
+   if (!(ts = calloc(1, sizeof(ts_t))))
+     return NULL;
+   ts->sd = sd;
+   return ts;
+#else
+   errno = ENOSYS;
+   return NULL;
+#endif
+}
+
+
+void
+ts_free(ts)
+   ts_t *ts;
+{
+   free(ts);
+}
+
+
+/*
+ * read(), but also find out when the kernel got the data.  *whenp is
+ * left at 0 if it didn't say.
+ */
+ssize_t
+ts_read(ts, buf, len, whenp)
+   ts_t *ts;
+   u_char *buf;
+   size_t len;
+   u_int64_t *whenp;
+{
+#ifdef HAVE_TSTAMP
+   u_char control[256];
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cm;
+   struct scm_timestamping *tss;
+   ssize_t ret;
+   u_int64_t now;
+
+   *whenp = 0;
+   iov.iov_base = buf;
+   iov.iov_len = len;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   if ((ret = recvmsg(ts->sd, &msg, 0)) < 1)
+     return ret;
+
+   for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+     if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+       {
+	  tss = (struct scm_timestamping *)CMSG_DATA(cm);
+	  *whenp = ts_usecs(&tss->ts[0]);
+       }
+   if (*whenp && stats)
+     {
+	now = stats_wall();
+	if (now > *whenp)
+	  stats_record(HIST_KERNEL_RX, now - *whenp);
+     }
+   return ret;
+#else
+   *whenp = 0;
+   return read(ts->sd, buf, len);
+#endif
+}
+
+
+/*
+ * remember a write until its transmit timestamp comes back.  written is
+ * taken before the write, a fast device may stamp it before it returns.
+ * received is when the kernel got the oldest of the data (0 if unknown).
+ */
+void
+ts_sent(ts, len, written, received)
+   ts_t *ts;
+   size_t len;
+   u_int64_t written, received;
+{
+   ts_send_t *s;
+
+   if (len == 0)
+     return;
+   ts->sent += len;
+
+   /* timestamps that never came, forget the oldest */
+   if (ts->count == TS_PENDING)
+     {
+	ts->head = (ts->head + 1) % TS_PENDING;
+	ts->count--;
+     }
+   s = &(ts->pending[(ts->head + ts->count) % TS_PENDING]);
+   s->key = ts->sent - 1;
+   s->written = written;
+   s->received = received;
+   ts->count++;
+}
+
+
+/*
+ * read the transmit timestamps that are queued.  returns how many
+ * writes they covered, or -1 on error.
+ */
+int
+ts_reap(ts)
+   ts_t *ts;
+{
+#ifdef HAVE_TSTAMP
+   u_char control[256];
+   struct msghdr msg;
+   struct cmsghdr *cm;
+   struct sock_extended_err *serr;
+   struct scm_timestamping *tss;
+   u_int64_t when;
+   u_int32_t key;
+   u_char have_key;
+   u_int before = ts->count;
+   int save = errno;
+
+   while (ts->count > 0)
+     {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(ts->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+	  {
+	     if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	       {
+		  errno = save;
+		  break;
+	       }
+	     return -1;
+	  }
+
+	/* the time and the key are in separate control messages */
+	when = 0;
+	key = 0;
+	have_key = 0;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+	  {
+	     if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+	       {
+		  tss = (struct scm_timestamping *)CMSG_DATA(cm);
+		  when = ts_usecs(&tss->ts[0]);
+	       }
+	     else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+		      || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+	       {
+		  serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		  if (serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING
+		      && serr->ee_info == SCM_TSTAMP_SND)
+		    {
+		       key = serr->ee_data;
+		       have_key = 1;
+		    }
+	       }
+	  }
+	if (when && have_key)
+	  ts_done(ts, key, when);
+     }
+   return before - ts->count;
+#else
+   return 0;
+#endif
+}
+
+
+#ifdef HAVE_TSTAMP
+/*
+ * every write up to key went out at when
+ */
+static void
+ts_done(ts, key, when)
+   ts_t *ts;
+   u_int32_t key;
+   u_int64_t when;
+{
+   ts_send_t *s;
+
+   while (ts->count > 0)
+     {
+	s = &(ts->pending[ts->head]);
+	if ((int32_t)(s->key - key) > 0)
+	  break;
+	if (stats)
+	  {
+	     if (when > s->written)
+	       stats_record(HIST_KERNEL_TX, when - s->written);
+	     if (s->received && when > s->received)
+	       stats_record(HIST_HOP, when - s->received);
+	  }
+	ts->head = (ts->head + 1) % TS_PENDING;
+	ts->count--;
+     }
+}
+
+
+static u_int64_t
+ts_usecs(tv)
+   struct timespec *tv;
+{
+   return (u_int64_t)tv->tv_sec * 1000000 + tv->tv_nsec / 1000;
+}
+#endif
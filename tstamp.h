@@ -0,0 +1,31 @@
+/*
+ * kernel timestamps on relayed data (-y)
+ */
+#ifndef __nsc_tstamp_h
+#define __nsc_tstamp_h
+
+/* writes waiting for their transmit timestamp */
+#define TS_PENDING 	256
+
+typedef struct __nsc_ts_send_stru
+{
+   u_int32_t key; 		/* offset of the last byte written */
+   u_int64_t written; 		/* when nsc wrote it */
+   u_int64_t received; 		/* when the kernel got the oldest of it */
+} ts_send_t;
+
+typedef struct __nsc_ts_stru
+{
+   int sd;
+   u_int32_t sent; 		/* bytes written since timestamping began */
+   ts_send_t pending[TS_PENDING];
+   u_int head, count;
+} ts_t;
+
+ts_t *ts_new(int);
+void ts_free(ts_t *);
+ssize_t ts_read(ts_t *, u_char *, size_t, u_int64_t *);
+void ts_sent(ts_t *, size_t, u_int64_t, u_int64_t);
+int ts_reap(ts_t *);
+
+#endif
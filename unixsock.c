@@ -0,0 +1,300 @@
+/*
+ * unix domain socket end points.
+ *
+ * libnsock only knows about inet sockets, so these are set up by hand
+ * and then wrapped in an nsock_t so the rest of nsc can treat them like
+ * any other connection.  a path starting with '@' lives in the abstract
+ * namespace (linux only).
+ */
+
+#include <nsock/nsock.h>
+#include <nsock/errors.h>
+
+#include "nsc.h"
+#include "unixsock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+static nsock_t *unixsock_new(int);
+static int unixsock_in_use(struct sockaddr_un *, socklen_t, int);
+
+
+/*
+ * is this host one of ours?
+ */
+int
+unixsock_is(host)
+   u_char *host;
+{
+   return host && !strncmp((char *)host, UNIXSOCK_PREFIX, strlen(UNIXSOCK_PREFIX));
+}
+
+
+/*
+ * bind to a path and start listening on it (stream sockets only)
+ */
+nsock_t *
+unixsock_listen(host, type, backlog)
+   u_char *host;
+   int type, backlog;
+{
+   nsock_t *ns;
+   struct sockaddr_un *sa_un;
+   socklen_t len;
+   struct stat st;
+   
+   if (!(ns = unixsock_new(type)))
+     return NULL;
+   if (unixsock_addr(host, &(ns->inet_fin), &len) == -1)
+     {
+	nsock_close(ns);
+	return NULL;
+     }
+   
+   /* a socket left behind by an earlier listener is in the way, one
+    * that somebody is still listening on is not ours to take */
+   sa_un = (struct sockaddr_un *)&(ns->inet_fin);
+   if (sa_un->sun_path[0] != '\0'
+       && stat(sa_un->sun_path, &st) == 0
+       && S_ISSOCK(st.st_mode))
+     switch (unixsock_in_use(sa_un, len, type))
+       {
+	case 1:
+	  nsock_close(ns);
+	  errno = EADDRINUSE;
+	  return NULL;
+	case 0:
+	  unlink(sa_un->sun_path);
+	  break;
+       }
+   
+   if (bind(ns->sd, (struct sockaddr *)&(ns->inet_fin), len) == -1
+       || (type == SOCK_STREAM && listen(ns->sd, backlog) == -1))
+     {
+	int save_errno = errno;
+	
+	nsock_close(ns);
+	errno = save_errno;
+	return NULL;
+     }
+   return ns;
+}
+
+
+/*
+ * try connecting to a socket found at the path.  returns 1 if something
+ * answered, 0 if nothing is listening there any more, or -1 if that
+ * can't be told (which leaves the path alone).
+ */
+static int
+unixsock_in_use(sa_un, len, type)
+   struct sockaddr_un *sa_un;
+   socklen_t len;
+   int type;
+{
+   int sd, ret = -1;
+   
+   if ((sd = socket(PF_UNIX, type, 0)) == -1)
+     return -1;
+   if (connect(sd, (struct sockaddr *)sa_un, len) == 0)
+     ret = 1;
+   else if (errno == ECONNREFUSED)
+     ret = 0;
+   close(sd);
+   return ret;
+}
+
+
+/*
+ * accept a client on a unix listener
+ */
+int
+unixsock_accept(listener, cli)
+   nsock_t *listener, *cli;
+{
+   socklen_t len = sizeof(cli->inet_fin);
+   
+   if (cli->sd != -1)
+     close(cli->sd);
+   memset(&(cli->inet_fin), 0, sizeof(cli->inet_fin));
+   cli->sd = accept(listener->sd, (struct sockaddr *)&(cli->inet_fin), &len);
+   if (cli->sd == -1)
+     return nsock_error(listener, NSERR_READ_ERROR);
+   return NSERR_SUCCESS;
+}
+
+
+/*
+ * a datagram listener talks back to whoever sent the first datagram.
+ * that only works if the sender bound an address.
+ */
+int
+unixsock_connect_back(ns, len)
+   nsock_t *ns;
+   socklen_t len;
+{
+   if (len <= offsetof(struct sockaddr_un, sun_path))
+     {
+	if (opts.verbosity > 0)
+	  fprintf(stderr, "unix datagram sender is unbound, replies are not possible\n");
+	return NSERR_SUCCESS;
+     }
+   if (connect(ns->sd, (struct sockaddr *)&(ns->inet_tin), len) == -1)
+     return nsock_error(ns, NSERR_WRITE_ERROR);
+   return NSERR_SUCCESS;
+}
+
+
+/*
+ * connect to a unix socket, optionally from a source path
+ */
+nsock_t *
+unixsock_connect(source, target, type)
+   u_char *source, *target;
+   int type;
+{
+   nsock_t *ns;
+   socklen_t len;
+   int save_errno;
+   
+   if (!(ns = unixsock_new(type)))
+     return NULL;
+   
+   if (source && unixsock_is(source))
+     {
+	if (unixsock_addr(source, &(ns->inet_fin), &len) == -1
+	    || bind(ns->sd, (struct sockaddr *)&(ns->inet_fin), len) == -1)
+	  goto fail;
+     }
+#ifdef __linux__
+   else if (type == SOCK_DGRAM)
+     {
+	/* datagram replies need an address to come back to, let the
+	 * kernel pick an abstract one */
+	ns->inet_fin.ss_family = AF_UNIX;
+	if (bind(ns->sd, (struct sockaddr *)&(ns->inet_fin), sizeof(sa_family_t)) == -1)
+	  goto fail;
+     }
+#endif
+   
+   if (unixsock_addr(target, &(ns->inet_tin), &len) == -1
+       || connect(ns->sd, (struct sockaddr *)&(ns->inet_tin), len) == -1)
+     goto fail;
+   return ns;
+   
+ fail:
+   save_errno = errno;
+   nsock_close(ns);
+   errno = save_errno;
+   return NULL;
+}
+
+
+/*
+ * remove the path a listener was bound to
+ */
+void
+unixsock_unlink(ns)
+   nsock_t *ns;
+{
+   struct sockaddr_un *sa_un = (struct sockaddr_un *)&(ns->inet_fin);
+   
+   if (sa_un->sun_family == AF_UNIX && sa_un->sun_path[0] != '\0')
+     unlink(sa_un->sun_path);
+}
+
+
+/*
+ * a printable name for a unix socket address
+ */
+u_char *
+unixsock_name(ss)
+   struct sockaddr_storage *ss;
+{
+   static char name[sizeof(((struct sockaddr_un *)0)->sun_path) + 1];
+   struct sockaddr_un *sa_un = (struct sockaddr_un *)ss;
+   
+   if (sa_un->sun_path[0] != '\0')
+     snprintf(name, sizeof(name), "%s", sa_un->sun_path);
+   else if (sa_un->sun_path[1] != '\0')
+     snprintf(name, sizeof(name), "@%s", sa_un->sun_path + 1);
+   else
+     strcpy(name, "unnamed");
+   return (u_char *)name;
+}
+
+
+/*
+ * get an nsock_t with a unix socket in it
+ */
+static nsock_t *
+unixsock_new(type)
+   int type;
+{
+   nsock_t *ns;
+   u_int ns_errno;
+   
+   if (!(ns = nsock_new(PF_UNIX, type, 0, &ns_errno)))
+     {
+	errno = ENOMEM;
+	return NULL;
+     }
+   if (ns->sd == -1
+       && (ns->sd = socket(PF_UNIX, type, 0)) == -1)
+     {
+	int save_errno = errno;
+	
+	nsock_close(ns);
+	errno = save_errno;
+	return NULL;
+     }
+   return ns;
+}
+
+
+/*
+ * turn unix:<path> or unix:@<name> into an address
+ */
+int
+unixsock_addr(host, ss, lenp)
+   u_char *host;
+   struct sockaddr_storage *ss;
+   socklen_t *lenp;
+{
+   struct sockaddr_un *sa_un = (struct sockaddr_un *)ss;
+   char *path = (char *)host + strlen(UNIXSOCK_PREFIX);
+   size_t plen = strlen(path);
+   
+   memset(ss, 0, sizeof(*ss));
+   sa_un->sun_family = AF_UNIX;
+   if (plen == 0 || plen >= sizeof(sa_un->sun_path))
+     {
+	errno = ENAMETOOLONG;
+	if (plen == 0)
+	  errno = EINVAL;
+	return -1;
+     }
+   memcpy(sa_un->sun_path, path, plen);
+   *lenp = offsetof(struct sockaddr_un, sun_path) + plen;
+   
+   if (*path == '@')
+     {
+#ifdef __linux__
+	sa_un->sun_path[0] = '\0';
+#else
+	errno = EAFNOSUPPORT;
+	return -1;
+#endif
+     }
+   else
+     *lenp += 1;
+   return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * unix domain socket end points
+ */
+#ifndef __nsc_unixsock_h
+#define __nsc_unixsock_h
+
+/* any host argument starting with this is a unix socket path */
+#define UNIXSOCK_PREFIX 	"unix:"
+
+int unixsock_is(u_char *);
+nsock_t *unixsock_listen(u_char *, int, int);
+int unixsock_accept(nsock_t *, nsock_t *);
+int unixsock_connect_back(nsock_t *, socklen_t);
+nsock_t *unixsock_connect(u_char *, u_char *, int);
+int unixsock_addr(u_char *, struct sockaddr_storage *, socklen_t *);
+void unixsock_unlink(nsock_t *);
+u_char *unixsock_name(struct sockaddr_storage *);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * MSG_ZEROCOPY sends to the remote.
+ *
+ * with -Z the relay buffers for a socket come from a pool.  a buffer
+ * sent with MSG_ZEROCOPY stays pinned until the kernel says (through
+ * the socket error queue) that it is done with it, so after each send
+ * the relay switches to a fresh buffer and the old one goes back to the
+ * pool once released.  the kernel counts zerocopy sends per socket and
+ * reports ranges of that count, which is how buffers are matched up.
+ *
+ * loopback and some drivers copy anyway.  when that keeps happening
+ * the pool falls back to normal sends, as the kernel docs suggest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <nsock/nsock.h>
+
+#include "nsc.h"
+#include "zerocopy.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY
+#endif
+
+
+/*
+ * turn on zerocopy for a socket and set up its buffers
+ */
+zc_t *
+zc_new(sd)
+   int sd;
+{
+#ifdef HAVE_ZEROCOPY
+   zc_t *zc;
+   int one = 1, i;
+
+   if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+     return NULL;
+   if (!(zc = calloc(1, sizeof(zc_t))))
+     return NULL;
+   if (!(zc->mem = calloc(ZC_BUFS, NSOCK_IOP_BLOCKSZ)))
+     {
+	free(zc);
+	return NULL;
+     }
+   for (i = 0; i < ZC_BUFS; i++)
+     zc->bufs[i].buf = zc->mem + i * NSOCK_IOP_BLOCKSZ;
+   zc->sd = sd;
+   zc->on = 1;
+   return zc;
+#else
+   errno = ENOSYS;
+   return NULL;
+#endif
+}
+
+
+/*
+ * done with the pool.  if the kernel still has some of it pinned, the
+ * memory is left alone rather than handed back to malloc.
+ */
+void
+zc_free(zc)
+   zc_t *zc;
+{
+   if (!zc)
+     return;
+   if (zc->inflight == 0)
+     free(zc->mem);
+   free(zc);
+}
+
+
+/*
+ * a buffer the relay can fill.  when all of them are pinned this waits
+ * for the kernel, much like a blocking write waits for socket space.
+ */
+u_char *
+zc_get(zc)
+   zc_t *zc;
+{
+   struct pollfd pfd;
+   int i;
+
+   while (1)
+     {
+	for (i = 0; i < ZC_BUFS; i++)
+	  if (zc->bufs[i].state == ZC_FREE)
+	    {
+	       zc->bufs[i].state = ZC_IN_USE;
+	       return zc->bufs[i].buf;
+	    }
+	if (zc->inflight == 0)
+	  return NULL;
+
+	/* the error queue shows up as POLLERR */
+	pfd.fd = zc->sd;
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+	  return NULL;
+	if (zc_reap(zc) == -1)
+	  return NULL;
+	if (pfd.revents & (POLLHUP | POLLNVAL) && !(pfd.revents & POLLERR))
+	  return NULL;
+     }
+}
+
+
+/*
+ * send from a pool buffer.  zc->pinned says whether the kernel kept a
+ * reference to it, in which case it must be retired rather than reused.
+ */
+ssize_t
+zc_send(zc, buf, len)
+   zc_t *zc;
+   u_char *buf;
+   size_t len;
+{
+   ssize_t ret;
+
+   zc->pinned = 0;
+#ifdef HAVE_ZEROCOPY
+   if (zc->on)
+     {
+	ret = send(zc->sd, buf, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+	if (ret > 0)
+	  {
+	     zc->seq++;
+	     zc->pinned = 1;
+	     return ret;
+	  }
+
+	/* out of option memory for notifications, copy this one */
+	if (ret == 0 || errno != ENOBUFS)
+	  return ret;
+     }
+#endif
+   ret = send(zc->sd, buf, len, MSG_NOSIGNAL);
+   return ret;
+}
+
+
+/*
+ * a buffer that was just sent goes back once the kernel lets go
+ */
+void
+zc_retire(zc, buf)
+   zc_t *zc;
+   u_char *buf;
+{
+   int i = (buf - zc->mem) / NSOCK_IOP_BLOCKSZ;
+
+   zc->bufs[i].state = ZC_PINNED;
+   zc->bufs[i].seq = zc->seq - 1;
+   zc->inflight++;
+}
+
+
+/*
+ * read whatever completions are queued and free their buffers.
+ * returns how many buffers came back, or -1 on error.
+ */
+int
+zc_reap(zc)
+   zc_t *zc;
+{
+#ifdef HAVE_ZEROCOPY
+   u_char control[128];
+   struct msghdr msg;
+   struct cmsghdr *cm;
+   struct sock_extended_err *serr;
+   u_int32_t lo, hi;
+   int i, freed = 0, save = errno;
+
+   while (zc->inflight > 0)
+     {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(zc->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+	  {
+	     /* an empty queue is not worth reporting */
+	     if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	       {
+		  errno = save;
+		  break;
+	       }
+	     return -1;
+	  }
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+	  {
+	     if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+		   || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+	       continue;
+	     serr = (struct sock_extended_err *)CMSG_DATA(cm);
+	     if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY
+		 || serr->ee_errno != 0)
+	       continue;
+
+	     /* sends lo through hi are done */
+	     lo = serr->ee_info;
+	     hi = serr->ee_data;
+	     for (i = 0; i < ZC_BUFS; i++)
+	       if (zc->bufs[i].state == ZC_PINNED
+		   && zc->bufs[i].seq - lo <= hi - lo)
+		 {
+		    zc->bufs[i].state = ZC_FREE;
+		    zc->inflight--;
+		    freed++;
+		 }
+
+	     /* the kernel copied after all, no point pinning pages */
+	     if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+	       {
+		  if (zc->on && ++zc->copied >= ZC_COPIED_MAX)
+		    {
+		       zc->on = 0;
+		       if (opts.verbosity > 1)
+			 fprintf(stderr, "zerocopy: the kernel copies anyway, sending normally\n");
+		    }
+	       }
+	     else
+	       zc->copied = 0;
+	  }
+     }
+   return freed;
+#else
+   return 0;
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * MSG_ZEROCOPY sends to the remote (-Z)
+ */
+#ifndef __nsc_zerocopy_h
+#define __nsc_zerocopy_h
+
+/* buffers each socket may have pinned by the kernel at once */
+#define ZC_BUFS 	64
+
+/* give up on zerocopy after this many sends in a row were copied */
+#define ZC_COPIED_MAX 	16
+
+#define ZC_FREE 	0
+#define ZC_IN_USE 	1 		/* handed out, ours to change */
+#define ZC_PINNED 	2 		/* sent, waiting for the kernel */
+
+typedef struct __nsc_zc_buf_stru
+{
+   u_char *buf;
+   u_int32_t seq; 		/* the send that pinned it */
+   u_char state;
+} zc_buf_t;
+
+typedef struct __nsc_zc_stru
+{
+   int sd;
+   u_char on; 			/* still sending with MSG_ZEROCOPY */
+   u_char pinned; 		/* the last send pinned its buffer */
+   u_int32_t seq; 		/* next send, as the kernel counts them */
+   u_int inflight;
+   u_int copied; 		/* completions in a row that were copied */
+
+   u_char *mem;
+   zc_buf_t bufs[ZC_BUFS];
+} zc_t;
+
+zc_t *zc_new(int);
+void zc_free(zc_t *);
+u_char *zc_get(zc_t *);
+ssize_t zc_send(zc_t *, u_char *, size_t);
+void zc_retire(zc_t *, u_char *);
+int zc_reap(zc_t *);
+
+#endif